@@ -0,0 +1,42 @@
+# Generates the duty cycle tables played by timer_waveform_play(), written to
+# stdout as C source. Values are in units of TIMER_PWM_FULL_SCALE, as words
+# since the DMA writes them whole into TIM2's 32-bit compare register.
+
+import math
+
+PWM_FULL_SCALE = 1000 # must match TIMER_PWM_FULL_SCALE in inc/timer.h
+GAMMA = 2.2 # perceived brightness is roughly linear in duty ** (1 / GAMMA)
+
+BREATHE_LENGTH = 128
+
+
+def gamma_correct(brightness):
+    return round(PWM_FULL_SCALE * (brightness ** GAMMA))
+
+
+def breathe(length):
+    # one raised cosine, from off to full brightness and back
+    return [gamma_correct((1 - math.cos(2 * math.pi * i / length)) / 2)
+            for i in range(length)]
+
+
+def emit_table(name, values):
+    print(f"const uint32_t {name}[{len(values)}] = {{")
+    for i in range(0, len(values), 12):
+        row = ", ".join(f"{value:4d}" for value in values[i:i + 12])
+        print(f"    {row},")
+    print("};")
+    print(f"const uint16_t {name}_length = {len(values)};")
+    print()
+
+
+print("// generated by gen-waveforms.py, do not edit")
+print()
+print('#include "timer.h"')
+print('#include "waveforms.h"')
+print()
+print(f"#if TIMER_PWM_FULL_SCALE != {PWM_FULL_SCALE}")
+print("#error \"gen-waveforms.py is out of step with TIMER_PWM_FULL_SCALE\"")
+print("#endif")
+print()
+emit_table("waveform_breathe", breathe(BREATHE_LENGTH))
@@ -1,4 +1,11 @@
 #pragma once
 
+#include "common.h"
+
+#define TIMER_PWM_FULL_SCALE (1000) // compare value for a 100% duty cycle
+
 void timer_setup(void);
-void timer_pwm_set_duty_cycle(float duty_cycle);
\ No newline at end of file
+void timer_pwm_set_duty_cycle(float duty_cycle);
+void timer_waveform_play(const uint32_t* table, uint16_t length, 
+    uint32_t sample_rate);
+void timer_waveform_stop(void);
\ No newline at end of file
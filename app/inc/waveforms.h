@@ -0,0 +1,9 @@
+#pragma once
+
+#include "common.h"
+
+// duty cycle tables in units of TIMER_PWM_FULL_SCALE, generated at build time
+// by gen-waveforms.py, for playback with timer_waveform_play(). Words, as
+// they are written straight into TIM2's 32-bit compare register
+extern const uint32_t waveform_breathe[];
+extern const uint16_t waveform_breathe_length;
@@ -14,8 +14,17 @@
 #include "core/uart.h"
 #include "core/gpio.h"
 #include "timer.h"
+#include "waveforms.h"
 #include "core/shift-register.h"
 #include "core/firmware-info.h"
+#include "core/handoff.h"
+#include "core/task-scheduler.h"
+
+#define APP_EVENT_UART_RX (0x1U << 0)
+
+static task_t blink_task;
+static task_t walk_task;
+static task_t uart_task;
 
 /*******************************************************************************
  * @brief offset vector table location in memory by booloader size
@@ -26,8 +35,10 @@ static void vector_setup(void) {
 
 /*******************************************************************************
  * @brief Initializes the GPIO pins for the application
+ * 
+ * @param handoff_flags HANDOFF_FLAG_* bits for what the bootloader left set up
  ******************************************************************************/
-static void gpio_setup(void) {
+static void gpio_setup(uint32_t handoff_flags) {
     // enable rcc for GPIOA
     rcc_periph_clock_enable(RCC_GPIOA);
     rcc_periph_clock_enable(RCC_GPIOB);
@@ -39,85 +50,129 @@ static void gpio_setup(void) {
     gpio_mode_setup(GPIOB, GPIO_MODE_AF, GPIO_PUPD_NONE, GPIO2);
     gpio_set_af(GPIOB, GPIO_AF1, GPIO2);
 
-    //configure uart
-    gpio_mode_setup(UART_PORT, GPIO_MODE_AF, GPIO_PUPD_NONE, TX_PIN | RX_PIN);
-    gpio_set_af(UART_PORT, GPIO_AF7, TX_PIN | RX_PIN);
+    //configure uart, unless the bootloader left it configured
+    if (!(handoff_flags & HANDOFF_FLAG_UART_GPIO_CONFIGURED)) {
+        gpio_mode_setup(UART_PORT, GPIO_MODE_AF, GPIO_PUPD_NONE, TX_PIN | RX_PIN);
+        gpio_set_af(UART_PORT, GPIO_AF7, TX_PIN | RX_PIN);
+    }
 
     gpio_set(LED_PORT_BUILTIN, LED_PIN_BUILTIN); // set builtin LED high
 }
 
 /*******************************************************************************
- * @brief Blinks led on a given systick interval
+ * @brief Toggles the LED, run periodically by the scheduler
  * 
- * @param offset The time in milliseconds to wait before toggling the LED
+ * @param events Pending task events, only TASK_EVENT_WAKE
+ * @param context Unused
  ******************************************************************************/
-static void blink_led(uint16_t offset, uint64_t *start_time) {
-    if ((system_get_ticks() - *start_time) >= offset) {
-        gpio_toggle(LED_PORT, LED_PIN);
-        *start_time = system_get_ticks();
-    }
+static void blink_led(uint32_t events, void* context) {
+    (void)events;
+    (void)context;
+    gpio_toggle(LED_PORT, LED_PIN);
+}
+
+/*******************************************************************************
+ * @brief Raises the UART task's receive event, called from the UART interrupt
+ ******************************************************************************/
+static void uart_rx_signal(void) {
+    task_signal(&uart_task, APP_EVENT_UART_RX);
 }
 
 /*******************************************************************************
- * @brief Increments the duty cycle of the PWM LED in a breathing pattern
+ * @brief retransmits received bytes over UART, run by the scheduler whenever 
+ *        bytes have been received
+ * 
+ * @param events Pending task events, only APP_EVENT_UART_RX
+ * @param context Unused
  * 
- * @param offset The time in milliseconds to acheive brightness extrema
+ * @note Received bytes are also checked for the "enter bootloader" command, 
+ *       upon which the system resets straight into a firmware update
  ******************************************************************************/
-static void led_breathe(uint16_t offset, uint64_t *pwm_time) {
-    static float cycle = 0.0;
-    static bool increasing = true;
-
-    if ((system_get_ticks() - *pwm_time) >= offset) {
-        if (increasing) {
-            cycle += 10.0;
-        } else {
-            cycle -= 10.0;
-        }
+static void uart_retransmit(uint32_t events, void* context) {
+    (void)events;
+    (void)context;
+
+    // retransmit every byte received since the last run
+    while (uart_data_available()) {
+        uint8_t data = uart_receive_byte();
+        uart_send_byte(data);
 
-        if (cycle >= 100.0) {
-            increasing = false;
-        } else if (cycle <= 0.0) {
-            increasing = true;
+        if (handoff_parse_update_command(data)) {
+            handoff_enter_bootloader(); // does not return
         }
-        
-        timer_pwm_set_duty_cycle(cycle);
-        *pwm_time = system_get_ticks();
     }
 }
 
 /*******************************************************************************
- * @brief retransmits the last received byte over UART
+ * @brief Sends an unsigned value as decimal text over UART
  ******************************************************************************/
-static void uart_retransmit(void) {
-    // retransmit the last received byte over UART
-    if (uart_data_available()) {
-        uint8_t data = uart_receive_byte();
-        uart_send_byte(data);
+static void uart_send_decimal(uint32_t value) {
+    uint8_t digits[10];
+    uint8_t count = 0;
+
+    do {
+        digits[count++] = '0' + (value % 10);
+        value /= 10;
+    } while (value > 0);
+
+    while (count > 0) {
+        uart_send_byte(digits[--count]);
     }
 }
 
 /*******************************************************************************
- * @brief Walks through the shift register LEDs, advancing the state every 
- *        offset milliseconds
+ * @brief Reports how long it took to get from bootloader entry to main(), and 
+ *        how much of that was the jump itself
  * 
- * @param sr Pointer to the structure containing SR configuration
- * @param offset The time in milliseconds to wait before advancing the SR state
- * @param start_time Pointer to the start time for the walking operation
+ * @param boot_info The handoff record left by the bootloader
+ * @param main_cycles The cycle counter sampled on entry to main()
  ******************************************************************************/
-static void walk(ShiftRegister8_t *sr, uint16_t offset, uint64_t *start_time) {
-    if ((system_get_ticks() - *start_time) >= offset) {
-        shift_register_advance(sr); // advance the shift register state
-        *start_time = system_get_ticks();
-    }
+static void report_boot_time(const handoff_boot_info_t* boot_info,
+    uint32_t main_cycles) {
+    const uint32_t cycles_per_us = boot_info->cpu_freq / 1000000U;
+
+    uart_send((uint8_t*)"boot ", 5);
+    uart_send_decimal(main_cycles / cycles_per_us);
+    uart_send((uint8_t*)" us, handoff ", 13);
+    uart_send_decimal((main_cycles - boot_info->jump_cycles) / cycles_per_us);
+    uart_send((uint8_t*)" us\r\n", 5);
+}
+
+/*******************************************************************************
+ * @brief Walks through the shift register LEDs, run periodically by the 
+ *        scheduler
+ * 
+ * @param events Pending task events, only TASK_EVENT_WAKE
+ * @param context Pointer to the ShiftRegister8_t to advance
+ ******************************************************************************/
+static void walk(uint32_t events, void* context) {
+    (void)events;
+    shift_register_advance((ShiftRegister8_t*)context);
 }
 
 int main(void) {
-    system_setup();
-    gpio_setup();
+    // sample first, so the boot time covers everything up to this point
+    const uint32_t main_cycles = system_get_cycles();
+
+    handoff_boot_info_t boot_info = {0U};
+    const bool handed_off = handoff_take_boot_info(&boot_info);
+
+    // a bootloader built for another clock profile leaves the wrong PLL setup
+    if ((boot_info.flags & HANDOFF_FLAG_CLOCKS_CONFIGURED)
+        && boot_info.cpu_freq == CPU_FREQ) {
+        system_setup_preconfigured(); // skip redundant PLL bring-up
+    } else {
+        system_setup();
+    }
+    gpio_setup(boot_info.flags);
     timer_setup();
     vector_setup();
     uart_setup();
 
+    if (handed_off) {
+        report_boot_time(&boot_info, main_cycles);
+    }
+
     ShiftRegister8_t sr1 = {
         .led_state = 0x00, // start with first LED on
         .num_outputs = 8, // 8 outputs for the debug LEDs
@@ -129,23 +184,21 @@ int main(void) {
 
     shift_register_setup(&sr1);
 
-    uint64_t start_time = system_get_ticks();
-    uint64_t pwm_time = system_get_ticks();
-    uint64_t sr_time = system_get_ticks();
+    // breathe the PWM LED in hardware, one breath every two seconds
+    timer_waveform_play(waveform_breathe, waveform_breathe_length, 
+        waveform_breathe_length / 2);
 
-    // float cycle = 0.0;
+    // tasks run in this order whenever several are ready at once
+    task_scheduler_add(&blink_task, blink_led, NULL, 1000); // every second
+    task_scheduler_add(&walk_task, walk, &sr1, 1000); // walk the SR LEDs every second
+    task_scheduler_add(&uart_task, uart_retransmit, NULL, 0); // on receive
 
-    while (1) {
-        blink_led(1000, &start_time); // blink led every second
-        led_breathe(100, &pwm_time); // breathe led every second
-
-        // update shift register with current state
-        // shift_register_set_pattern(&sr1, 0x02); 
-        
-        walk(&sr1, 1000, &sr_time); // walk through the shift register LEDs
-       
-        uart_retransmit();
+    uart_set_rx_callback(uart_rx_signal);
+    if (uart_data_available()) {
+        uart_rx_signal(); // bytes received before the callback was set
     }
 
+    task_scheduler_run(); // sleeps whenever no task has work, never returns
+
     return 0;
 }
\ No newline at end of file
@@ -2,16 +2,29 @@
  * @file   timer.c
  * @author Camille Alexandra
  *
- * @brief  Implements timers, used in this case for PWM
+ * @brief  Implements timers, used in this case for PWM, and a waveform engine
+ *         which plays duty cycle tables into the PWM output by DMA
  ******************************************************************************/
 
 #include <libopencm3/stm32/timer.h>
 #include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/dma.h>
 
 #include "timer.h"
+#include "core/system.h"
 
-#define PRESCALER (84)
-#define ARR_VALUE (1000)
+#define PWM_TICK_FREQ (1000000) // 1MHz, so a 1kHz PWM period
+#define ARR_VALUE (TIMER_PWM_FULL_SCALE)
+
+// TIM3 paces waveform playback, each update event moving one table entry into
+// TIM2_CCR4 through its DMA request on DMA1 stream 2, channel 5
+#define WAVEFORM_TIMER       (TIM3)
+#define WAVEFORM_TICK_FREQ   (10000)
+#define WAVEFORM_DMA         (DMA1)
+#define WAVEFORM_DMA_STREAM  (DMA_STREAM2)
+#define WAVEFORM_DMA_CHANNEL (DMA_SxCR_CHSEL_5)
+
+static bool waveform_playing = false;
 
 /*******************************************************************************
  * @brief Setup timer for PWM output
@@ -27,14 +40,16 @@ void timer_setup(void) {
 
     // setup pwm mode for given pin configuration
     timer_set_oc_mode(TIM2, TIM_OC4, TIM_OCM_PWM1); // output compare channel 4
+    // new compare values take effect on the next period, so never glitch
+    timer_enable_oc_preload(TIM2, TIM_OC4);
     timer_enable_counter(TIM2);
     timer_enable_oc_output(TIM2, TIM_OC4);
 
     // setup frequency and resolution
     // set frequency to run at, set steps for given freq.
-    // given clock freq. of 84_000_000
-    // freq = system_freq / ((prescaler - 1) + (auto_reload - 1))
-    timer_set_prescaler(TIM2, PRESCALER - 1);
+    // freq = timer_clock / (prescaler * auto_reload), with the timer clock
+    // depending on the clock profile
+    timer_set_prescaler(TIM2, (system_get_apb1_timer_frequency() / PWM_TICK_FREQ) - 1);
     timer_set_period(TIM2, ARR_VALUE - 1);
 }
 
@@ -50,4 +65,67 @@ void timer_pwm_set_duty_cycle(float duty_cycle) {
     const float raw_value = (float)ARR_VALUE * (duty_cycle / 100.0f);
 
     timer_set_oc_value(TIM2, TIM_OC4, (uint32_t)raw_value);
+}
+
+/*******************************************************************************
+ * @brief Play a duty cycle table into the PWM output, repeating forever
+ * 
+ * @param table Compare values in units of TIMER_PWM_FULL_SCALE, which must 
+ *        remain valid during playback. Words, as TIM2 is a 32-bit timer: the
+ *        bus copies a half-word written to CCR4 into both halves, giving
+ *        v | v << 16, above ARR for any v but 0
+ * @param length Number of entries in table
+ * @param sample_rate Entries played per second, from 1 to 10000
+ * 
+ * @note Playback runs entirely in hardware, taking no CPU time. Any previous 
+ *       waveform is stopped first.
+ ******************************************************************************/
+void timer_waveform_play(const uint32_t* table, uint16_t length, 
+    uint32_t sample_rate) {
+    timer_waveform_stop();
+
+    if (length == 0 || sample_rate == 0 || sample_rate > WAVEFORM_TICK_FREQ) {
+        return;
+    }
+
+    rcc_periph_clock_enable(RCC_DMA1);
+    dma_stream_reset(WAVEFORM_DMA, WAVEFORM_DMA_STREAM);
+    dma_channel_select(WAVEFORM_DMA, WAVEFORM_DMA_STREAM, 
+        WAVEFORM_DMA_CHANNEL);
+    dma_set_transfer_mode(WAVEFORM_DMA, WAVEFORM_DMA_STREAM, 
+        DMA_SxCR_DIR_MEM_TO_PERIPHERAL);
+    dma_set_peripheral_address(WAVEFORM_DMA, WAVEFORM_DMA_STREAM, 
+        (uint32_t)&TIM_CCR4(TIM2));
+    dma_set_memory_address(WAVEFORM_DMA, WAVEFORM_DMA_STREAM, (uint32_t)table);
+    dma_set_number_of_data(WAVEFORM_DMA, WAVEFORM_DMA_STREAM, length);
+    dma_set_peripheral_size(WAVEFORM_DMA, WAVEFORM_DMA_STREAM, 
+        DMA_SxCR_PSIZE_32BIT);
+    dma_set_memory_size(WAVEFORM_DMA, WAVEFORM_DMA_STREAM, DMA_SxCR_MSIZE_32BIT);
+    dma_enable_memory_increment_mode(WAVEFORM_DMA, WAVEFORM_DMA_STREAM);
+    dma_enable_circular_mode(WAVEFORM_DMA, WAVEFORM_DMA_STREAM);
+    dma_set_priority(WAVEFORM_DMA, WAVEFORM_DMA_STREAM, DMA_SxCR_PL_LOW);
+    dma_enable_stream(WAVEFORM_DMA, WAVEFORM_DMA_STREAM);
+
+    rcc_periph_clock_enable(RCC_TIM3);
+    rcc_periph_reset_pulse(RST_TIM3);
+    timer_set_prescaler(WAVEFORM_TIMER, 
+        (system_get_apb1_timer_frequency() / WAVEFORM_TICK_FREQ) - 1);
+    timer_set_period(WAVEFORM_TIMER, (WAVEFORM_TICK_FREQ / sample_rate) - 1);
+    timer_enable_irq(WAVEFORM_TIMER, TIM_DIER_UDE); // DMA request on update
+    timer_enable_counter(WAVEFORM_TIMER);
+
+    waveform_playing = true;
+}
+
+/*******************************************************************************
+ * @brief Stop waveform playback, leaving the PWM output at its last value
+ ******************************************************************************/
+void timer_waveform_stop(void) {
+    if (!waveform_playing) {
+        return;
+    }
+
+    timer_disable_counter(WAVEFORM_TIMER);
+    dma_disable_stream(WAVEFORM_DMA, WAVEFORM_DMA_STREAM);
+    waveform_playing = false;
 }
\ No newline at end of file
@@ -2,5 +2,28 @@
 
 #include "common.h"
 
-void bl_flash_erase_main_app(void);
-void bl_flash_write_main_app(const uint32_t address, const uint8_t* data, uint32_t length);
+#define BL_FLASH_QUEUE_LENGTH (8U)  // operations queued or in progress, a power of 2
+#define BL_FLASH_PROGRAM_MAX  (64U) // bytes one program operation carries, a block
+
+// passed to a callback in place of FLASH_SR error flags when an earlier
+// operation failed, and this one was dropped without being started
+#define BL_FLASH_CANCELLED    (1U << 31)
+
+// called from the flash interrupt when an operation ends, with errors 0 on
+// success, otherwise the FLASH_SR error flags or BL_FLASH_CANCELLED. It must
+// not submit further operations
+typedef void (*bl_flash_callback_t)(uint32_t errors, void* context);
+
+typedef struct bl_flash_stats_t {
+    uint32_t erase_us;   // total time spent erasing
+    uint32_t program_us; // total time spent programming
+} bl_flash_stats_t;
+
+void bl_flash_setup(void);
+bool bl_flash_submit_erase_main_app(bl_flash_callback_t callback, void* context);
+bool bl_flash_submit_write_main_app(const uint32_t offset, const uint8_t* data, 
+    uint32_t length, bl_flash_callback_t callback, void* context);
+uint32_t bl_flash_queue_space(void);
+bool bl_flash_is_idle(void);
+void bl_flash_wait_idle(void);
+const bl_flash_stats_t* bl_flash_get_stats(void);
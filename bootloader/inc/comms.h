@@ -7,6 +7,10 @@
 #define PACKET_CRC_LENGTH     (1)
 #define PACKET_LENGTH         (PACKET_LENGTH_LENGTH + PACKET_DATA_LENGTH + PACKET_CRC_LENGTH)
 
+// COBS framing: a packet is encoded without zero bytes, then terminated by one
+#define PACKET_COBS_DELIMITER    (0x00)
+#define PACKET_COBS_FRAME_LENGTH (PACKET_LENGTH + 1) // excluding the delimiter
+
 #define PACKET_RETX_DATA0 (0x19)
 #define PACKET_ACK_DATA0  (0x15)
 
@@ -22,6 +26,114 @@
 #define BL_PACKET_READY_FOR_DATA_DATA0             (0x48)
 #define BL_PACKET_UPDATE_SUCCESS_DATA0             (0x54)
 #define BL_PACKET_NACK_DATA0                       (0x99)
+#define BL_PACKET_BEGIN_SESSION_DATA0              (0x60)
+#define BL_PACKET_SESSION_RESPONSE_DATA0           (0x63)
+#define BL_PACKET_EXTENT_DATA0                     (0x66)
+#define BL_PACKET_WRITE_BLOCK_DATA0                (0x69)
+#define BL_PACKET_QUERY_BLOCKS_DATA0               (0x6C)
+#define BL_PACKET_BLOCKS_DATA0                     (0x6F)
+#define BL_PACKET_END_TRANSFER_DATA0               (0x72)
+#define BL_PACKET_QUERY_CRC_DATA0                  (0x75)
+#define BL_PACKET_CRC_DATA0                        (0x78)
+#define BL_PACKET_QUERY_STATS_DATA0                (0x7B)
+#define BL_PACKET_STATS_DATA0                      (0x7E)
+#define BL_PACKET_QUERY_TRACE_DATA0                (0x81)
+#define BL_PACKET_TRACE_DATA0                      (0x84)
+
+// options byte which may follow BL_PACKET_FW_UPDATE_REQUEST_DATA0
+#define BL_FW_UPDATE_OPTION_COBS   (0x01) // switch to COBS framing after response
+#define BL_FW_UPDATE_OPTION_SPARSE (0x02) // data comes in extents, begin session only
+#define BL_FW_UPDATE_OPTION_BLOCKS (0x04) // data comes in blocks, begin session only
+#define BL_FW_UPDATE_OPTION_STATS  (0x08) // stats packet before update success, begin session only
+#define BL_FW_UPDATE_OPTION_SEQUENCE (0x10) // transfer packets are sequenced, begin session only
+
+// begin session command, replacing the update request, device ID and firmware
+// length exchanges: tag, device ID, firmware length (uint32_t), firmware 
+// version (uint32_t), BL_FW_UPDATE_OPTION_* bits. Multi-byte fields are 
+// little-endian.
+#define BL_BEGIN_SESSION_LENGTH    (11)
+// session response: tag, BL_CAPABILITY_* bits, bootloader version (uint16_t),
+// then the installed firmware's device ID (uint8_t), version and length 
+// (uint32_t), as found in its firmware_info_t
+#define BL_SESSION_RESPONSE_LENGTH (13)
+
+#define BL_CAPABILITY_COBS         (0x01) // understands BL_FW_UPDATE_OPTION_COBS
+#define BL_CAPABILITY_SPARSE       (0x02) // understands BL_FW_UPDATE_OPTION_SPARSE
+#define BL_CAPABILITY_BLOCKS       (0x04) // understands BL_FW_UPDATE_OPTION_BLOCKS
+#define BL_CAPABILITY_QUERY_CRC    (0x08) // answers BL_PACKET_QUERY_CRC_DATA0
+#define BL_CAPABILITY_STATS        (0x10) // answers BL_PACKET_QUERY_STATS_DATA0
+#define BL_CAPABILITY_TRACE        (0x20) // answers BL_PACKET_QUERY_TRACE_DATA0
+#define BL_CAPABILITY_SEQUENCE     (0x40) // understands BL_FW_UPDATE_OPTION_SEQUENCE
+
+// in a sequenced transfer, each packet the host sends from the first READY on
+// flips BL_PACKET_SEQUENCE_BIT of its length byte, the first having it clear.
+// A packet resent after its ACK was lost repeats the bit of the one before,
+// so it is dropped rather than written twice, and READY sent again. READY 
+// then carries the number of packets taken so far (uint32_t), so that no two
+// READY packets are alike and the host can drop one the device resent.
+#define BL_PACKET_SEQUENCE_BIT     (0x80)
+#define BL_READY_SEQUENCED_LENGTH  (5)
+
+// extent header, which in a sparse transfer precedes the data packets for each
+// range of the image that is not erased flash: tag, offset into the image 
+// (uint32_t), length (uint32_t). Extents go forwards through the image, and a
+// zero length extent ends the transfer.
+#define BL_EXTENT_LENGTH           (9)
+
+// in a block transfer, the image is split into BL_BLOCK_SIZE byte blocks which
+// may be sent in any order, and again if lost. A write block command: tag, 
+// block number (uint16_t), is followed by the data packets for that block, 
+// which is BL_BLOCK_SIZE bytes long except at the end of the image.
+#define BL_BLOCK_SIZE              (64)
+#define BL_WRITE_BLOCK_LENGTH      (3)
+// query blocks command: tag, first block number (uint16_t), answered with a 
+// blocks packet: tag, first block number (uint16_t), then a bitmap of which 
+// of the following BL_BLOCKS_PER_QUERY blocks were received, lowest first
+#define BL_QUERY_BLOCKS_LENGTH     (3)
+#define BL_BLOCKS_LENGTH           (PACKET_DATA_LENGTH)
+#define BL_BLOCKS_PER_QUERY        ((BL_BLOCKS_LENGTH - 3) * 8)
+// end transfer command: tag only. Blocks never received are left erased.
+
+// query CRC command, understood instead of an update request, between the 
+// blocks of a block transfer and between the extents of a sparse one: tag, offset into the application region 
+// (uint32_t), length (uint32_t). Answered with a CRC packet: tag, offset, 
+// length, then the CRC-32 of that range (uint32_t). An end transfer command 
+// in place of an update request leaves the bootloader without erasing.
+#define BL_QUERY_CRC_LENGTH        (9)
+#define BL_CRC_LENGTH              (13)
+
+// query stats command: tag only, understood wherever query CRC is, answered 
+// with a stats packet, which BL_FW_UPDATE_OPTION_STATS also has sent just 
+// before update success: tag, KiB received and sent (uint16_t each), then 
+// UART overruns, bytes dropped on a full UART ring, CRC errors, RETX sent, 
+// RETX received, packet ring high-water mark and full packet ring events 
+// (uint8_t each), then time spent erasing and programming flash in ms 
+// (uint16_t each). Counts saturate rather than wrap.
+#define BL_STATS_LENGTH            (16)
+
+// query trace command: tag, record index (uint16_t, 0 being the oldest), 
+// understood wherever query CRC is. The first stops tracing, so that reading 
+// the ring out does not overwrite it. Answered with a trace packet: tag, 
+// record index, records held (uint16_t each), core clock in MHz (uint8_t),
+// then the trace_record_t: timestamp in core cycles (uint32_t), event, arg0
+// (uint8_t each), arg1 (uint16_t). See core/trace.h for the events.
+#define BL_QUERY_TRACE_LENGTH      (3)
+#define BL_TRACE_LENGTH            (14)
+
+#define BOOTLOADER_VERSION         (0x0201) // major in the high byte
+
+typedef enum comms_framing_t {
+    COMMS_FRAMING_RAW,  // fixed length packets, back to back
+    COMMS_FRAMING_COBS, // COBS encoded packets, delimited by a zero byte
+} comms_framing_t;
+
+typedef struct comms_stats_t {
+    uint32_t crc_errors;      // packets or COBS frames received corrupted
+    uint32_t retx_sent;
+    uint32_t retx_received;
+    uint32_t ring_full;       // good packets refused for lack of room
+    uint32_t ring_high_water; // most packets ever waiting in the ring
+} comms_stats_t;
 
 typedef struct comms_packet_t {
     uint8_t length;
@@ -30,7 +142,9 @@ typedef struct comms_packet_t {
 } comms_packet_t;
 
 void comms_setup(void);
+void comms_set_framing(comms_framing_t new_framing);
 void comms_update(void);
+void comms_discard_input(void);
 
 bool comms_is_single_byte_packet(comms_packet_t* packet, uint8_t data0);
 
@@ -39,4 +153,5 @@ void comms_send_packet(comms_packet_t* packet);
 void comms_receive_packet(comms_packet_t* packet);
 void comms_create_single_byte_packet(comms_packet_t* packet, uint8_t data0);
 
-uint8_t comms_compute_crc(comms_packet_t* packet);
\ No newline at end of file
+uint8_t comms_compute_crc(comms_packet_t* packet);
+const comms_stats_t* comms_get_stats(void);
\ No newline at end of file
@@ -1,13 +1,22 @@
+import re
+import sys
 
-
-BOOTLOADER_SIZE = 0x8000
+FIRMWARE_INFO_HEADER = "../shared/inc/core/firmware-info.h"
 BOOTLOADER_FILE = "bootloader.bin"
 
+# the application is linked to start right after this, so it is a hard limit
+with open(FIRMWARE_INFO_HEADER) as f:
+    BOOTLOADER_SIZE = int(re.search(r"#define\s+BOOTLOADER_SIZE\s+\(?(0x[0-9A-Fa-f]+|\d+)U?\)?", f.read()).group(1), 0)
+
 with open(BOOTLOADER_FILE, "rb") as f:
     raw_file = f.read()
 
 bytes_to_pad = BOOTLOADER_SIZE - len(raw_file)
+if bytes_to_pad < 0:
+    sys.exit(f"{BOOTLOADER_FILE} is {len(raw_file)} bytes, {-bytes_to_pad} over BOOTLOADER_SIZE ({BOOTLOADER_SIZE})")
+print(f"{BOOTLOADER_FILE}: {len(raw_file)} of {BOOTLOADER_SIZE} bytes, {bytes_to_pad} free")
+
 padding = bytes([0xff for _ in range(bytes_to_pad)])
 
 with open(BOOTLOADER_FILE, "wb") as f:
-    f.write(raw_file + padding)
\ No newline at end of file
+    f.write(raw_file + padding)
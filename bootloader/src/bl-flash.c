@@ -4,53 +4,359 @@
  *
  * @brief Contains implementation for flash memory operations in the bootloader
  *        such as erasing and writing the main application.
+ *
+ * Operations are queued and run by the flash interrupt, one hardware step at a
+ * time (a sector erase, or a word or byte programmed), so that submitting one
+ * returns at once and the bootloader loop no longer blocks between steps.
+ *
+ * @note  The F446 has a single flash bank, and all code, this file's interrupt
+ *        and the vector table included, runs from it. Any fetch or read of
+ *        flash made while a step runs stalls until the step ends, unless the
+ *        ART accelerator's caches can answer it. A program step is short next
+ *        to a UART character, but a sector erase stalls everything, the UART
+ *        interrupt too, for 1-2s; of the bytes arriving then, the UART keeps
+ *        the first and overruns on the rest. The host's ACK of the session
+ *        response always lands in the first sector's erase, so the
+ *        bootloader discards whatever was received before sending READY
+ *        (comms_discard_input()), as with raw framing a leftover byte would
+ *        put every later packet out of step.
  ******************************************************************************/
 
+#include <string.h>
+
 // External library includes
 #include <libopencm3/stm32/flash.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/cortex.h> // interrupt masking
 
 // User includes
 #include "bl-flash.h"
+#include "core/system.h"
+#include "core/trace.h"
 
 // Defines & macros
 #define BOOTLOADER_SIZE (0x8000U) // 32KB
-#define MAIN_APP_SIZE   (0x80000U - BOOTLOADER_SIZE) // 
+#define MAIN_APP_SIZE   (0x80000U - BOOTLOADER_SIZE) //
+#define MAIN_APP_START  (FLASH_BASE + BOOTLOADER_SIZE)
 
 #define MAIN_APP_SECTOR_START  (2)
 #define MAIN_APP_SECTOR_END    (7)
+#define MAIN_APP_SECTORS       (MAIN_APP_SECTOR_END - MAIN_APP_SECTOR_START + 1)
+
+#define FLASH_SR_ERRORS (FLASH_SR_OPERR | FLASH_SR_WRPERR | FLASH_SR_PGAERR \
+    | FLASH_SR_PGPERR | FLASH_SR_PGSERR)
+#define FLASH_CR_STEP   (FLASH_CR_PG | FLASH_CR_SER \
+    | (FLASH_CR_SNB_MASK << FLASH_CR_SNB_SHIFT) \
+    | (FLASH_CR_PROGRAM_MASK << FLASH_CR_PROGRAM_SHIFT))
+
+typedef enum flash_op_kind_t {
+    FLASH_OP_ERASE,
+    FLASH_OP_PROGRAM,
+} flash_op_kind_t;
+
+typedef struct flash_op_t {
+    uint8_t kind;        // flash_op_kind_t
+    uint8_t sector;      // erase only
+    uint8_t length;      // program only, bytes in data
+    uint8_t programmed;  // program only, bytes written so far
+    uint8_t in_flight;   // program only, bytes the current step writes
+    uint32_t address;    // program only, where data[0] goes
+    uint8_t data[BL_FLASH_PROGRAM_MAX];
+    bl_flash_callback_t callback;
+    void* context;
+} flash_op_t;
+
+_Static_assert((BL_FLASH_QUEUE_LENGTH & (BL_FLASH_QUEUE_LENGTH - 1U)) == 0,
+    "BL_FLASH_QUEUE_LENGTH must be a power of 2");
+_Static_assert(BL_FLASH_QUEUE_LENGTH >= MAIN_APP_SECTORS,
+    "an erase of the main application must fit in the queue");
+
+// the operation at head is the one running whenever the queue is not empty.
+// Only submissions move tail, and only the interrupt moves head once running
+static flash_op_t queue[BL_FLASH_QUEUE_LENGTH];
+static volatile uint32_t head = 0;
+static volatile uint32_t tail = 0;
+
+static uint64_t op_start_time = 0;
+static bl_flash_stats_t stats = {0U};
 
 /*******************************************************************************
- * @brief Erase the main application flash memory
- * 
- * This function unlocks the flash memory, erases the sectors allocated for the
- * main application, and then locks the flash memory again.
+ * @brief Drops whatever the ART accelerator's caches hold, so that reads of
+ *        erased flash do not return the image validated before the erase
+ *
+ * @note  The caches can only be reset while disabled (RM0390 3.5.2)
  ******************************************************************************/
-void bl_flash_erase_main_app(void) {
-    // Erase the main application flash memory
-    flash_unlock();
+static void flush_flash_caches(void) {
+    bool icache = (FLASH_ACR & FLASH_ACR_ICEN) != 0;
+    bool dcache = (FLASH_ACR & FLASH_ACR_DCEN) != 0;
 
-    for (uint8_t sector = MAIN_APP_SECTOR_START; sector <= MAIN_APP_SECTOR_END; ++sector) {
-        flash_erase_sector(sector, FLASH_CR_PROGRAM_X32);
+    flash_icache_disable();
+    flash_dcache_disable();
+    flash_icache_reset();
+    flash_dcache_reset();
+
+    if (icache) {
+        flash_icache_enable();
+    }
+    if (dcache) {
+        flash_dcache_enable();
     }
+}
 
+/*******************************************************************************
+ * @brief Starts the next hardware step of an operation
+ *
+ * @return 0 if the step is running and will end in the flash interrupt, else
+ *         the error flags raised at once, in which case it never started
+ *
+ * @note  Sequence and alignment errors stop a program step before it starts,
+ *        and raise no interrupt, so they have to be caught here
+ ******************************************************************************/
+static uint32_t start_step(flash_op_t* op) {
+    FLASH_CR &= ~FLASH_CR_STEP;
+
+    if (op->kind == FLASH_OP_ERASE) {
+        FLASH_CR |= (FLASH_CR_PROGRAM_X32 << FLASH_CR_PROGRAM_SHIFT)
+            | ((uint32_t)op->sector << FLASH_CR_SNB_SHIFT) | FLASH_CR_SER;
+        FLASH_CR |= FLASH_CR_STRT;
+    } else {
+        uint32_t address = op->address + op->programmed;
+
+        // whole words where aligned, a quarter of the steps of bytes
+        if ((address & 3U) == 0 && (uint32_t)(op->length - op->programmed) >= 4U) {
+            uint32_t word;
+            memcpy(&word, &op->data[op->programmed], sizeof(word));
+
+            FLASH_CR |= (FLASH_CR_PROGRAM_X32 << FLASH_CR_PROGRAM_SHIFT) | FLASH_CR_PG;
+            MMIO32(address) = word;
+            op->in_flight = 4U;
+        } else {
+            FLASH_CR |= (FLASH_CR_PROGRAM_X8 << FLASH_CR_PROGRAM_SHIFT) | FLASH_CR_PG;
+            MMIO8(address) = op->data[op->programmed];
+            op->in_flight = 1U;
+        }
+    }
+
+    return FLASH_SR & FLASH_SR_ERRORS;
+}
+
+/*******************************************************************************
+ * @brief Ends the operation at the head of the queue, dropping everything
+ *        after it if it failed, as later writes may depend on it
+ *
+ * @param errors FLASH_SR error flags, 0 on success
+ ******************************************************************************/
+static void complete_operation(uint32_t errors) {
+    flash_op_t* op = &queue[head & (BL_FLASH_QUEUE_LENGTH - 1U)];
+    uint32_t elapsed = (uint32_t)(system_get_micros() - op_start_time);
+
+    if (op->kind == FLASH_OP_ERASE) {
+        trace_event(TRACE_EVENT_FLASH_ERASE_END, op->sector, 0U);
+        stats.erase_us += elapsed;
+        flush_flash_caches();
+    } else {
+        trace_event(TRACE_EVENT_FLASH_PROGRAM_END, 0U, op->length);
+        stats.program_us += elapsed;
+    }
+
+    FLASH_SR = errors; // write 1 to clear
+    ++head;
+    if (op->callback) {
+        op->callback(errors, op->context);
+    }
+
+    while (errors != 0 && head != tail) {
+        op = &queue[head & (BL_FLASH_QUEUE_LENGTH - 1U)];
+        ++head;
+        if (op->callback) {
+            op->callback(BL_FLASH_CANCELLED, op->context);
+        }
+    }
+}
+
+/*******************************************************************************
+ * @brief Starts the operation at the head of the queue, or locks the flash
+ *        again once there is none
+ *
+ * @note  Called with the flash interrupt unable to run, either from it or with
+ *        interrupts masked
+ ******************************************************************************/
+static void start_next_operation(void) {
+    while (head != tail) {
+        flash_op_t* op = &queue[head & (BL_FLASH_QUEUE_LENGTH - 1U)];
+
+        if (op->kind == FLASH_OP_ERASE) {
+            trace_event(TRACE_EVENT_FLASH_ERASE_START, op->sector, 0U);
+        } else {
+            trace_event(TRACE_EVENT_FLASH_PROGRAM_START, 0U, op->length);
+        }
+        op_start_time = system_get_micros();
+
+        uint32_t errors = start_step(op);
+        if (errors == 0) {
+            return; // the flash interrupt takes it from here
+        }
+        complete_operation(errors);
+    }
+
+    FLASH_CR &= ~(FLASH_CR_EOPIE | FLASH_CR_ERRIE | FLASH_CR_STEP);
     flash_lock();
 }
 
 /*******************************************************************************
- * @brief Write data to the main application flash memory
- * 
- * This function unlocks the flash memory, writes the specified data to the
- * given address, and then locks the flash memory again.
- * 
- * @param address The starting address in flash memory where data will be written
+ * @brief Runs at the end of each step, successful or not, starting the next
+ ******************************************************************************/
+void flash_isr(void) {
+    uint32_t status = FLASH_SR;
+    FLASH_SR = status & FLASH_SR_EOP; // write 1 to clear
+
+    if (head == tail) {
+        return; // nothing was running
+    }
+
+    flash_op_t* op = &queue[head & (BL_FLASH_QUEUE_LENGTH - 1U)];
+    uint32_t errors = status & FLASH_SR_ERRORS;
+
+    if (errors == 0 && op->kind == FLASH_OP_PROGRAM) {
+        op->programmed += op->in_flight;
+        if (op->programmed < op->length) {
+            errors = start_step(op);
+            if (errors == 0) {
+                return;
+            }
+        }
+    }
+
+    complete_operation(errors);
+    start_next_operation();
+}
+
+/*******************************************************************************
+ * @brief Returns the next free queue entry, to be filled in and then committed
+ ******************************************************************************/
+static flash_op_t* reserve_operation(bl_flash_callback_t callback, void* context) {
+    flash_op_t* op = &queue[tail & (BL_FLASH_QUEUE_LENGTH - 1U)];
+
+    op->callback = callback;
+    op->context = context;
+    return op;
+}
+
+/*******************************************************************************
+ * @brief Adds the reserved entry to the queue, starting it if the flash is idle
+ ******************************************************************************/
+static void commit_operation(void) {
+    uint32_t interrupts_masked = cm_mask_interrupts(1U);
+    bool idle = (head == tail);
+
+    ++tail;
+    if (idle) {
+        flash_unlock();
+        FLASH_SR = FLASH_SR_EOP | FLASH_SR_ERRORS; // stale flags
+        FLASH_CR |= FLASH_CR_EOPIE | FLASH_CR_ERRIE;
+        start_next_operation();
+    }
+
+    cm_mask_interrupts(interrupts_masked);
+}
+
+/*******************************************************************************
+ * @brief Enables the flash interrupt which runs the operation queue
+ ******************************************************************************/
+void bl_flash_setup(void) {
+    nvic_enable_irq(NVIC_FLASH_IRQ);
+}
+
+/*******************************************************************************
+ * @brief Queue an erase of the main application flash memory
+ *
+ * This queues one erase per sector allocated to the main application. Each
+ * can take a second or more.
+ *
+ * @param callback Called once the last sector is erased, or as soon as one
+ *        fails, may be NULL
+ * @param context Passed to callback
+ * @return True if queued, False if the queue has no room, in which case
+ *         nothing is queued
+ ******************************************************************************/
+bool bl_flash_submit_erase_main_app(bl_flash_callback_t callback, void* context) {
+    if (bl_flash_queue_space() < MAIN_APP_SECTORS) {
+        return false;
+    }
+
+    for (uint8_t sector = MAIN_APP_SECTOR_START; sector <= MAIN_APP_SECTOR_END; ++sector) {
+        bool last = (sector == MAIN_APP_SECTOR_END);
+        flash_op_t* op = reserve_operation(last ? callback : NULL, context);
+
+        op->kind = FLASH_OP_ERASE;
+        op->sector = sector;
+        commit_operation();
+    }
+
+    return true;
+}
+
+/*******************************************************************************
+ * @brief Queue a write of data to the main application flash memory
+ *
+ * The data is copied, so the caller's buffer may be reused straight away.
+ *
+ * @param offset The offset from the start of the main application
  * @param data Pointer to the data to be written
- * @param length The length of the data to be written in bytes
+ * @param length The length of the data in bytes, at most BL_FLASH_PROGRAM_MAX
+ * @param callback Called once the data is written, or fails to be, may be NULL
+ * @param context Passed to callback
+ * @return True if queued, False if the data would not fit in the main
+ *         application sectors or the queue has no room, in which case nothing
+ *         is queued
  ******************************************************************************/
-void bl_flash_write_main_app(const uint32_t address, 
-    const uint8_t* data, uint32_t length) {
-    flash_unlock();
-    
-    flash_program(address, data, length);
+bool bl_flash_submit_write_main_app(const uint32_t offset, const uint8_t* data,
+    uint32_t length, bl_flash_callback_t callback, void* context) {
+    // written so that neither side can wrap around
+    if (offset > MAIN_APP_SIZE || length > MAIN_APP_SIZE - offset) {
+        return false;
+    }
+    if (length == 0 || length > BL_FLASH_PROGRAM_MAX || bl_flash_queue_space() == 0) {
+        return false;
+    }
 
-    flash_lock();
-}
\ No newline at end of file
+    flash_op_t* op = reserve_operation(callback, context);
+    op->kind = FLASH_OP_PROGRAM;
+    op->address = MAIN_APP_START + offset;
+    op->length = (uint8_t)length;
+    op->programmed = 0;
+    memcpy(op->data, data, length);
+    commit_operation();
+
+    return true;
+}
+
+/*******************************************************************************
+ * @brief Returns how many more operations can be queued
+ ******************************************************************************/
+uint32_t bl_flash_queue_space(void) {
+    return BL_FLASH_QUEUE_LENGTH - (tail - head);
+}
+
+/*******************************************************************************
+ * @brief Returns true once every queued operation has ended
+ ******************************************************************************/
+bool bl_flash_is_idle(void) {
+    return head == tail;
+}
+
+/*******************************************************************************
+ * @brief Waits for every queued operation to end, for reading flash back
+ ******************************************************************************/
+void bl_flash_wait_idle(void) {
+    while (!bl_flash_is_idle()) {
+        // the flash interrupt moves the queue along
+    }
+}
+
+/*******************************************************************************
+ * @brief Returns the time spent erasing and programming since boot
+ ******************************************************************************/
+const bl_flash_stats_t* bl_flash_get_stats(void) {
+    return &stats;
+}
@@ -5,9 +5,11 @@
  * @brief  Redirect vector table to launch with custom bootloader
  ******************************************************************************/
 
+#include <string.h> // memcpy, memset
+
 #include <libopencm3/stm32/memorymap.h>
 #include <libopencm3/stm32/rcc.h>
-// #include <libopencm3/cm3/vector.h> // if using libopencm3 vector table
+#include <libopencm3/cm3/vector.h> // application vector table layout
 #include <libopencm3/cm3/scb.h> // system control block
 
 // User includes
@@ -21,6 +23,9 @@
 #include "core/shift-register.h"
 #include "core/firmware-info.h"
 #include "core/aes.h"
+#include "core/handoff.h"
+#include "core/crc.h"
+#include "core/trace.h"
 
 // Arbitrary sync sequence used to identify the start of a firmware update
 #define SYNC_SEQUENCE_0 (0xC4)
@@ -28,6 +33,12 @@
 #define SYNC_SEQUENCE_2 (0x7E)
 #define SYNC_SEQUENCE_3 (0x10)
 
+// peripherals left configured for the application, see core/handoff.h
+#ifndef BL_HANDOFF_FLAGS
+#define BL_HANDOFF_FLAGS \
+    (HANDOFF_FLAG_CLOCKS_CONFIGURED | HANDOFF_FLAG_UART_GPIO_CONFIGURED)
+#endif
+
 #define DEFAULT_TIMEOUT (5000)  // default timeout at 5s
 #define SHORT_TIMEOUT   (1000)  // short timeout at 1s
 #define LONG_TIMEOUT    (15000) // long timeout at 15s
@@ -48,9 +59,25 @@ typedef enum bl_state_t {
 static bl_state_t bl_state = BL_STATE_SYNC;
 static uint32_t fw_length = 0; // length of firmware to be received in bytes
 static uint32_t fw_bytes_written = 0; // track bytes written to flash
+static bool sparse_transfer = false; // data comes in extents
+static uint32_t extent_remaining = 0; // bytes still to come in this extent
+static bool block_transfer = false; // data comes in blocks, in any order
+static bool stats_requested = false; // send stats before update success
+static bool sequenced_transfer = false; // see BL_PACKET_SEQUENCE_BIT
+static uint8_t last_sequence = 0; // sequence bit of the last packet taken
+static uint32_t packets_taken = 0; // of a sequenced transfer, duplicates aside
+static uint8_t block_bitmap[MAX_FW_LENGTH / BL_BLOCK_SIZE / 8]; // blocks written
+static uint8_t block_buffer[BL_BLOCK_SIZE]; // the block being received
+static uint32_t block_number = 0;
+static uint32_t block_length = 0; // 0 between blocks
+static uint32_t block_filled = 0; // bytes of the block received so far
+static bool erase_submitted = false; // the erase is queued, or done
+static volatile bool erase_done = false; // set from the flash interrupt
+static volatile uint32_t flash_errors = 0; // of any flash operation, 0 if none failed
 static uint8_t sync_seq[4] = {0};
 static simple_timer_t timer; // module-level timer we will use for timeouts
 static comms_packet_t packet; 
+static handoff_update_request_t update_request; // set if app requested update
 
 ShiftRegister8_t sr1 = {
         .led_state = 0x00,
@@ -64,24 +91,29 @@ ShiftRegister8_t sr1 = {
 /*******************************************************************************
  * @brief Targets the main application start address and jumps to it using
  *        reset vector.
+ * 
+ * @note  Hands the application a clean start: its vector table is installed,
+ *        the main stack pointer is loaded from its first vector table entry, 
+ *        and a handoff record describes what is already configured
  ******************************************************************************/
 static void jump_to_main(void) {
-    // create typedef for a void function
-    typedef void (*void_fn)(void);
+    vector_table_t* main_vector_table = (vector_table_t*)MAIN_APP_START_ADDRESS;
 
-    // reset vector is second entry in table, stack pointer is first, thus + 4
-    uint32_t* reset_vector_entry = (uint32_t*)(MAIN_APP_START_ADDRESS + 4U);
-    uint32_t* reset_vector = (uint32_t*)(*reset_vector_entry);
+    // read both entries before the stack they may have been spilled to moves
+    uint32_t stack_pointer = (uint32_t)main_vector_table->initial_sp_value;
+    vector_table_entry_t reset_handler = main_vector_table->reset;
 
-    // interpret reset_vector as void function and call function
-    void_fn reset_fnc = (void_fn)reset_vector;
+    handoff_set_boot_info(BL_HANDOFF_FLAGS, CPU_FREQ, system_get_cycles());
 
-    reset_fnc();
+    SCB_VTOR = MAIN_APP_START_ADDRESS;
+#ifndef BOOTLOADER_HOST
+    __asm__ volatile ("dsb\n\tisb" : : : "memory");
+    __asm__ volatile ("msr msp, %0" : : "r" (stack_pointer) : "memory");
+#else
+    (void)stack_pointer; // the fuzz harness ends the session before this
+#endif
 
-    // The following implementation uses the libopencm3 vector table
-    // and uses the libopencm3/cm3/vector.h file to call the reset function
-    // vector_table_t* vector_table = (vector_table_t*)MAIN_APP_START_ADDRESS;
-    // main_vector_table->reset();
+    reset_handler();
 }
 
 /*******************************************************************************
@@ -111,11 +143,14 @@ static void gpio_setup(void) {
  * @brief Teardown for GPIO before jumping to main app
  ******************************************************************************/
 static void gpio_teardown(void) {
-    gpio_mode_setup(UART_PORT, GPIO_MODE_ANALOG, GPIO_PUPD_NONE,
-        TX_PIN | RX_PIN); // set uart pins to analog mode
     gpio_mode_setup(GPIOA, GPIO_MODE_INPUT, GPIO_PUPD_NONE,
         GPIO4); // set LED pin to input
+
+#if !(BL_HANDOFF_FLAGS & HANDOFF_FLAG_UART_GPIO_CONFIGURED)
+    gpio_mode_setup(UART_PORT, GPIO_MODE_ANALOG, GPIO_PUPD_NONE,
+        TX_PIN | RX_PIN); // set uart pins to analog mode
     rcc_periph_clock_disable(RCC_GPIOA);
+#endif
 }
 
 /*******************************************************************************
@@ -127,13 +162,476 @@ static void abort_fw_update(void) {
     bl_state = BL_STATE_DONE;
 }
 
+/*******************************************************************************
+ * @brief Called from the flash interrupt once the application is erased
+ ******************************************************************************/
+static void flash_erase_done(uint32_t errors, void* context) {
+    (void)context;
+    flash_errors |= errors;
+    erase_done = true;
+}
+
+/*******************************************************************************
+ * @brief Called from the flash interrupt once queued data is written, any
+ *        failure aborting the update at the next pass of the loop
+ ******************************************************************************/
+static void flash_write_done(uint32_t errors, void* context) {
+    (void)context;
+    flash_errors |= errors;
+}
+
 /*******************************************************************************
  * @brief Checks bootloader update timeout and aborts if it has expired
+ * 
+ * @note Only called while waiting on the host, so until the timeout expires 
+ *       the core sleeps until the next UART byte rather than spinning
  ******************************************************************************/
 static void check_update_timeout(void) {
     if (simple_timer_check_has_expired(&timer)) {
         abort_fw_update();
+    } else {
+        system_sleep_until(timer.target_time, uart_data_available);
+    }
+}
+
+/*******************************************************************************
+ * @brief Announces an application-requested update session to the host
+ * 
+ * @param session_token The token the application was given by the host
+ * 
+ * @note Replaces the sync observed packet, with the session token following
+ *       BL_PACKET_SYNC_OBSERVED_DATA0 as a little-endian uint32_t
+ ******************************************************************************/
+static void announce_update_session(uint32_t session_token) {
+    comms_create_single_byte_packet(&packet, BL_PACKET_SYNC_OBSERVED_DATA0);
+    packet.length = 5;
+    packet.data[1] = (uint8_t)(session_token);
+    packet.data[2] = (uint8_t)(session_token >> 8);
+    packet.data[3] = (uint8_t)(session_token >> 16);
+    packet.data[4] = (uint8_t)(session_token >> 24);
+    packet.crc = comms_compute_crc(&packet);
+    comms_send_packet(&packet);
+}
+
+/*******************************************************************************
+ * @brief Check if a given packet is a firmware update request
+ *
+ * @param verify_packet Pointer to the packet to check
+ * @param options Pointer to write the requested BL_FW_UPDATE_OPTION_* bits to
+ * @return True if the packet is a firmware update request, False otherwise
+ * 
+ * @note A firmware update request is a single byte packet, or a 2 byte packet 
+ *       with the second byte holding options for the rest of the update
+ ******************************************************************************/
+static bool is_fw_update_request_packet(const comms_packet_t* verify_packet,
+    uint8_t* options) {
+    if (verify_packet->length != 1 && verify_packet->length != 2) {
+        return false;
+    }
+
+    if (verify_packet->data[0] != BL_PACKET_FW_UPDATE_REQUEST_DATA0) {
+        return false;
     }
+
+    for (uint8_t i = verify_packet->length; i < PACKET_DATA_LENGTH; ++i) {
+        if (verify_packet->data[i] != 0xFF) {
+            return false;
+        }
+    }
+
+    *options = (verify_packet->length == 2) ? verify_packet->data[1] : 0;
+    
+    return true;
+}
+
+/*******************************************************************************
+ * @brief Reads a little-endian uint32_t, at any alignment
+ ******************************************************************************/
+static uint32_t read_u32_le(const uint8_t* bytes) {
+    return ((uint32_t)bytes[0])       |
+           ((uint32_t)bytes[1]) << 8  |
+           ((uint32_t)bytes[2]) << 16 |
+           ((uint32_t)bytes[3]) << 24;
+}
+
+/*******************************************************************************
+ * @brief Reads a little-endian uint16_t, at any alignment
+ ******************************************************************************/
+static uint16_t read_u16_le(const uint8_t* bytes) {
+    return (uint16_t)(bytes[0] | (bytes[1] << 8));
+}
+
+/*******************************************************************************
+ * @brief Writes a little-endian uint32_t, at any alignment
+ ******************************************************************************/
+static void write_u32_le(uint8_t* bytes, uint32_t value) {
+    bytes[0] = (uint8_t)(value);
+    bytes[1] = (uint8_t)(value >> 8);
+    bytes[2] = (uint8_t)(value >> 16);
+    bytes[3] = (uint8_t)(value >> 24);
+}
+
+/*******************************************************************************
+ * @brief Check if a given packet is a command with a fixed layout
+ *
+ * @param verify_packet Pointer to the packet to check
+ * @param data0 The tag the command starts with
+ * @param length The length of the command, including its tag
+ * @return True if the packet is such a command, False otherwise
+ * 
+ * @note As with single byte packets, unused data bytes must be 0xFF
+ ******************************************************************************/
+static bool is_command_packet(const comms_packet_t* verify_packet, 
+    uint8_t data0, uint8_t length) {
+    if (verify_packet->length != length) {
+        return false;
+    }
+
+    if (verify_packet->data[0] != data0) {
+        return false;
+    }
+
+    for (uint8_t i = length; i < PACKET_DATA_LENGTH; ++i) {
+        if (verify_packet->data[i] != 0xFF) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*******************************************************************************
+ * @brief Check a firmware length offered by the host
+ *
+ * @param length The length of the firmware the host wants to send
+ * @return True if the length can be accepted, False otherwise
+ * 
+ * @note  Too short for an image to ever validate is refused, as is a length 
+ *        other than the one agreed through the application, if any
+ ******************************************************************************/
+static bool is_acceptable_fw_length(uint32_t length) {
+    bool length_expected = update_request.fw_length == 0
+        || update_request.fw_length == length;
+
+    return length >= MIN_FW_LENGTH && length <= MAX_FW_LENGTH 
+        && length_expected;
+}
+
+/*******************************************************************************
+ * @brief Answers a begin session command with what the host needs to know 
+ *        about this bootloader and the firmware it currently holds
+ * 
+ * @note  See BL_SESSION_RESPONSE_LENGTH for the layout. The firmware info is
+ *        sent as found, erased flash reading as 0xFF.
+ ******************************************************************************/
+static void send_session_response(void) {
+    const firmware_info_t* info = (const firmware_info_t*)FWINFO_ADDRESS;
+
+    comms_create_single_byte_packet(&packet, BL_PACKET_SESSION_RESPONSE_DATA0);
+    packet.length = BL_SESSION_RESPONSE_LENGTH;
+    packet.data[1] = BL_CAPABILITY_COBS | BL_CAPABILITY_SPARSE 
+        | BL_CAPABILITY_BLOCKS | BL_CAPABILITY_QUERY_CRC | BL_CAPABILITY_STATS 
+        | BL_CAPABILITY_TRACE | BL_CAPABILITY_SEQUENCE;
+    packet.data[2] = (uint8_t)(BOOTLOADER_VERSION);
+    packet.data[3] = (uint8_t)(BOOTLOADER_VERSION >> 8);
+    packet.data[4] = (uint8_t)(info->device_id);
+    write_u32_le(&packet.data[5], info->version);
+    write_u32_le(&packet.data[9], info->length);
+    packet.crc = comms_compute_crc(&packet);
+    comms_send_packet(&packet);
+}
+
+/*******************************************************************************
+ * @brief Tells the host the bootloader is ready for the next packet
+ * 
+ * @note  In a sequenced transfer the packets taken so far follow the tag, see
+ *        BL_READY_SEQUENCED_LENGTH
+ ******************************************************************************/
+static void send_ready(void) {
+    comms_create_single_byte_packet(&packet, BL_PACKET_READY_FOR_DATA_DATA0);
+    if (sequenced_transfer) {
+        packet.length = BL_READY_SEQUENCED_LENGTH;
+        write_u32_le(&packet.data[1], packets_taken);
+        packet.crc = comms_compute_crc(&packet);
+    }
+    comms_send_packet(&packet);
+}
+
+/*******************************************************************************
+ * @brief Takes the sequence bit off a packet of a sequenced transfer
+ *
+ * @param sequenced_packet The packet received, its length left without the bit
+ * @return True if the packet is new, False if it repeats the last one taken
+ ******************************************************************************/
+static bool take_sequenced_packet(comms_packet_t* sequenced_packet) {
+    uint8_t sequence = sequenced_packet->length & BL_PACKET_SEQUENCE_BIT;
+
+    if (sequence == last_sequence) {
+        return false;
+    }
+
+    last_sequence = sequence;
+    sequenced_packet->length &= (uint8_t)~BL_PACKET_SEQUENCE_BIT;
+    packets_taken++;
+    return true;
+}
+
+/*******************************************************************************
+ * @brief Start receiving the extent described by an extent header
+ *
+ * @param extent_packet The extent header packet
+ * @return True if the extent was accepted, False otherwise
+ * 
+ * @note  Extents must go forwards and stay within the announced firmware 
+ *        length, so no flash is written twice or outside the image
+ ******************************************************************************/
+static bool begin_extent(const comms_packet_t* extent_packet) {
+    uint32_t offset = read_u32_le(&extent_packet->data[1]);
+    uint32_t length = read_u32_le(&extent_packet->data[5]);
+
+    if (offset < fw_bytes_written || offset > fw_length 
+        || length > fw_length - offset) {
+        return false;
+    }
+
+    fw_bytes_written = offset;
+    extent_remaining = length;
+    return true;
+}
+
+/*******************************************************************************
+ * @brief Answers a query blocks command with which blocks have been written
+ *
+ * @param first_block The first block the host wants to know about
+ * 
+ * @note  See BL_BLOCKS_PER_QUERY for the layout. Blocks past the end of the
+ *        image are reported as missing.
+ ******************************************************************************/
+static void send_blocks(uint32_t first_block) {
+    uint32_t block_count = (fw_length + BL_BLOCK_SIZE - 1) / BL_BLOCK_SIZE;
+
+    comms_create_single_byte_packet(&packet, BL_PACKET_BLOCKS_DATA0);
+    packet.length = BL_BLOCKS_LENGTH;
+    packet.data[1] = (uint8_t)(first_block);
+    packet.data[2] = (uint8_t)(first_block >> 8);
+    memset(&packet.data[3], 0, BL_BLOCKS_LENGTH - 3);
+
+    for (uint32_t i = 0; i < BL_BLOCKS_PER_QUERY; ++i) {
+        uint32_t block = first_block + i;
+        if (block < block_count 
+            && (block_bitmap[block / 8] & (1U << (block % 8)))) {
+            packet.data[3 + i / 8] |= (uint8_t)(1U << (i % 8));
+        }
+    }
+
+    packet.crc = comms_compute_crc(&packet);
+    comms_send_packet(&packet);
+}
+
+/*******************************************************************************
+ * @brief Answers a query CRC command with the CRC-32 of the range it names
+ *
+ * @param query_packet The query CRC packet
+ * @return True if the range was answered, False if it is not within the
+ *         application region
+ * 
+ * @note  See BL_CRC_LENGTH for the layout. Flash is memory-mapped, so the 
+ *        CRC is computed in place. Lets the host check what flash holds, or 
+ *        bisect to a corrupted range, without reading it back over UART.
+ ******************************************************************************/
+static bool send_crc(const comms_packet_t* query_packet) {
+    uint32_t offset = read_u32_le(&query_packet->data[1]);
+    uint32_t length = read_u32_le(&query_packet->data[5]);
+
+    if (offset > MAX_FW_LENGTH || length > MAX_FW_LENGTH - offset) {
+        return false;
+    }
+
+    bl_flash_wait_idle(); // queued writes first, so the CRC covers them
+    uint32_t crc = crc32((const uint8_t*)(MAIN_APP_START_ADDRESS + offset), 
+        length);
+
+    comms_create_single_byte_packet(&packet, BL_PACKET_CRC_DATA0);
+    packet.length = BL_CRC_LENGTH;
+    write_u32_le(&packet.data[1], offset);
+    write_u32_le(&packet.data[5], length);
+    write_u32_le(&packet.data[9], crc);
+    packet.crc = comms_compute_crc(&packet);
+    comms_send_packet(&packet);
+    return true;
+}
+
+/*******************************************************************************
+ * @brief Clamps a count to what fits in a uint8_t
+ ******************************************************************************/
+static uint8_t saturate_u8(uint32_t value) {
+    return value > 0xFFU ? 0xFFU : (uint8_t)value;
+}
+
+/*******************************************************************************
+ * @brief Writes a little-endian uint16_t, clamping values which do not fit
+ ******************************************************************************/
+static void write_u16_le_saturated(uint8_t* bytes, uint32_t value) {
+    if (value > 0xFFFFU) {
+        value = 0xFFFFU;
+    }
+    bytes[0] = (uint8_t)(value);
+    bytes[1] = (uint8_t)(value >> 8);
+}
+
+/*******************************************************************************
+ * @brief Sends the UART, packet layer and flash counters in one packet
+ * 
+ * @note  See BL_STATS_LENGTH for the layout. Tells the host whether a slow 
+ *        session was down to the line, the packet layer or flash.
+ ******************************************************************************/
+static void send_stats(void) {
+    const uart_stats_t* uart_stats = uart_get_stats();
+    const comms_stats_t* comms_stats = comms_get_stats();
+    const bl_flash_stats_t* flash_stats = bl_flash_get_stats();
+
+    comms_create_single_byte_packet(&packet, BL_PACKET_STATS_DATA0);
+    packet.length = BL_STATS_LENGTH;
+    write_u16_le_saturated(&packet.data[1], uart_stats->rx_bytes / 1024U);
+    write_u16_le_saturated(&packet.data[3], uart_stats->tx_bytes / 1024U);
+    packet.data[5] = saturate_u8(uart_stats->overruns);
+    packet.data[6] = saturate_u8(uart_stats->rx_dropped);
+    packet.data[7] = saturate_u8(comms_stats->crc_errors);
+    packet.data[8] = saturate_u8(comms_stats->retx_sent);
+    packet.data[9] = saturate_u8(comms_stats->retx_received);
+    packet.data[10] = saturate_u8(comms_stats->ring_high_water);
+    packet.data[11] = saturate_u8(comms_stats->ring_full);
+    write_u16_le_saturated(&packet.data[12], flash_stats->erase_us / 1000U);
+    write_u16_le_saturated(&packet.data[14], flash_stats->program_us / 1000U);
+    packet.crc = comms_compute_crc(&packet);
+    comms_send_packet(&packet);
+}
+
+/*******************************************************************************
+ * @brief Answers a query trace command with one record of the trace ring
+ *
+ * @param query_packet The query trace packet
+ * @return True if the record was sent, False if there is no such record
+ * 
+ * @note  See BL_TRACE_LENGTH for the layout. Tracing stops at the first 
+ *        query, until the next boot.
+ ******************************************************************************/
+static bool send_trace_record(const comms_packet_t* query_packet) {
+    uint16_t index = read_u16_le(&query_packet->data[1]);
+    trace_record_t record;
+
+    trace_freeze();
+    if (!trace_get(index, &record)) {
+        return false;
+    }
+
+    uint32_t count = trace_count();
+    comms_create_single_byte_packet(&packet, BL_PACKET_TRACE_DATA0);
+    packet.length = BL_TRACE_LENGTH;
+    packet.data[1] = (uint8_t)(index);
+    packet.data[2] = (uint8_t)(index >> 8);
+    packet.data[3] = (uint8_t)(count);
+    packet.data[4] = (uint8_t)(count >> 8);
+    packet.data[5] = (uint8_t)(rcc_ahb_frequency / 1000000U);
+    write_u32_le(&packet.data[6], record.timestamp);
+    packet.data[10] = record.event;
+    packet.data[11] = record.arg0;
+    packet.data[12] = (uint8_t)(record.arg1);
+    packet.data[13] = (uint8_t)(record.arg1 >> 8);
+    packet.crc = comms_compute_crc(&packet);
+    comms_send_packet(&packet);
+    return true;
+}
+
+/*******************************************************************************
+ * @brief Answers a query CRC, stats or trace command received mid-transfer
+ *
+ * @param query_packet The packet received
+ * @return True if the query was answered, False if the packet is no query or
+ *         asks for something there is no answer to
+ ******************************************************************************/
+static bool answer_query(const comms_packet_t* query_packet) {
+    if (is_command_packet(query_packet, BL_PACKET_QUERY_CRC_DATA0, 
+        BL_QUERY_CRC_LENGTH)) {
+        return send_crc(query_packet);
+    }
+    if (is_command_packet(query_packet, BL_PACKET_QUERY_STATS_DATA0, 1)) {
+        send_stats();
+        return true;
+    }
+    if (is_command_packet(query_packet, BL_PACKET_QUERY_TRACE_DATA0, 
+        BL_QUERY_TRACE_LENGTH)) {
+        return send_trace_record(query_packet);
+    }
+
+    return false;
+}
+
+/*******************************************************************************
+ * @brief Handles a packet received during a block transfer
+ *
+ * @param block_packet The packet received
+ * @return True if the transfer goes on, False if it must be aborted
+ * 
+ * @note  Between blocks a command is expected, otherwise data for the block 
+ *        being received. Blocks are buffered whole and written once, so a 
+ *        block sent again after a lost READY is not programmed twice.
+ ******************************************************************************/
+static bool receive_block_packet(const comms_packet_t* block_packet) {
+    if (block_length == 0) {
+        if (is_command_packet(block_packet, BL_PACKET_WRITE_BLOCK_DATA0, 
+            BL_WRITE_BLOCK_LENGTH)) {
+            uint32_t offset = 
+                (uint32_t)read_u16_le(&block_packet->data[1]) * BL_BLOCK_SIZE;
+            if (offset >= fw_length) {
+                return false;
+            }
+
+            block_number = offset / BL_BLOCK_SIZE;
+            block_length = fw_length - offset;
+            if (block_length > BL_BLOCK_SIZE) {
+                block_length = BL_BLOCK_SIZE;
+            }
+            block_filled = 0;
+        } else if (is_command_packet(block_packet, 
+            BL_PACKET_QUERY_BLOCKS_DATA0, BL_QUERY_BLOCKS_LENGTH)) {
+            send_blocks(read_u16_le(&block_packet->data[1]));
+        } else if (is_command_packet(block_packet, 
+            BL_PACKET_END_TRANSFER_DATA0, 1)) {
+            bl_state = BL_STATE_DONE;
+            return true;
+        } else if (!answer_query(block_packet)) {
+            return false;
+        }
+
+        send_ready();
+        return true;
+    }
+
+    // the length byte is untrusted, and must not overrun the block
+    if (block_packet->length == 0 || block_packet->length > PACKET_DATA_LENGTH
+        || block_packet->length > block_length - block_filled) {
+        return false;
+    }
+
+    memcpy(&block_buffer[block_filled], block_packet->data, 
+        block_packet->length);
+    block_filled += block_packet->length;
+
+    if (block_filled == block_length) {
+        uint8_t mask = (uint8_t)(1U << (block_number % 8));
+        if (!(block_bitmap[block_number / 8] & mask)) {
+            if (!bl_flash_submit_write_main_app(block_number * BL_BLOCK_SIZE, 
+                block_buffer, block_length, flash_write_done, NULL)) {
+                return false;
+            }
+            block_bitmap[block_number / 8] |= mask;
+        }
+        block_length = 0;
+    }
+
+    send_ready();
+    return true;
 }
 
 /*******************************************************************************
@@ -195,15 +693,36 @@ static bool is_fw_length_packet(const comms_packet_t* verify_packet) {
 int main(void) {
     // initialize system peripherals
     system_setup();
+    trace_setup(); // needs the cycle counter running
     gpio_setup();
     uart_setup();
     comms_setup();
+    bl_flash_setup();
     shift_register_setup(&sr1);
 
     // initialize module level timer to check fw update timeouts
     simple_timer_setup(&timer, DEFAULT_TIMEOUT, false);
 
+    // the application already agreed on an update with the host, so skip sync
+    if (handoff_take_update_request(&update_request)) {
+        // the record passed its check, but a rate the host cannot use would
+        // lock out recovery, so anything unexpected keeps the default
+        if (handoff_baud_rate_supported(update_request.baud_rate)) {
+            uart_set_baud_rate(update_request.baud_rate);
+        }
+        announce_update_session(update_request.session_token);
+        bl_state = BL_STATE_UPDATE_REQ;
+    }
+
+    int traced_state = -1; // none yet, so the first state is traced too
+
     while (1) {
+        // trace transitions here, wherever in the state machine they happen
+        if ((int)bl_state != traced_state) {
+            trace_event(TRACE_EVENT_STATE, (uint8_t)bl_state, 0U);
+            traced_state = (int)bl_state;
+        }
+
         // TODO: change implementation to utilize packet protocol and state 
         // machine for all states
         
@@ -252,11 +771,72 @@ int main(void) {
                 if (comms_data_available()) {
                     comms_receive_packet(&packet);
                     
-                    if (comms_is_single_byte_packet(&packet, BL_PACKET_FW_UPDATE_REQUEST_DATA0)) {
+                    uint8_t options = 0;
+                    if (is_command_packet(&packet, BL_PACKET_BEGIN_SESSION_DATA0, 
+                        BL_BEGIN_SESSION_LENGTH)) {
+                        // everything the legacy exchanges settle, in one go
+                        uint32_t length = read_u32_le(&packet.data[2]);
+                        options = packet.data[10];
+
+                        // extents and blocks are two ways to skip data, not both
+                        bool layout_conflict = (options & BL_FW_UPDATE_OPTION_SPARSE)
+                            && (options & BL_FW_UPDATE_OPTION_BLOCKS);
+
+                        if (packet.data[1] != DEVICE_ID 
+                            || !is_acceptable_fw_length(length)
+                            || layout_conflict) {
+                            abort_fw_update();
+                            break;
+                        }
+
+                        send_session_response();
+                        if (options & BL_FW_UPDATE_OPTION_COBS) {
+                            comms_set_framing(COMMS_FRAMING_COBS);
+                        }
+
+                        fw_length = length;
+                        sparse_transfer = (options & BL_FW_UPDATE_OPTION_SPARSE) != 0;
+                        block_transfer = (options & BL_FW_UPDATE_OPTION_BLOCKS) != 0;
+                        stats_requested = (options & BL_FW_UPDATE_OPTION_STATS) != 0;
+                        sequenced_transfer = (options & BL_FW_UPDATE_OPTION_SEQUENCE) != 0;
+                        last_sequence = BL_PACKET_SEQUENCE_BIT; // the first is clear
+                        packets_taken = 0;
+                        simple_timer_reset(&timer);
+                        bl_state = BL_STATE_APPLICATION_ERASE;
+                    } else if (is_fw_update_request_packet(&packet, &options)) {
                         comms_create_single_byte_packet(&packet, BL_PACKET_FW_UPDATE_RESPONSE_DATA0);
                         comms_send_packet(&packet);
+
+                        // both sides switch once the response is sent
+                        if (options & BL_FW_UPDATE_OPTION_COBS) {
+                            comms_set_framing(COMMS_FRAMING_COBS);
+                        }
+
                         simple_timer_reset(&timer);
                         bl_state = BL_STATE_DEVICE_ID_REQ;
+                    } else if (is_command_packet(&packet, 
+                        BL_PACKET_QUERY_CRC_DATA0, BL_QUERY_CRC_LENGTH)) {
+                        // checking flash needs no update, wait for whatever
+                        // the host wants next
+                        if (send_crc(&packet)) {
+                            simple_timer_reset(&timer);
+                        } else {
+                            abort_fw_update();
+                        }
+                    } else if (is_command_packet(&packet, 
+                        BL_PACKET_QUERY_STATS_DATA0, 1)) {
+                        send_stats();
+                        simple_timer_reset(&timer);
+                    } else if (is_command_packet(&packet, 
+                        BL_PACKET_QUERY_TRACE_DATA0, BL_QUERY_TRACE_LENGTH)) {
+                        if (send_trace_record(&packet)) {
+                            simple_timer_reset(&timer);
+                        } else {
+                            abort_fw_update();
+                        }
+                    } else if (is_command_packet(&packet, 
+                        BL_PACKET_END_TRANSFER_DATA0, 1)) {
+                        bl_state = BL_STATE_DONE; // nothing erased, just leave
                     } else {
                         abort_fw_update();
                     }
@@ -309,16 +889,10 @@ int main(void) {
                 if (comms_data_available()) {
                     comms_receive_packet(&packet);
 
-                    fw_length = *((uint32_t*)&packet.data[1]);
-                    // fw_length = (
-                    //     (packet.data[1])      |
-                    //     (packet.data[2]) << 8 |
-                    //     (packet.data[3]) << 16|
-                    //     (packet.data[4]) << 24
-                    // );
-                    
+                    fw_length = read_u32_le(&packet.data[1]);
+
                     if (is_fw_length_packet(&packet) 
-                    && fw_length <= MAX_FW_LENGTH) {
+                        && is_acceptable_fw_length(fw_length)) {
                         simple_timer_reset(&timer);
                         bl_state = BL_STATE_APPLICATION_ERASE;
                     } else {
@@ -331,13 +905,35 @@ int main(void) {
 
             case BL_STATE_APPLICATION_ERASE: {
                 shift_register_set_pattern(&sr1, SR_DEBUG_7);
-                bl_flash_erase_main_app(); // can take ~10s
+
+                // queued rather than waited for, the loop runs between the
+                // sectors, though it stalls on flash while each is erased,
+                // which can take ~10s in all
+                if (!erase_submitted) {
+                    erase_done = false;
+                    erase_submitted = bl_flash_submit_erase_main_app(
+                        flash_erase_done, NULL);
+                    if (!erase_submitted) {
+                        abort_fw_update();
+                    }
+                    memset(block_bitmap, 0, sizeof(block_bitmap));
+                    break;
+                }
+                if (!erase_done) {
+                    break;
+                }
+                if (flash_errors != 0) {
+                    abort_fw_update();
+                    break;
+                }
+
+                // the host's ACK of the session response arrives while the
+                // first sector erases, and only its first byte survives the
+                // overrun, which would leave raw framing out of step for good
+                comms_discard_input();
 
                 // send ready for data packet whenever we want to receive data
-                // blocking operation, takes time
-                comms_create_single_byte_packet(&packet, 
-                    BL_PACKET_READY_FOR_DATA_DATA0);
-                comms_send_packet(&packet);
+                send_ready();
 
                 simple_timer_reset(&timer);
                 bl_state = BL_STATE_RECEIVE_FW;
@@ -345,21 +941,81 @@ int main(void) {
 
             case BL_STATE_RECEIVE_FW: {
                 shift_register_set_pattern(&sr1, SR_DEBUG_8);
+                if (flash_errors != 0) {
+                    abort_fw_update();
+                    break;
+                }
+
+                // with the flash queue full, leave packets in the ring until
+                // a write ends, rather than refusing them
+                if (bl_flash_queue_space() == 0) {
+                    break;
+                }
+
                 if (comms_data_available()) {
                     comms_receive_packet(&packet);
+                    simple_timer_reset(&timer);
+
+                    // resent after its ACK was lost, so already handled, but 
+                    // the READY which followed may have been lost as well
+                    if (sequenced_transfer && !take_sequenced_packet(&packet)) {
+                        send_ready();
+                        break;
+                    }
+
+                    if (block_transfer) {
+                        if (!receive_block_packet(&packet)) {
+                            abort_fw_update();
+                        }
+                        break;
+                    }
+
+                    // between extents of a sparse transfer, expect the next,
+                    // or a query such as the host checking what was written
+                    if (sparse_transfer && extent_remaining == 0) {
+                        if (!is_command_packet(&packet, BL_PACKET_EXTENT_DATA0, 
+                            BL_EXTENT_LENGTH)) {
+                            if (answer_query(&packet)) {
+                                send_ready();
+                            } else {
+                                abort_fw_update();
+                            }
+                        } else if (read_u32_le(&packet.data[5]) == 0) {
+                            bl_state = BL_STATE_DONE; // the end of the image
+                        } else if (!begin_extent(&packet)) {
+                            abort_fw_update();
+                        } else {
+                            send_ready();
+                        }
+                        break;
+                    }
+
+                    // the length byte is untrusted, and must not take the 
+                    // write past the data, the extent or the announced length
+                    uint32_t writable = sparse_transfer ? extent_remaining
+                        : fw_length - fw_bytes_written;
+                    if (packet.length == 0 || packet.length > PACKET_DATA_LENGTH
+                        || packet.length > writable) {
+                        abort_fw_update();
+                        break;
+                    }
                     
-                    // write packet data to flash memory
-                    bl_flash_write_main_app(MAIN_APP_START_ADDRESS 
-                        + fw_bytes_written, packet.data, packet.length);
+                    // queue packet data to be written to flash memory, READY
+                    // going out while it is programmed
+                    if (!bl_flash_submit_write_main_app(fw_bytes_written, 
+                        packet.data, packet.length, flash_write_done, NULL)) {
+                        abort_fw_update();
+                        break;
+                    }
                     fw_bytes_written += packet.length;
-
-                    simple_timer_reset(&timer);
+                    if (sparse_transfer) {
+                        extent_remaining -= packet.length;
+                    }
                     
-                    if (fw_bytes_written >= fw_length) {
+                    if (!sparse_transfer && fw_bytes_written >= fw_length) {
                         bl_state = BL_STATE_DONE;
                     } else {
-                        comms_create_single_byte_packet(&packet, BL_PACKET_READY_FOR_DATA_DATA0);
-                        comms_send_packet(&packet);
+                        send_ready();
                     }
                 } else {
                     check_update_timeout();
@@ -368,20 +1024,42 @@ int main(void) {
 
             case BL_STATE_DONE: {   
                 shift_register_set_pattern(&sr1, 0xFF); 
+
+                // the last writes may still be queued, and may yet fail
+                if (!bl_flash_is_idle()) {
+                    break;
+                }
+                if (flash_errors != 0) {
+                    flash_errors = 0; // reported once, then on as any abort
+                    abort_fw_update();
+                    break;
+                }
+
+                // check the image before claiming success, so one corrupted
+                // on the way fails the update at the host rather than quietly
+                trace_event(TRACE_EVENT_VALIDATE_START, 0U, 0U);
+                bool valid = validate_firmware_image();
+                trace_event(TRACE_EVENT_VALIDATE_END, valid ? 1U : 0U, 0U);
+
+                if (stats_requested) {
+                    send_stats();
+                }
+                // leaving without an update keeps to success, valid or not
                 comms_create_single_byte_packet(&packet, 
-                    BL_PACKET_UPDATE_SUCCESS_DATA0);
+                    (valid || !erase_submitted) ? BL_PACKET_UPDATE_SUCCESS_DATA0
+                    : BL_PACKET_NACK_DATA0);
                 comms_send_packet(&packet);
 
                 // led_debug(DEBUG_4); // indicate update success
                 
                 system_delay(200); // arbitrary delay to allow packet to send
 
-                gpio_teardown();
                 uart_teardown();
                 system_teardown();
                 shift_register_teardown();
 
-                if (validate_firmware_image()) {
+                if (valid) {
+                    gpio_teardown();
                     jump_to_main();
                 } else {
                     scb_reset_system(); // reset system if firmware is invalid
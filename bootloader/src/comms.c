@@ -8,6 +8,7 @@
 #include "comms.h"
 #include "core/uart.h"
 #include "core/crc.h"
+#include "core/trace.h"
 
 #define PACKET_BUFFER_LENGTH (8)
 
@@ -24,9 +25,14 @@ typedef struct comms_ring_buffer_t {
     uint32_t tail;
 } comms_ring_buffer_t;
 
+static comms_framing_t framing = COMMS_FRAMING_RAW;
 static comms_state_t state = CommsState_Length;
 static uint8_t data_index = 0;
 
+// encoded frame being received, when using COBS framing
+static uint8_t cobs_frame[PACKET_COBS_FRAME_LENGTH] = {0U};
+static uint8_t cobs_index = 0;
+
 // temp packet for storing data
 static comms_packet_t temp_packet = { .length = 0, .data = {0}, .crc = 0 };
 static comms_packet_t retx_packet = { .length = 0, .data = {0}, .crc = 0 };
@@ -35,6 +41,8 @@ static comms_packet_t last_transmit_packet = {
     .length = 0, .data = {0}, .crc = 0 
 }; 
 
+static comms_stats_t stats = {0U};
+
 static comms_packet_t packet_buffer[PACKET_BUFFER_LENGTH] = {0U};
 static comms_ring_buffer_t packet_ring_buffer = { 
     .buffer = packet_buffer,
@@ -100,6 +108,69 @@ bool comms_is_single_byte_packet(comms_packet_t* packet, uint8_t data0) {
     return true;
 }
 
+/*******************************************************************************
+ * @brief COBS encode a packet, so that it contains no delimiter bytes
+ * 
+ * @param src Pointer to the PACKET_LENGTH bytes to encode
+ * @param dest Pointer to PACKET_COBS_FRAME_LENGTH bytes to write into
+ * 
+ * @note Every run of non-zero bytes is preceded by a code byte holding its 
+ *       length plus one, standing in for the zero which followed it. Runs are
+ *       never long enough for the 0xFF code, which has no implied zero.
+ ******************************************************************************/
+static void comms_cobs_encode(const uint8_t* src, uint8_t* dest) {
+    uint8_t code_index = 0;
+    uint8_t write_index = 1;
+    uint8_t code = 1;
+
+    for (uint8_t i = 0; i < PACKET_LENGTH; ++i) {
+        if (src[i] == PACKET_COBS_DELIMITER) {
+            dest[code_index] = code;
+            code_index = write_index++;
+            code = 1;
+        } else {
+            dest[write_index++] = src[i];
+            code++;
+        }
+    }
+
+    dest[code_index] = code;
+}
+
+/*******************************************************************************
+ * @brief Decode a COBS frame back into a packet
+ * 
+ * @param src Pointer to the PACKET_COBS_FRAME_LENGTH bytes of the frame
+ * @param dest Pointer to the PACKET_LENGTH bytes to write into
+ * @return True if the frame decoded to exactly one packet, False otherwise
+ ******************************************************************************/
+static bool comms_cobs_decode(const uint8_t* src, uint8_t* dest) {
+    uint8_t read_index = 0;
+    uint8_t write_index = 0;
+
+    while (read_index < PACKET_COBS_FRAME_LENGTH) {
+        uint8_t code = src[read_index++];
+
+        for (uint8_t i = 1; i < code; ++i) {
+            if (read_index >= PACKET_COBS_FRAME_LENGTH 
+                || write_index >= PACKET_LENGTH) {
+                return false;
+            }
+            dest[write_index++] = src[read_index++];
+        }
+
+        // the last run of the frame has no zero following it
+        if (read_index < PACKET_COBS_FRAME_LENGTH) {
+            if (write_index >= PACKET_LENGTH) {
+                return false;
+            }
+            dest[write_index++] = PACKET_COBS_DELIMITER;
+        }
+    }
+
+    return write_index == PACKET_LENGTH;
+}
+
 /*******************************************************************************
  * @brief Setup the communication peripheral
  ******************************************************************************/
@@ -108,6 +179,138 @@ void comms_setup(void) {
     comms_create_single_byte_packet(&ack_packet, PACKET_ACK_DATA0);
 }
 
+/*******************************************************************************
+ * @brief Select how packets are framed on the wire, for both directions
+ * 
+ * @param new_framing The framing to use from now on
+ * 
+ * @note Any partially received packet is discarded
+ ******************************************************************************/
+void comms_set_framing(comms_framing_t new_framing) {
+    framing = new_framing;
+    state = CommsState_Length;
+    data_index = 0;
+    cobs_index = 0;
+}
+
+/*******************************************************************************
+ * @brief Drop every byte received but not yet parsed, and any partially
+ *        received packet
+ * 
+ * @note  For after a stall, as while a flash sector erases, through which the
+ *        UART overruns and keeps only the first byte of whatever arrived. Raw
+ *        framing cannot find the start of a packet again, so a byte left over
+ *        would put every later packet out of step. Packets already in the 
+ *        ring passed their CRC and are kept.
+ ******************************************************************************/
+void comms_discard_input(void) {
+    while (uart_data_available()) {
+        (void)uart_receive_byte();
+    }
+
+    state = CommsState_Length;
+    data_index = 0;
+    cobs_index = 0;
+}
+
+/*******************************************************************************
+ * @brief Act on a completely received packet held in temp_packet
+ * 
+ * @note  Corrupted packets are answered with a retransmit request, control
+ *        packets are handled here, and anything else is stored in the ring 
+ *        buffer and acknowledged
+ ******************************************************************************/
+static void comms_handle_packet(void) {
+    uint8_t calculated_crc = comms_compute_crc(&temp_packet);
+
+    // check if received packet was corrupted
+    if (temp_packet.crc != calculated_crc) {
+        trace_event(TRACE_EVENT_PACKET_BAD, TRACE_BAD_CRC, 0U);
+        stats.crc_errors++;
+        stats.retx_sent++;
+        comms_send_packet(&retx_packet);
+        return;
+    } 
+
+    trace_event(TRACE_EVENT_PACKET_RX, temp_packet.data[0], 
+        temp_packet.length);
+
+    // check if received packet was retx packet
+    if (comms_is_special_packet(&temp_packet, &retx_packet)) {
+        stats.retx_received++;
+        comms_send_packet(&last_transmit_packet);
+        return;
+    }
+
+    // check if received packet was ack packet
+    if (comms_is_special_packet(&temp_packet, &ack_packet)) {
+        return;
+    }
+
+    // packet was good, store it in the ring buffer
+
+    // with no room, ask for it again rather than lose it, by which time the 
+    // state machine will have taken packets out
+    uint32_t next_write_index = (packet_ring_buffer.tail + 1) 
+        & packet_ring_buffer.mask;
+    if (next_write_index == packet_ring_buffer.head) {
+        trace_event(TRACE_EVENT_PACKET_BAD, TRACE_BAD_RING_FULL, 0U);
+        stats.ring_full++;
+        stats.retx_sent++;
+        comms_send_packet(&retx_packet);
+        return;
+    }
+
+    comms_packet_memcpy(&temp_packet, 
+        &packet_ring_buffer.buffer[packet_ring_buffer.tail]);
+    packet_ring_buffer.tail = next_write_index;
+
+    uint32_t waiting = (packet_ring_buffer.tail - packet_ring_buffer.head) 
+        & packet_ring_buffer.mask;
+    if (waiting > stats.ring_high_water) {
+        stats.ring_high_water = waiting;
+    }
+    comms_send_packet(&ack_packet);
+}
+
+/*******************************************************************************
+ * @brief Parse one received byte of a COBS framed packet
+ * 
+ * @param byte The received byte
+ * 
+ * @note  A delimiter always ends the frame, so after lost or extra bytes the 
+ *        parser is back in step by the next packet. A frame of the wrong 
+ *        length is answered like a corrupted packet.
+ ******************************************************************************/
+static void comms_update_cobs(uint8_t byte) {
+    if (byte != PACKET_COBS_DELIMITER) {
+        if (cobs_index < PACKET_COBS_FRAME_LENGTH) {
+            cobs_frame[cobs_index] = byte;
+        }
+        // keep counting past the end, so an overlong frame is still rejected
+        if (cobs_index <= PACKET_COBS_FRAME_LENGTH) {
+            cobs_index++;
+        }
+        return;
+    }
+
+    // empty frames carry nothing, they may be sent just to flush the line
+    if (cobs_index == 0) {
+        return;
+    }
+
+    if (cobs_index == PACKET_COBS_FRAME_LENGTH 
+        && comms_cobs_decode(cobs_frame, (uint8_t*)&temp_packet)) {
+        comms_handle_packet();
+    } else {
+        trace_event(TRACE_EVENT_PACKET_BAD, TRACE_BAD_FRAMING, 0U);
+        stats.crc_errors++;
+        stats.retx_sent++;
+        comms_send_packet(&retx_packet);
+    }
+    cobs_index = 0;
+}
+
 /*******************************************************************************
  * @brief Receive UART data and parse it into packets
  * 
@@ -117,6 +320,11 @@ void comms_setup(void) {
  ******************************************************************************/
 void comms_update(void) {
     while (uart_data_available()) {
+        if (framing == COMMS_FRAMING_COBS) {
+            comms_update_cobs(uart_receive_byte());
+            continue;
+        }
+
         switch (state) {
             case CommsState_Length: {
                 temp_packet.length = uart_receive_byte();
@@ -135,42 +343,7 @@ void comms_update(void) {
 
             case CommsState_CRC: {
                 temp_packet.crc = uart_receive_byte();
-                uint8_t calculated_crc = comms_compute_crc(&temp_packet);
-
-                // check if received packet was corrupted
-                if (temp_packet.crc != calculated_crc) {
-                    comms_send_packet(&retx_packet);
-                    state = CommsState_Length;
-                    break;
-                } 
-
-                // check if received packet was retx packet
-                if (comms_is_special_packet(&temp_packet, &retx_packet)) {
-                    comms_send_packet(&last_transmit_packet);
-                    state = CommsState_Length;
-                    break;
-                }
-
-                // check if received packet was ack packet
-                if (comms_is_special_packet(&temp_packet, &ack_packet)) {
-                    state = CommsState_Length;
-                    break;
-                }
-
-                // packet was good, store it in the ring buffer
-
-                // assert that the ring buffer is not full
-                uint32_t next_write_index = (packet_ring_buffer.tail + 1) 
-                    & packet_ring_buffer.mask;
-                // replace the std assert() call because it broke stuff
-                if (next_write_index == packet_ring_buffer.head) {
-                    __asm__("BKPT #0");
-                }
-
-                comms_packet_memcpy(&temp_packet, 
-                    &packet_ring_buffer.buffer[packet_ring_buffer.tail]);
-                packet_ring_buffer.tail = next_write_index;
-                comms_send_packet(&ack_packet);
+                comms_handle_packet();
                 state = CommsState_Length;
             } break;
 
@@ -196,7 +369,16 @@ bool comms_data_available(void) {
  * @param packet Pointer to the packet to send
  ******************************************************************************/
 void comms_send_packet(comms_packet_t* packet) {
-    uart_send((uint8_t*)packet, PACKET_LENGTH);
+    trace_event(TRACE_EVENT_PACKET_TX, packet->data[0], packet->length);
+
+    if (framing == COMMS_FRAMING_COBS) {
+        uint8_t frame[PACKET_COBS_FRAME_LENGTH];
+        comms_cobs_encode((uint8_t*)packet, frame);
+        uart_send(frame, PACKET_COBS_FRAME_LENGTH);
+        uart_send_byte(PACKET_COBS_DELIMITER);
+    } else {
+        uart_send((uint8_t*)packet, PACKET_LENGTH);
+    }
     comms_packet_memcpy(packet, &last_transmit_packet);
 }
 
@@ -241,3 +423,10 @@ uint8_t comms_compute_crc(comms_packet_t* packet) {
 
     return crc;
 }
+
+/*******************************************************************************
+ * @brief Returns the packet layer counters, which run from boot onwards
+ ******************************************************************************/
+const comms_stats_t* comms_get_stats(void) {
+    return &stats;
+}
@@ -0,0 +1,472 @@
+/*******************************************************************************
+ * @file   bootloader-fuzz.c
+ * @author Camille Alexandra
+ *
+ * @brief  Fuzz target for the bootloader, built for the host from bootloader.c,
+ *         comms.c, uart.c and the ring buffer. An input is what the host sends
+ *         over the UART: each byte is fed to usart1_isr() at line rate on a
+ *         simulated clock, pausing while the bootloader answers, and flash is
+ *         an array behind a fake of bl-flash.h. A run ends where the
+ *         bootloader tears down to leave, and checks that:
+ *         - nothing is programmed outside the application region, or over
+ *           flash which was not erased first
+ *         - the loop never spins without a byte arriving, a flash operation
+ *           ending or a sleep, so it cannot hang
+ *         - the UART ring never drops a byte and the packet ring never holds
+ *           more than it has room for
+ ******************************************************************************/
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libopencm3/stm32/memorymap.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/usart.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/scb.h>
+
+#include "bootloader-fuzz.h"
+#include "common.h"
+#include "comms.h"
+#include "bl-flash.h"
+#include "core/system.h"
+#include "core/uart.h"
+#include "core/shift-register.h"
+#include "core/firmware-info.h"
+
+#define FLASH_SIZE         (1024U * 512U)
+#define OLD_IMAGE_BYTE     (0xA5) // application flash before the erase
+
+#define BYTE_US            (87U)   // a 10 bit character at 115200 baud
+#define PASS_US            (5U)    // a pass of the bootloader loop
+#define PROGRAM_WORD_US    (16U)
+// sectors take 1-2s to erase on the F446, shortened so that a run stays
+// quick, as what matters is the loop carrying on meanwhile
+#define ERASE_SECTOR_US    (500U)
+
+#define STALL_PASSES       (100000U) // passes without progress to call a hang
+#define PACKET_RING_LENGTH (8U)      // comms.c's PACKET_BUFFER_LENGTH
+
+// the main application's sectors, 2 to 7, as bl-flash.c erases them
+static const uint32_t sector_sizes[] = {
+    0x4000U, 0x4000U, 0x10000U, 0x20000U, 0x20000U, 0x20000U,
+};
+#define MAIN_APP_SECTORS (sizeof(sector_sizes) / sizeof(sector_sizes[0]))
+
+typedef struct fake_flash_op_t {
+    bool erase;
+    uint32_t offset; // into the application region
+    uint32_t length;
+    uint8_t data[BL_FLASH_PROGRAM_MAX]; // program only
+    bl_flash_callback_t callback;
+    void* context;
+} fake_flash_op_t;
+
+// the firmware's statics, renamed into these sections by the Makefile so that
+// they can be put back as they were at reset before every run
+extern char __start_fw_data[], __stop_fw_data[];
+extern char __start_fw_bss[], __stop_fw_bss[];
+
+int bootloader_main(void); // bootloader.c's main(), renamed by the Makefile
+
+uint8_t fuzz_flash[FLASH_SIZE];
+volatile uint32_t fuzz_scb_vtor = 0;
+uint32_t rcc_ahb_frequency = CPU_FREQ;
+
+static jmp_buf session_end;
+static char* fw_data_snapshot = NULL;
+static char* fw_bss_snapshot = NULL;
+
+static uint64_t now = 0;
+static uint32_t passes_since_progress = 0;
+
+static const uint8_t* line = NULL; // the input, sent by the host in order
+static size_t line_length = 0;
+static size_t line_index = 0;
+static uint64_t next_byte_time = 0;
+static bool rx_full = false; // a byte waits in the data register
+static uint8_t rx_data = 0;
+
+static fake_flash_op_t flash_queue[BL_FLASH_QUEUE_LENGTH];
+static uint32_t flash_head = 0;
+static uint32_t flash_tail = 0;
+static uint64_t flash_op_end = 0; // when the operation at the head ends
+static bl_flash_stats_t flash_stats = {0U};
+
+/*******************************************************************************
+ * @brief Reports a broken invariant and aborts, so that the fuzzer keeps the
+ *        input which broke it
+ ******************************************************************************/
+static void fuzz_fail(const char* format, ...)
+    __attribute__((noreturn, format(printf, 1, 2)));
+static void fuzz_fail(const char* format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    fprintf(stderr, "INVARIANT: ");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, " (at %llu us, input byte %zu of %zu)\n",
+        (unsigned long long)now, line_index, line_length);
+    va_end(args);
+
+    abort();
+}
+
+/*******************************************************************************
+ * @brief Copies between the firmware's sections and their snapshots
+ *
+ * @note  Not instrumented, as the address sanitizer poisons the redzones it
+ *        leaves between globals
+ ******************************************************************************/
+__attribute__((no_sanitize_address))
+static void copy_section(volatile char* dest, const volatile char* src,
+    size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        dest[i] = src[i];
+    }
+}
+
+/*******************************************************************************
+ * @brief Puts the firmware's statics back as they were at reset, taking a
+ *        snapshot of them the first time
+ ******************************************************************************/
+static void reset_firmware_state(void) {
+    size_t data_length = (size_t)(__stop_fw_data - __start_fw_data);
+    size_t bss_length = (size_t)(__stop_fw_bss - __start_fw_bss);
+
+    if (fw_data_snapshot == NULL) {
+        fw_data_snapshot = malloc(data_length + 1);
+        fw_bss_snapshot = malloc(bss_length + 1);
+        if (fw_data_snapshot == NULL || fw_bss_snapshot == NULL) {
+            abort();
+        }
+        copy_section(fw_data_snapshot, __start_fw_data, data_length);
+        copy_section(fw_bss_snapshot, __start_fw_bss, bss_length);
+        return;
+    }
+
+    copy_section(__start_fw_data, fw_data_snapshot, data_length);
+    copy_section(__start_fw_bss, fw_bss_snapshot, bss_length);
+}
+
+/*******************************************************************************
+ * @brief Returns the time an operation takes once it reaches the flash
+ ******************************************************************************/
+static uint64_t flash_op_duration(const fake_flash_op_t* op) {
+    return op->erase ? ERASE_SECTOR_US
+        : ((op->length + 3U) / 4U) * PROGRAM_WORD_US;
+}
+
+/*******************************************************************************
+ * @brief Ends the operation at the head of the flash queue as the flash
+ *        interrupt would, programming only clearing bits, as on real flash
+ ******************************************************************************/
+static void complete_flash_op(void) {
+    fake_flash_op_t* op = &flash_queue[flash_head % BL_FLASH_QUEUE_LENGTH];
+    uint8_t* region = &fuzz_flash[BOOTLOADER_SIZE + op->offset];
+
+    if (op->erase) {
+        memset(region, 0xFF, op->length);
+        flash_stats.erase_us += (uint32_t)flash_op_duration(op);
+    } else {
+        for (uint32_t i = 0; i < op->length; ++i) {
+            if (region[i] != 0xFF) {
+                fuzz_fail("programmed application offset %u, which was not erased",
+                    op->offset + i);
+            }
+            region[i] &= op->data[i];
+        }
+        flash_stats.program_us += (uint32_t)flash_op_duration(op);
+    }
+
+    ++flash_head;
+    if (flash_head != flash_tail) {
+        flash_op_end = now + flash_op_duration(
+            &flash_queue[flash_head % BL_FLASH_QUEUE_LENGTH]);
+    }
+    passes_since_progress = 0;
+
+    if (op->callback) {
+        op->callback(0U, op->context);
+    }
+}
+
+/*******************************************************************************
+ * @brief Puts the next byte of the input in the data register and runs the
+ *        UART interrupt, which must take it
+ ******************************************************************************/
+static void receive_next_byte(void) {
+    rx_data = line[line_index++];
+    rx_full = true;
+    usart1_isr();
+    if (rx_full) {
+        fuzz_fail("usart1_isr() left a byte in the data register");
+    }
+
+    next_byte_time += BYTE_US;
+    passes_since_progress = 0;
+}
+
+/*******************************************************************************
+ * @brief Moves the clock on, running the interrupts for whatever happens on
+ *        the way, in order
+ *
+ * @param until The time to move the clock to
+ * @param line_paused True while the bootloader sends, as the host waits for
+ *        its answer rather than talking over it
+ ******************************************************************************/
+static void advance_clock(uint64_t until, bool line_paused) {
+    while (1) {
+        bool byte_due = !line_paused && line_index < line_length
+            && next_byte_time <= until;
+        bool flash_due = flash_head != flash_tail && flash_op_end <= until;
+
+        if (byte_due && (!flash_due || next_byte_time <= flash_op_end)) {
+            now = next_byte_time > now ? next_byte_time : now;
+            receive_next_byte();
+        } else if (flash_due) {
+            now = flash_op_end > now ? flash_op_end : now;
+            complete_flash_op();
+        } else {
+            break;
+        }
+    }
+
+    if (until > now) {
+        now = until;
+    }
+    if (line_paused && next_byte_time < now + BYTE_US) {
+        next_byte_time = now + BYTE_US;
+    }
+}
+
+/*******************************************************************************
+ * @brief Called once every pass of the bootloader loop, which costs PASS_US,
+ *        and fails if the loop spins with nothing happening
+ ******************************************************************************/
+static void loop_pass(void) {
+    if (++passes_since_progress > STALL_PASSES) {
+        fuzz_fail("loop spun %u passes with no byte, flash operation or sleep",
+            STALL_PASSES);
+    }
+    advance_clock(now + PASS_US, false);
+}
+
+/*******************************************************************************
+ * @brief Checks what the UART and packet layer counted during a run
+ ******************************************************************************/
+static void check_rings(void) {
+    const uart_stats_t* uart_stats = uart_get_stats();
+    const comms_stats_t* comms_stats = comms_get_stats();
+
+    if (uart_stats->rx_dropped != 0 || uart_stats->overruns != 0) {
+        fuzz_fail("UART ring dropped %u bytes, %u overruns",
+            uart_stats->rx_dropped, uart_stats->overruns);
+    }
+    if (comms_stats->ring_high_water >= PACKET_RING_LENGTH) {
+        fuzz_fail("packet ring held %u packets", comms_stats->ring_high_water);
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    reset_firmware_state();
+
+    // a previous image is installed, so any write not preceded by the erase
+    // programs flash which is not blank
+    memset(fuzz_flash, 0xFF, BOOTLOADER_SIZE);
+    memset(&fuzz_flash[BOOTLOADER_SIZE], OLD_IMAGE_BYTE, MAX_FW_LENGTH);
+
+    now = 0;
+    passes_since_progress = 0;
+    line = data;
+    line_length = size;
+    line_index = 0;
+    next_byte_time = BYTE_US;
+    rx_full = false;
+    flash_head = 0;
+    flash_tail = 0;
+    memset(&flash_stats, 0, sizeof(flash_stats));
+
+    if (setjmp(session_end) == 0) {
+        bootloader_main();
+        fuzz_fail("bootloader main() returned");
+    }
+
+    check_rings();
+    return 0;
+}
+
+/*******************************************************************************
+ * Fake USART1 data register and flags
+ ******************************************************************************/
+bool usart_get_flag(uint32_t usart, uint32_t flag) {
+    (void)usart;
+    return flag == USART_FLAG_RXNE && rx_full;
+}
+
+uint16_t usart_recv(uint32_t usart) {
+    (void)usart;
+    rx_full = false;
+    return rx_data;
+}
+
+void usart_send_blocking(uint32_t usart, uint16_t data) {
+    (void)usart;
+    (void)data;
+    advance_clock(now + BYTE_US, true);
+}
+
+/*******************************************************************************
+ * Fake flash, queued as bl-flash.c queues it, refusing what it refuses, but
+ * failing the run where the bootloader asks for anything out of bounds
+ ******************************************************************************/
+void bl_flash_setup(void) {
+}
+
+uint32_t bl_flash_queue_space(void) {
+    return BL_FLASH_QUEUE_LENGTH - (flash_tail - flash_head);
+}
+
+bool bl_flash_is_idle(void) {
+    return flash_head == flash_tail;
+}
+
+/*******************************************************************************
+ * @brief Queues an operation, starting it if the flash is idle
+ ******************************************************************************/
+static void submit_flash_op(const fake_flash_op_t* op) {
+    if (bl_flash_is_idle()) {
+        flash_op_end = now + flash_op_duration(op);
+    }
+    flash_queue[flash_tail % BL_FLASH_QUEUE_LENGTH] = *op;
+    ++flash_tail;
+}
+
+bool bl_flash_submit_erase_main_app(bl_flash_callback_t callback, void* context) {
+    if (bl_flash_queue_space() < MAIN_APP_SECTORS) {
+        return false;
+    }
+
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < MAIN_APP_SECTORS; ++i) {
+        bool last = (i == MAIN_APP_SECTORS - 1U);
+        fake_flash_op_t op = {
+            .erase = true,
+            .offset = offset,
+            .length = sector_sizes[i],
+            .callback = last ? callback : NULL,
+            .context = context,
+        };
+        submit_flash_op(&op);
+        offset += sector_sizes[i];
+    }
+
+    return true;
+}
+
+bool bl_flash_submit_write_main_app(const uint32_t offset, const uint8_t* data,
+    uint32_t length, bl_flash_callback_t callback, void* context) {
+    if (offset > MAX_FW_LENGTH || length > MAX_FW_LENGTH - offset) {
+        fuzz_fail("write of %u bytes at application offset %u, past MAX_FW_LENGTH",
+            length, offset);
+    }
+    if (length == 0 || length > BL_FLASH_PROGRAM_MAX || bl_flash_queue_space() == 0) {
+        return false;
+    }
+
+    fake_flash_op_t op = {
+        .erase = false,
+        .offset = offset,
+        .length = length,
+        .callback = callback,
+        .context = context,
+    };
+    memcpy(op.data, data, length);
+    submit_flash_op(&op);
+
+    return true;
+}
+
+void bl_flash_wait_idle(void) {
+    while (!bl_flash_is_idle()) {
+        advance_clock(flash_op_end, false);
+    }
+}
+
+const bl_flash_stats_t* bl_flash_get_stats(void) {
+    return &flash_stats;
+}
+
+/*******************************************************************************
+ * Simulated clock, standing in for core/system.c
+ ******************************************************************************/
+void system_setup(void) {
+}
+
+uint64_t system_get_micros(void) {
+    return now;
+}
+
+uint32_t system_get_cycles(void) {
+    return (uint32_t)(now * CLOCK_PROFILE_MHZ);
+}
+
+/*******************************************************************************
+ * @brief Sleeps until the deadline, or the next byte or flash interrupt if
+ *        either comes first
+ ******************************************************************************/
+void system_sleep_until(uint64_t deadline, bool (*work_pending)(void)) {
+    passes_since_progress = 0;
+    if (work_pending && work_pending()) {
+        return;
+    }
+
+    uint64_t wake = deadline;
+    if (line_index < line_length && next_byte_time < wake) {
+        wake = next_byte_time;
+    }
+    if (!bl_flash_is_idle() && flash_op_end < wake) {
+        wake = flash_op_end;
+    }
+    advance_clock(wake, false);
+}
+
+/*******************************************************************************
+ * @brief Only called once the session is over, to let the last packet go out,
+ *        after which nothing received matters
+ ******************************************************************************/
+void system_delay(uint64_t milliseconds) {
+    now += milliseconds * 1000U;
+}
+
+/*******************************************************************************
+ * @brief Where the bootloader leaves, by jumping to the application or by a
+ *        reset, so the run ends here
+ ******************************************************************************/
+void system_teardown(void) {
+    longjmp(session_end, 1);
+}
+
+void scb_reset_system(void) {
+    longjmp(session_end, 1);
+}
+
+/*******************************************************************************
+ * Shift register, whose pattern the bootloader sets on every pass of its loop
+ ******************************************************************************/
+bool shift_register_setup(const ShiftRegister8_t* sr) {
+    (void)sr;
+    return true;
+}
+
+void shift_register_set_pattern(ShiftRegister8_t* sr, uint8_t pattern) {
+    (void)sr;
+    (void)pattern;
+    loop_pass();
+}
+
+void shift_register_teardown(void) {
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// runs the bootloader from reset on one input, the bytes arriving on its UART,
+// aborting if an invariant breaks. The libFuzzer entry point
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
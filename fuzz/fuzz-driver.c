@@ -0,0 +1,751 @@
+/*******************************************************************************
+ * @file   fuzz-driver.c
+ * @author Camille Alexandra
+ *
+ * @brief  Stand-alone driver for bootloader-fuzz.c where libFuzzer is not
+ *         available, built with gcc. Coverage comes from the firmware objects
+ *         being built with -fsanitize-coverage=trace-pc, hashed into an edge
+ *         map as AFL does, and inputs reaching new edges join the corpus. It
+ *         starts from complete update sessions in every transfer mode, and
+ *         besides byte level mutations rewrites whole packets with their
+ *         checksum fixed, so that mutants get past the CRC check.
+ *
+ *         bootloader-fuzz -t <seconds> [-s <seed>] [-o <dir>] [input...]
+ *             fuzz for a time, then report execs/s, saving failing inputs
+ *         bootloader-fuzz -w <dir>
+ *             write the starting sessions out, as a corpus for libFuzzer/AFL
+ *         bootloader-fuzz <input...>
+ *             run each input once, to reproduce a failure (and for AFL's @@)
+ ******************************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bootloader-fuzz.h"
+#include "common.h"
+#include "comms.h"
+#include "core/crc.h"
+#include "core/firmware-info.h"
+
+#define COVERAGE_MAP_SIZE (1U << 16) // a power of 2
+#define CORPUS_MAX        (4096U)
+#define INPUT_MAX         (8192U)
+#define FRAMES_MAX        (512U)     // packets found in an input, for mutating
+#define IMAGE_LENGTH      (1024U)
+#define REPORT_NS         (5000000000ULL)
+
+#define SYNC_SEQUENCE_LENGTH (4U)
+static const uint8_t sync_sequence[SYNC_SEQUENCE_LENGTH] = { 0xC4, 0x55, 0x7E, 0x10 };
+
+typedef struct input_t {
+    uint8_t* data;
+    size_t length;
+} input_t;
+
+// where a packet sits in an input, so that it can be rewritten in place
+typedef struct frame_t {
+    uint32_t offset;
+    bool cobs;
+} frame_t;
+
+// a session being written out as the host would send it
+typedef struct session_t {
+    uint8_t data[INPUT_MAX];
+    size_t length;
+    bool cobs;
+    bool sequenced;
+    uint8_t sequence;
+} session_t;
+
+static uint8_t coverage[COVERAGE_MAP_SIZE];
+static uint8_t seen[COVERAGE_MAP_SIZE]; // hit count buckets reached so far
+static uintptr_t previous_location = 0;
+
+static input_t corpus[CORPUS_MAX];
+static uint32_t corpus_length = 0;
+static uint32_t coverage_points = 0;
+
+static uint64_t rng_state = 1;
+static const char* output_dir = ".";
+static const uint8_t* current_input = NULL; // for saving on failure
+static size_t current_length = 0;
+
+// tags and field values worth trying where a packet is rewritten
+static const uint8_t packet_tags[] = {
+    BL_PACKET_FW_UPDATE_REQUEST_DATA0, BL_PACKET_DEVICE_ID_RESPONSE_DATA0,
+    BL_PACKET_FW_LENGTH_RESPONSE_DATA0, BL_PACKET_BEGIN_SESSION_DATA0,
+    BL_PACKET_EXTENT_DATA0, BL_PACKET_WRITE_BLOCK_DATA0,
+    BL_PACKET_QUERY_BLOCKS_DATA0, BL_PACKET_END_TRANSFER_DATA0,
+    BL_PACKET_QUERY_CRC_DATA0, BL_PACKET_QUERY_STATS_DATA0,
+    BL_PACKET_QUERY_TRACE_DATA0, PACKET_RETX_DATA0, PACKET_ACK_DATA0,
+};
+static const uint32_t interesting_values[] = {
+    0U, 1U, 15U, 16U, 17U, 63U, 64U, 65U, 255U, 256U, IMAGE_LENGTH,
+    IMAGE_LENGTH + 1U, MIN_FW_LENGTH - 1U, MIN_FW_LENGTH, MAX_FW_LENGTH - 1U,
+    MAX_FW_LENGTH, MAX_FW_LENGTH + 1U, MAX_FW_LENGTH / BL_BLOCK_SIZE,
+    0x7FFFFFFFU, 0xFFFFFFF0U, 0xFFFFFFFFU,
+};
+#define ARRAY_LENGTH(array) (sizeof(array) / sizeof((array)[0]))
+
+void __sanitizer_cov_trace_pc(void);
+void __sanitizer_set_death_callback(void (*callback)(void)) __attribute__((weak));
+
+/*******************************************************************************
+ * @brief Called by every basic block of the instrumented firmware objects,
+ *        counting the edge from the previous one
+ ******************************************************************************/
+void __sanitizer_cov_trace_pc(void) {
+    uintptr_t location = (uintptr_t)__builtin_return_address(0);
+
+    location = (location >> 4) ^ (location << 8);
+    coverage[(location ^ previous_location) & (COVERAGE_MAP_SIZE - 1U)]++;
+    previous_location = location >> 1;
+}
+
+/*******************************************************************************
+ * @brief Returns a monotonic wall clock time in nanoseconds
+ ******************************************************************************/
+static uint64_t wall_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000U + (uint64_t)time.tv_nsec;
+}
+
+/*******************************************************************************
+ * @brief xorshift64*, returning a value below bound
+ ******************************************************************************/
+static uint32_t random_below(uint32_t bound) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (uint32_t)((rng_state * 0x2545F4914F6CDD1DULL) >> 32) % bound;
+}
+
+/*******************************************************************************
+ * @brief Writes the input being run when the process dies, so that the
+ *        failure can be replayed. Called from a signal handler, or by the
+ *        sanitizers once they have reported
+ ******************************************************************************/
+static void save_current_input(void) {
+    static const char name[] = "/failure.bin";
+    char path[4096];
+    size_t dir_length = strlen(output_dir);
+
+    if (current_input == NULL || dir_length + sizeof(name) > sizeof(path)) {
+        return;
+    }
+    memcpy(path, output_dir, dir_length);
+    memcpy(&path[dir_length], name, sizeof(name));
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        ssize_t written = write(fd, current_input, current_length);
+        (void)written;
+        close(fd);
+        (void)!write(STDERR_FILENO, "failing input written to ", 25);
+        (void)!write(STDERR_FILENO, path, strlen(path));
+        (void)!write(STDERR_FILENO, "\n", 1);
+    }
+}
+
+static void on_fatal_signal(int signal_number) {
+    save_current_input();
+    signal(signal_number, SIG_DFL);
+    raise(signal_number);
+}
+
+/*******************************************************************************
+ * @brief Runs one input, returning true if it reached coverage not seen before
+ *
+ * @note  Hit counts are bucketed as AFL does, so that a loop running more
+ *        times counts as new only across powers of 2
+ ******************************************************************************/
+static bool run_input(const uint8_t* data, size_t length) {
+    static const uint8_t buckets[8] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+    bool is_new = false;
+
+    memset(coverage, 0, sizeof(coverage));
+    previous_location = 0;
+    current_input = data;
+    current_length = length;
+
+    LLVMFuzzerTestOneInput(data, length);
+
+    for (uint32_t i = 0; i < COVERAGE_MAP_SIZE; ++i) {
+        if (coverage[i] == 0) {
+            continue;
+        }
+        uint8_t bucket = coverage[i] >= 128 ? 7 : 0;
+        while (bucket < 7 && coverage[i] >= (1U << (bucket + 1U))) {
+            bucket++;
+        }
+        if (!(seen[i] & buckets[bucket])) {
+            if (seen[i] == 0) {
+                coverage_points++;
+            }
+            seen[i] |= buckets[bucket];
+            is_new = true;
+        }
+    }
+
+    return is_new;
+}
+
+/*******************************************************************************
+ * @brief Keeps a copy of an input in the corpus, if there is room
+ ******************************************************************************/
+static void corpus_add(const uint8_t* data, size_t length) {
+    if (corpus_length == CORPUS_MAX || length == 0) {
+        return;
+    }
+
+    uint8_t* copy = malloc(length);
+    if (copy == NULL) {
+        return;
+    }
+    memcpy(copy, data, length);
+    corpus[corpus_length++] = (input_t){ copy, length };
+}
+
+/*******************************************************************************
+ * @brief COBS encodes a packet into PACKET_COBS_FRAME_LENGTH bytes, as comms.c
+ *        does
+ ******************************************************************************/
+static void cobs_encode(const uint8_t* src, uint8_t* dest) {
+    uint8_t code_index = 0;
+    uint8_t write_index = 1;
+    uint8_t code = 1;
+
+    for (uint8_t i = 0; i < PACKET_LENGTH; ++i) {
+        if (src[i] == PACKET_COBS_DELIMITER) {
+            dest[code_index] = code;
+            code_index = write_index++;
+            code = 1;
+        } else {
+            dest[write_index++] = src[i];
+            code++;
+        }
+    }
+
+    dest[code_index] = code;
+}
+
+/*******************************************************************************
+ * @brief Decodes a COBS frame back into a packet, false if it is not one
+ ******************************************************************************/
+static bool cobs_decode(const uint8_t* src, uint8_t* dest) {
+    uint8_t read_index = 0;
+    uint8_t write_index = 0;
+
+    while (read_index < PACKET_COBS_FRAME_LENGTH) {
+        uint8_t code = src[read_index++];
+        if (code == 0) {
+            return false;
+        }
+
+        for (uint8_t i = 1; i < code; ++i) {
+            if (read_index >= PACKET_COBS_FRAME_LENGTH || write_index >= PACKET_LENGTH) {
+                return false;
+            }
+            dest[write_index++] = src[read_index++];
+        }
+        if (read_index < PACKET_COBS_FRAME_LENGTH) {
+            if (write_index >= PACKET_LENGTH) {
+                return false;
+            }
+            dest[write_index++] = PACKET_COBS_DELIMITER;
+        }
+    }
+
+    return write_index == PACKET_LENGTH;
+}
+
+/*******************************************************************************
+ * @brief Checks a packet's CRC, as the bootloader will
+ ******************************************************************************/
+static bool packet_crc_ok(uint8_t* packet) {
+    return crc8(packet, PACKET_LENGTH - PACKET_CRC_LENGTH)
+        == packet[PACKET_LENGTH - 1];
+}
+
+/*******************************************************************************
+ * @brief Finds the packets in an input which would pass the CRC check, raw or
+ *        COBS framed
+ ******************************************************************************/
+static uint32_t find_frames(const uint8_t* data, size_t length, frame_t* frames) {
+    uint32_t count = 0;
+    uint8_t packet[PACKET_LENGTH];
+
+    for (size_t i = 0; i + PACKET_LENGTH <= length && count < FRAMES_MAX; ++i) {
+        bool delimited = (i == 0 || data[i - 1] == PACKET_COBS_DELIMITER)
+            && i + PACKET_COBS_FRAME_LENGTH < length
+            && data[i + PACKET_COBS_FRAME_LENGTH] == PACKET_COBS_DELIMITER;
+
+        if (delimited && cobs_decode(&data[i], packet) && packet_crc_ok(packet)) {
+            frames[count++] = (frame_t){ (uint32_t)i, true };
+            i += PACKET_COBS_FRAME_LENGTH;
+            continue;
+        }
+
+        memcpy(packet, &data[i], PACKET_LENGTH);
+        if (packet_crc_ok(packet)) {
+            frames[count++] = (frame_t){ (uint32_t)i, false };
+            i += PACKET_LENGTH - 1U;
+        }
+    }
+
+    return count;
+}
+
+/*******************************************************************************
+ * @brief Writes a little-endian uint32_t, at any alignment
+ ******************************************************************************/
+static void write_u32_le(uint8_t* bytes, uint32_t value) {
+    bytes[0] = (uint8_t)(value);
+    bytes[1] = (uint8_t)(value >> 8);
+    bytes[2] = (uint8_t)(value >> 16);
+    bytes[3] = (uint8_t)(value >> 24);
+}
+
+/*******************************************************************************
+ * @brief Rewrites one field of a packet found in an input, fixing its CRC, so
+ *        that the bootloader acts on the change instead of asking again
+ ******************************************************************************/
+static void mutate_packet(uint8_t* data, const frame_t* frame) {
+    uint8_t packet[PACKET_LENGTH];
+    uint8_t* length = &packet[0];
+    uint8_t* fields = &packet[PACKET_LENGTH_LENGTH];
+
+    if (frame->cobs) {
+        (void)cobs_decode(&data[frame->offset], packet);
+    } else {
+        memcpy(packet, &data[frame->offset], PACKET_LENGTH);
+    }
+
+    switch (random_below(7)) {
+        case 0: *length ^= BL_PACKET_SEQUENCE_BIT; break;
+        case 1: *length = (uint8_t)((*length & BL_PACKET_SEQUENCE_BIT)
+            | random_below(PACKET_DATA_LENGTH + 2U)); break;
+        case 2: fields[0] = packet_tags[random_below(ARRAY_LENGTH(packet_tags))]; break;
+        case 3:
+        case 4: {
+            uint32_t at = 1U + random_below(PACKET_DATA_LENGTH - 4U);
+            write_u32_le(&fields[at],
+                interesting_values[random_below(ARRAY_LENGTH(interesting_values))]);
+        } break;
+        case 5: fields[1 + random_below(2)] = (uint8_t)random_below(256); break;
+        default: fields[random_below(PACKET_DATA_LENGTH)] = (uint8_t)random_below(256); break;
+    }
+
+    packet[PACKET_LENGTH - 1] = crc8(packet, PACKET_LENGTH - PACKET_CRC_LENGTH);
+
+    // a packet with no zeros encodes to the same length, so the frame fits
+    if (frame->cobs) {
+        cobs_encode(packet, &data[frame->offset]);
+    } else {
+        memcpy(&data[frame->offset], packet, PACKET_LENGTH);
+    }
+}
+
+/*******************************************************************************
+ * @brief Moves bytes to open or close a gap at offset, returning the new length
+ ******************************************************************************/
+static size_t shift_tail(uint8_t* data, size_t length, size_t offset,
+    long change) {
+    if (change > 0 && length + (size_t)change > INPUT_MAX) {
+        return length;
+    }
+    if (change < 0 && offset + (size_t)(-change) > length) {
+        return length;
+    }
+
+    memmove(&data[(long)offset + change > 0 ? (size_t)((long)offset + change) : 0],
+        &data[offset], length - offset);
+    return (size_t)((long)length + change);
+}
+
+/*******************************************************************************
+ * @brief Makes a new input from one in the corpus, by stacking mutations
+ ******************************************************************************/
+static size_t mutate(const input_t* parent, uint8_t* data) {
+    static frame_t frames[FRAMES_MAX];
+    size_t length = parent->length;
+    memcpy(data, parent->data, length);
+
+    uint32_t frame_count = find_frames(data, length, frames);
+    uint32_t rounds = 1U + random_below(4);
+
+    for (uint32_t round = 0; round < rounds && length > 0; ++round) {
+        uint32_t choice = random_below(12);
+
+        // packet level changes, in place while frame offsets are still right
+        if (choice < 5 && frame_count > 0) {
+            mutate_packet(data, &frames[random_below(frame_count)]);
+            continue;
+        }
+        frame_count = 0;
+
+        size_t offset = random_below((uint32_t)length);
+        switch (choice) {
+            case 5: data[offset] ^= (uint8_t)(1U << random_below(8)); break;
+            case 6: data[offset] = (uint8_t)random_below(256); break;
+            case 7: { // lost bytes
+                size_t count = 1U + random_below(PACKET_LENGTH);
+                if (offset + count <= length) {
+                    length = shift_tail(data, length, offset + count, -(long)count);
+                }
+            } break;
+            case 8: { // an extra byte
+                size_t new_length = shift_tail(data, length, offset, 1);
+                if (new_length != length) {
+                    data[offset] = (uint8_t)random_below(256);
+                    length = new_length;
+                }
+            } break;
+            case 9: { // a run sent again, such as a resent packet
+                size_t count = 1U + random_below(2U * PACKET_COBS_FRAME_LENGTH);
+                if (offset + count <= length && length + count <= INPUT_MAX) {
+                    memmove(&data[offset + count], &data[offset], length - offset);
+                    length += count;
+                }
+            } break;
+            case 10: { // the session cut short, then another input's tail
+                const input_t* other = &corpus[random_below(corpus_length)];
+                size_t from = random_below((uint32_t)other->length);
+                size_t count = other->length - from;
+                if (offset + count <= INPUT_MAX) {
+                    memcpy(&data[offset], &other->data[from], count);
+                    length = offset + count;
+                }
+            } break;
+            default: length = offset + 1U; break;
+        }
+    }
+
+    return length;
+}
+
+/*******************************************************************************
+ * @brief Appends a packet to a session, sequenced and framed as agreed
+ ******************************************************************************/
+static void session_packet(session_t* session, const uint8_t* fields,
+    uint8_t length) {
+    uint8_t packet[PACKET_LENGTH];
+
+    memset(packet, 0xFF, sizeof(packet));
+    packet[0] = (uint8_t)(length | (session->sequenced ? session->sequence : 0U));
+    memcpy(&packet[PACKET_LENGTH_LENGTH], fields, length);
+    packet[PACKET_LENGTH - 1] = crc8(packet, PACKET_LENGTH - PACKET_CRC_LENGTH);
+    session->sequence ^= BL_PACKET_SEQUENCE_BIT;
+
+    if (session->cobs) {
+        cobs_encode(packet, &session->data[session->length]);
+        session->length += PACKET_COBS_FRAME_LENGTH;
+        session->data[session->length++] = PACKET_COBS_DELIMITER;
+    } else {
+        memcpy(&session->data[session->length], packet, PACKET_LENGTH);
+        session->length += PACKET_LENGTH;
+    }
+}
+
+/*******************************************************************************
+ * @brief Appends a command of a tag and up to two uint32_t fields
+ ******************************************************************************/
+static void session_command(session_t* session, uint8_t tag, uint8_t length,
+    uint32_t first, uint32_t second) {
+    uint8_t fields[PACKET_DATA_LENGTH];
+
+    fields[0] = tag;
+    write_u32_le(&fields[1], first);
+    write_u32_le(&fields[5], second);
+    session_packet(session, fields, length);
+}
+
+/*******************************************************************************
+ * @brief Appends the data packets for a range of the image
+ ******************************************************************************/
+static void session_data(session_t* session, const uint8_t* image,
+    uint32_t offset, uint32_t length) {
+    for (uint32_t sent = 0; sent < length; sent += PACKET_DATA_LENGTH) {
+        uint32_t count = length - sent;
+        if (count > PACKET_DATA_LENGTH) {
+            count = PACKET_DATA_LENGTH;
+        }
+        session_packet(session, &image[offset + sent], (uint8_t)count);
+    }
+}
+
+/*******************************************************************************
+ * @brief Builds a signed image, with an erased range for sparse and block
+ *        transfers to skip
+ ******************************************************************************/
+static void build_image(uint8_t* image) {
+    for (uint32_t i = 0; i < IMAGE_LENGTH; ++i) {
+        image[i] = (uint8_t)(i * 7U + 3U);
+    }
+    memset(&image[512], 0xFF, 320);
+
+    firmware_info_t info = {
+        .sentinel = FWINFO_SENTINEL,
+        .device_id = DEVICE_ID,
+        .version = 1,
+        .length = IMAGE_LENGTH,
+    };
+    memcpy(&image[FWINFO_OFFSET], &info, sizeof(info));
+    firmware_image_signature(image, IMAGE_LENGTH, &image[SIGNATURE_OFFSET]);
+}
+
+/*******************************************************************************
+ * @brief Builds a whole update session, as fw-updater would send it
+ *
+ * @param options BL_FW_UPDATE_OPTION_* bits of a begin session command
+ * @param legacy True for the update request, device ID and length exchanges
+ ******************************************************************************/
+static void build_session(session_t* session, const uint8_t* image,
+    uint8_t options, bool legacy) {
+    memset(session, 0, sizeof(*session));
+    memcpy(session->data, sync_sequence, SYNC_SEQUENCE_LENGTH);
+    session->length = SYNC_SEQUENCE_LENGTH;
+
+    if (legacy) {
+        uint8_t request[2] = { BL_PACKET_FW_UPDATE_REQUEST_DATA0, options };
+        session_packet(session, request, options ? 2 : 1);
+        session->cobs = (options & BL_FW_UPDATE_OPTION_COBS) != 0;
+        uint8_t device_id[2] = { BL_PACKET_DEVICE_ID_RESPONSE_DATA0, DEVICE_ID };
+        session_packet(session, device_id, 2);
+        session_command(session, BL_PACKET_FW_LENGTH_RESPONSE_DATA0, 5,
+            IMAGE_LENGTH, 0);
+        session_data(session, image, 0, IMAGE_LENGTH);
+        return;
+    }
+
+    uint8_t begin[PACKET_DATA_LENGTH] = { BL_PACKET_BEGIN_SESSION_DATA0, DEVICE_ID };
+    write_u32_le(&begin[2], IMAGE_LENGTH);
+    write_u32_le(&begin[6], 1);
+    begin[10] = options;
+    session_packet(session, begin, BL_BEGIN_SESSION_LENGTH);
+
+    session->cobs = (options & BL_FW_UPDATE_OPTION_COBS) != 0;
+    session->sequenced = (options & BL_FW_UPDATE_OPTION_SEQUENCE) != 0;
+    session->sequence = 0;
+
+    if (options & BL_FW_UPDATE_OPTION_SPARSE) {
+        session_command(session, BL_PACKET_EXTENT_DATA0, BL_EXTENT_LENGTH, 0, 512);
+        session_data(session, image, 0, 512);
+        session_command(session, BL_PACKET_QUERY_CRC_DATA0, BL_QUERY_CRC_LENGTH,
+            0, IMAGE_LENGTH);
+        session_command(session, BL_PACKET_EXTENT_DATA0, BL_EXTENT_LENGTH, 832, 192);
+        session_data(session, image, 832, 192);
+        session_command(session, BL_PACKET_EXTENT_DATA0, BL_EXTENT_LENGTH,
+            IMAGE_LENGTH, 0);
+    } else if (options & BL_FW_UPDATE_OPTION_BLOCKS) {
+        // backwards, to be out of order, skipping the erased blocks
+        for (uint32_t block = IMAGE_LENGTH / BL_BLOCK_SIZE; block-- > 0;) {
+            if (block * BL_BLOCK_SIZE >= 512 && block * BL_BLOCK_SIZE < 832) {
+                continue;
+            }
+            session_command(session, BL_PACKET_WRITE_BLOCK_DATA0,
+                BL_WRITE_BLOCK_LENGTH, block, 0);
+            session_data(session, image, block * BL_BLOCK_SIZE, BL_BLOCK_SIZE);
+        }
+        session_command(session, BL_PACKET_QUERY_BLOCKS_DATA0,
+            BL_QUERY_BLOCKS_LENGTH, 0, 0);
+        session_command(session, BL_PACKET_QUERY_TRACE_DATA0,
+            BL_QUERY_TRACE_LENGTH, 0, 0);
+        session_command(session, BL_PACKET_END_TRANSFER_DATA0, 1, 0, 0);
+    } else {
+        session_data(session, image, 0, IMAGE_LENGTH);
+    }
+}
+
+/*******************************************************************************
+ * @brief Adds the starting sessions to the corpus: updates in each transfer
+ *        mode and framing, and queries made without updating
+ ******************************************************************************/
+static void add_seed_sessions(void) {
+    static const uint8_t option_sets[] = {
+        0,
+        BL_FW_UPDATE_OPTION_COBS,
+        BL_FW_UPDATE_OPTION_SEQUENCE,
+        BL_FW_UPDATE_OPTION_COBS | BL_FW_UPDATE_OPTION_SEQUENCE | BL_FW_UPDATE_OPTION_STATS,
+        BL_FW_UPDATE_OPTION_SPARSE,
+        BL_FW_UPDATE_OPTION_SPARSE | BL_FW_UPDATE_OPTION_COBS | BL_FW_UPDATE_OPTION_SEQUENCE,
+        BL_FW_UPDATE_OPTION_BLOCKS,
+        BL_FW_UPDATE_OPTION_BLOCKS | BL_FW_UPDATE_OPTION_COBS | BL_FW_UPDATE_OPTION_SEQUENCE,
+    };
+    static uint8_t image[IMAGE_LENGTH];
+    static session_t session;
+
+    build_image(image);
+    for (uint32_t i = 0; i < ARRAY_LENGTH(option_sets); ++i) {
+        build_session(&session, image, option_sets[i], false);
+        corpus_add(session.data, session.length);
+    }
+    build_session(&session, image, 0, true);
+    corpus_add(session.data, session.length);
+    build_session(&session, image, BL_FW_UPDATE_OPTION_COBS, true);
+    corpus_add(session.data, session.length);
+
+    memset(&session, 0, sizeof(session));
+    memcpy(session.data, sync_sequence, SYNC_SEQUENCE_LENGTH);
+    session.length = SYNC_SEQUENCE_LENGTH;
+    session_command(&session, BL_PACKET_QUERY_CRC_DATA0, BL_QUERY_CRC_LENGTH,
+        0, MAX_FW_LENGTH);
+    session_command(&session, BL_PACKET_QUERY_STATS_DATA0, 1, 0, 0);
+    session_command(&session, BL_PACKET_QUERY_TRACE_DATA0, BL_QUERY_TRACE_LENGTH,
+        1, 0);
+    session_command(&session, BL_PACKET_END_TRANSFER_DATA0, 1, 0, 0);
+    corpus_add(session.data, session.length);
+}
+
+/*******************************************************************************
+ * @brief Reads a whole file into a new input, false if it cannot be read
+ ******************************************************************************/
+static bool read_input(const char* path, input_t* input) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    input->data = malloc(INPUT_MAX);
+    input->length = input->data ? fread(input->data, 1, INPUT_MAX, file) : 0;
+    fclose(file);
+    return input->data != NULL;
+}
+
+/*******************************************************************************
+ * @brief Writes the corpus to a directory, one file per input
+ ******************************************************************************/
+static int write_corpus(const char* dir) {
+    for (uint32_t i = 0; i < corpus_length; ++i) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/session-%02u.bin", dir, i);
+
+        FILE* file = fopen(path, "wb");
+        if (file == NULL) {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            return 1;
+        }
+        fwrite(corpus[i].data, 1, corpus[i].length, file);
+        fclose(file);
+    }
+
+    printf("Wrote %u sessions to %s\n", corpus_length, dir);
+    return 0;
+}
+
+/*******************************************************************************
+ * @brief Fuzzes from the corpus until the time is up, reporting as it goes
+ ******************************************************************************/
+static int fuzz(uint64_t seconds) {
+    static uint8_t data[INPUT_MAX];
+    uint64_t execs = 0;
+    uint64_t start = wall_ns();
+    uint64_t end = start + seconds * 1000000000ULL;
+    uint64_t next_report = start + REPORT_NS;
+    uint32_t seeds = corpus_length;
+
+    for (uint32_t i = 0; i < seeds; ++i) {
+        (void)run_input(corpus[i].data, corpus[i].length);
+        execs++;
+    }
+    printf("%u starting inputs reach %u coverage points\n", seeds, coverage_points);
+
+    uint64_t time = wall_ns();
+    while (time < end) {
+        const input_t* parent = &corpus[random_below(corpus_length)];
+        size_t length = mutate(parent, data);
+
+        if (run_input(data, length)) {
+            corpus_add(data, length);
+        }
+        execs++;
+
+        // the clock is read every so often, as it costs more than some runs
+        if ((execs & 0x3F) == 0) {
+            time = wall_ns();
+            if (time >= next_report) {
+                printf("  %6.0fs: %llu execs, %.0f execs/s, corpus %u, coverage %u\n",
+                    (double)(time - start) / 1e9, (unsigned long long)execs,
+                    (double)execs * 1e9 / (double)(time - start), corpus_length,
+                    coverage_points);
+                fflush(stdout);
+                next_report += REPORT_NS;
+            }
+        }
+    }
+
+    double elapsed = (double)(wall_ns() - start) / 1e9;
+    printf("%llu execs in %.1fs, %.0f execs/s, corpus %u (%u new), coverage %u, "
+        "no invariant broken\n", (unsigned long long)execs, elapsed,
+        (double)execs / elapsed, corpus_length, corpus_length - seeds,
+        coverage_points);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    uint64_t seconds = 0;
+    const char* corpus_dir = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:s:o:w:")) != -1) {
+        switch (opt) {
+            case 't': seconds = strtoull(optarg, NULL, 0); break;
+            case 's': rng_state = strtoull(optarg, NULL, 0) | 1U; break;
+            case 'o': output_dir = optarg; break;
+            case 'w': corpus_dir = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-t seconds] [-s seed] [-o dir] "
+                    "[-w dir] [input...]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    signal(SIGABRT, on_fatal_signal);
+    signal(SIGSEGV, on_fatal_signal);
+    if (__sanitizer_set_death_callback) {
+        __sanitizer_set_death_callback(save_current_input);
+    }
+
+    // replay, each input once
+    if (seconds == 0 && corpus_dir == NULL) {
+        if (optind == argc) {
+            fprintf(stderr, "nothing to do, give inputs to run, -t or -w\n");
+            return 2;
+        }
+        for (int i = optind; i < argc; ++i) {
+            input_t input;
+            if (!read_input(argv[i], &input)) {
+                return 1;
+            }
+            (void)run_input(input.data, input.length);
+            printf("%s: %zu bytes, ok\n", argv[i], input.length);
+            free(input.data);
+        }
+        return 0;
+    }
+
+    add_seed_sessions();
+    for (int i = optind; i < argc; ++i) {
+        input_t input;
+        if (read_input(argv[i], &input)) {
+            corpus_add(input.data, input.length);
+            free(input.data);
+        }
+    }
+
+    if (corpus_dir != NULL) {
+        return write_corpus(corpus_dir);
+    }
+
+    printf("Fuzzing for %llus, seed %llu\n", (unsigned long long)seconds,
+        (unsigned long long)rng_state);
+    return fuzz(seconds);
+}
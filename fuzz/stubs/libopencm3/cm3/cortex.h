@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+
+// host stand-in: interrupts are simulated between loop passes, so masking is
+// a no-op
+static inline uint32_t cm_mask_interrupts(uint32_t mask) {
+    (void)mask;
+    return 0;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+
+// host stand-in: the harness calls usart1_isr() itself as bytes arrive
+#define NVIC_USART1_IRQ (37)
+
+static inline void nvic_enable_irq(uint8_t irqn) {
+    (void)irqn;
+}
+
+static inline void nvic_disable_irq(uint8_t irqn) {
+    (void)irqn;
+}
+
+void usart1_isr(void);
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdint.h>
+
+// host stand-in, provided by the harness
+extern volatile uint32_t fuzz_scb_vtor;
+#define SCB_VTOR fuzz_scb_vtor
+
+void scb_reset_system(void) __attribute__((noreturn));
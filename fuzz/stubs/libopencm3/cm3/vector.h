@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+
+// host stand-in, padded to the target's size for the check in
+// firmware-info.c. Only read by jump_to_main(), which the harness never
+// reaches: the session ends in system_teardown()
+typedef void (*vector_table_entry_t)(void);
+
+typedef struct vector_table_t {
+    uint32_t initial_sp_value;
+    vector_table_entry_t reset;
+    uint8_t reserved[0x1AC - 16];
+} vector_table_t;
@@ -0,0 +1,4 @@
+#pragma once
+
+// host stand-in, included by core/firmware-info.h for FLASH_BASE
+#include <libopencm3/stm32/memorymap.h>
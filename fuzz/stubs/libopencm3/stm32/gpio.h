@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+
+// host stand-in: pins are configured into nothing
+#define GPIOA (0x40020000U)
+#define GPIOB (0x40020400U)
+
+#define GPIO0  (1U << 0)
+#define GPIO1  (1U << 1)
+#define GPIO2  (1U << 2)
+#define GPIO3  (1U << 3)
+#define GPIO4  (1U << 4)
+#define GPIO5  (1U << 5)
+#define GPIO9  (1U << 9)
+#define GPIO10 (1U << 10)
+
+#define GPIO_MODE_INPUT  (0)
+#define GPIO_MODE_AF     (2)
+#define GPIO_MODE_ANALOG (3)
+#define GPIO_PUPD_NONE   (0)
+#define GPIO_AF7         (7)
+
+static inline void gpio_mode_setup(uint32_t port, uint8_t mode, uint8_t pull, 
+    uint16_t pins) {
+    (void)port;
+    (void)mode;
+    (void)pull;
+    (void)pins;
+}
+
+static inline void gpio_set_af(uint32_t port, uint8_t af, uint16_t pins) {
+    (void)port;
+    (void)af;
+    (void)pins;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+
+// host stand-in: flash is an array owned by the harness, so the bootloader's
+// reads of it (CRC queries, image validation) land there
+extern uint8_t fuzz_flash[];
+#define FLASH_BASE ((uintptr_t)fuzz_flash)
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+
+// host stand-in: clocks are always running
+enum rcc_periph_clken {
+    RCC_GPIOA,
+    RCC_USART1,
+};
+
+extern uint32_t rcc_ahb_frequency;
+
+static inline void rcc_periph_clock_enable(enum rcc_periph_clken clken) {
+    (void)clken;
+}
+
+static inline void rcc_periph_clock_disable(enum rcc_periph_clken clken) {
+    (void)clken;
+}
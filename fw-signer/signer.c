@@ -0,0 +1,425 @@
+/*******************************************************************************
+ * @file   signer.c
+ * @author Camille Alexandra
+ *
+ * @brief  Host tool which stamps a version into application images and signs
+ *         them, using the same signature code the bootloader validates with
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "core/firmware-info.h"
+#include "core/aes.h"
+#include "core/cmac.h"
+#include "core/crc.h"
+#include "core/tables.h"
+
+#define SIGNED_SUFFIX ".signed.bin"
+#define IMAGE_SUFFIX  ".bin"
+#define PATH_LENGTH   (4096U)
+#define BENCH_RUNS    (20U) // passes over a whole MAX_FW_LENGTH image
+
+// RFC 4493 section 4, the example key and the message its vectors prefix
+static const uint8_t rfc4493_key[AES_BLOCK_SIZE] = {
+    0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+    0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c,
+};
+
+static const uint8_t rfc4493_message[64] = {
+    0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+    0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+    0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+    0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10,
+};
+
+static const struct {
+    uint32_t length;
+    uint8_t mac[AES_BLOCK_SIZE];
+} rfc4493_examples[] = {
+    { 0, { 0xbb, 0x1d, 0x69, 0x29, 0xe9, 0x59, 0x37, 0x28, 0x7f, 0xa3, 0x7d, 0x12, 0x9b, 0x75, 0x67, 0x46 } },
+    { 16, { 0x07, 0x0a, 0x16, 0xb4, 0x6b, 0x4d, 0x41, 0x44, 0xf7, 0x9b, 0xdd, 0x9d, 0xd0, 0x4a, 0x28, 0x7c } },
+    { 40, { 0xdf, 0xa6, 0x67, 0x47, 0xde, 0x9a, 0xe6, 0x30, 0x30, 0xca, 0x32, 0x61, 0x14, 0x97, 0xc8, 0x27 } },
+    { 64, { 0x51, 0xf0, 0xbe, 0xbf, 0x7e, 0x3b, 0x9d, 0x92, 0xfc, 0x49, 0x74, 0x17, 0x79, 0x36, 0x3c, 0xfe } },
+};
+
+/*******************************************************************************
+ * @brief Returns true if a string ends with the given suffix
+ ******************************************************************************/
+static bool ends_with(const char* string, const char* suffix) {
+    size_t string_length = strlen(string);
+    size_t suffix_length = strlen(suffix);
+
+    return string_length >= suffix_length
+        && strcmp(string + string_length - suffix_length, suffix) == 0;
+}
+
+/*******************************************************************************
+ * @brief Reads a whole file into memory
+ *
+ * @param path File to read
+ * @param length Receives the length of the file
+ *
+ * @return The contents, to be freed by the caller, or NULL on failure
+ ******************************************************************************/
+static uint8_t* read_file(const char* path, uint32_t* length) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    uint8_t* data = NULL;
+    long size = -1;
+    if (fseek(file, 0, SEEK_END) == 0) {
+        size = ftell(file);
+    }
+    if (size >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+        data = malloc(size > 0 ? (size_t)size : 1U);
+    }
+    if (data != NULL && fread(data, 1, (size_t)size, file) != (size_t)size) {
+        free(data);
+        data = NULL;
+    }
+
+    fclose(file);
+    *length = (uint32_t)size;
+    return data;
+}
+
+/*******************************************************************************
+ * @brief Writes a whole buffer to a file, replacing it
+ ******************************************************************************/
+static bool write_file(const char* path, const uint8_t* data, uint32_t length) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        return false;
+    }
+
+    bool written = fwrite(data, 1, length, file) == length;
+    return (fclose(file) == 0) && written;
+}
+
+/*******************************************************************************
+ * @brief Signs one image, the bootloader followed by the application as built,
+ *        writing the signed application next to it as <name>.signed.bin
+ *
+ * @param path Image to sign
+ * @param version Version to stamp into the firmware info block
+ *
+ * @return True on success, False after reporting the failure
+ ******************************************************************************/
+static bool sign_file(const char* path, uint32_t version) {
+    char signed_path[PATH_LENGTH];
+    uint32_t file_length;
+    uint8_t* file = read_file(path, &file_length);
+
+    if (file == NULL) {
+        fprintf(stderr, "%s: cannot read: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    bool success = false;
+    uint8_t* image = file + BOOTLOADER_SIZE; // skip the bootloader section
+    uint32_t length = file_length - BOOTLOADER_SIZE;
+    firmware_info_t info;
+
+    if (file_length < BOOTLOADER_SIZE + MIN_FW_LENGTH || length > MAX_FW_LENGTH) {
+        fprintf(stderr, "%s: application of %ld bytes, must be %u to %u\n",
+            path, (long)file_length - (long)BOOTLOADER_SIZE, (unsigned)MIN_FW_LENGTH, MAX_FW_LENGTH);
+        goto done;
+    }
+
+    memcpy(&info, image + FWINFO_OFFSET, sizeof(info));
+    if (info.sentinel != FWINFO_SENTINEL || info.device_id != DEVICE_ID) {
+        fprintf(stderr, "%s: no firmware info block for device 0x%02x\n", path, DEVICE_ID);
+        goto done;
+    }
+
+    info.version = version;
+    info.length = length;
+    memcpy(image + FWINFO_OFFSET, &info, sizeof(info));
+    firmware_image_signature(image, length, image + SIGNATURE_OFFSET);
+
+    // the exact check the bootloader makes before booting the image
+    if (!firmware_image_is_valid(image, MAX_FW_LENGTH)) {
+        fprintf(stderr, "%s: signed image fails validation\n", path);
+        goto done;
+    }
+
+    size_t stem_length = strlen(path) - (ends_with(path, IMAGE_SUFFIX) ? strlen(IMAGE_SUFFIX) : 0U);
+    if (snprintf(signed_path, sizeof(signed_path), "%.*s%s", (int)stem_length, path, SIGNED_SUFFIX)
+        >= (int)sizeof(signed_path)) {
+        fprintf(stderr, "%s: path too long\n", path);
+        goto done;
+    }
+    if (!write_file(signed_path, image, length)) {
+        fprintf(stderr, "%s: cannot write: %s\n", signed_path, strerror(errno));
+        goto done;
+    }
+
+    printf("%s: version %08x, %u bytes, signature ", signed_path, version, length);
+    for (uint8_t i = 0; i < SIGNATURE_SIZE; ++i) {
+        printf("%02x", image[SIGNATURE_OFFSET + i]);
+    }
+    printf("\n");
+    success = true;
+
+done:
+    free(file);
+    return success;
+}
+
+/*******************************************************************************
+ * @brief Signs every .bin image in a directory, skipping signed outputs
+ *
+ * @return Number of images which failed
+ ******************************************************************************/
+static int sign_directory(const char* path, uint32_t version) {
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        fprintf(stderr, "%s: cannot open: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    int failures = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char image_path[PATH_LENGTH];
+
+        if (!ends_with(entry->d_name, IMAGE_SUFFIX) || ends_with(entry->d_name, SIGNED_SUFFIX)) {
+            continue;
+        }
+        if (snprintf(image_path, sizeof(image_path), "%s/%s", path, entry->d_name)
+            >= (int)sizeof(image_path)) {
+            fprintf(stderr, "%s/%s: path too long\n", path, entry->d_name);
+            ++failures;
+            continue;
+        }
+        if (!sign_file(image_path, version)) {
+            ++failures;
+        }
+    }
+
+    closedir(dir);
+    return failures;
+}
+
+/*******************************************************************************
+ * @brief Checks the CMAC against the RFC 4493 examples, fed whole and split at
+ *        every possible point, so the streaming paths are all exercised
+ *
+ * @return True if every example matches
+ ******************************************************************************/
+static bool selftest_cmac(void) {
+    bool passed = true;
+
+    for (size_t i = 0; i < sizeof(rfc4493_examples) / sizeof(rfc4493_examples[0]); ++i) {
+        uint32_t length = rfc4493_examples[i].length;
+        bool matches = true;
+
+        for (uint32_t split = 0; split <= length; ++split) {
+            aes_cmac_t cmac;
+            uint8_t mac[AES_BLOCK_SIZE];
+
+            aes_cmac_setup(&cmac, rfc4493_key);
+            aes_cmac_update(&cmac, rfc4493_message, split);
+            aes_cmac_update(&cmac, rfc4493_message + split, length - split);
+            aes_cmac_final(&cmac, mac);
+
+            matches = matches && memcmp(mac, rfc4493_examples[i].mac, AES_BLOCK_SIZE) == 0;
+        }
+
+        printf("AES-CMAC RFC 4493 example %zu (%u bytes): %s\n", i + 1, length, matches ? "ok" : "FAILED");
+        passed = passed && matches;
+    }
+
+    return passed;
+}
+
+/*******************************************************************************
+ * @brief Bitwise CRC-8, the way crc8() worked before it was table driven
+ ******************************************************************************/
+static uint8_t crc8_bitwise(const uint8_t* data, uint32_t length) {
+    uint8_t crc = 0;
+
+    for (uint32_t i = 0; i < length; ++i) {
+        crc ^= data[i];
+        for (uint32_t j = 0; j < 8; ++j) {
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+        }
+    }
+
+    return crc;
+}
+
+/*******************************************************************************
+ * @brief Shifts bytes through a CRC-32 register bitwise, the way crc32() worked
+ *        before it was table driven, without its initial and final inversion
+ ******************************************************************************/
+static uint32_t crc32_bitwise(uint32_t crc, const uint8_t* data, uint32_t length) {
+    for (uint32_t i = 0; i < length; ++i) {
+        crc ^= data[i];
+        for (uint32_t j = 0; j < 8; ++j) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+
+    return crc;
+}
+
+/*******************************************************************************
+ * @brief Checks the tables generated by gen-tables.py against the same values
+ *        computed at runtime: bitwise CRCs, the T-table from aes.c's S-box and
+ *        the round keys from AES_KeySchedule128()
+ *
+ * @return True if every table matches
+ ******************************************************************************/
+static bool selftest_tables(void) {
+    bool crc_matches = true;
+    bool te0_matches = true;
+    uint8_t data[1024];
+
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint8_t byte = (uint8_t)i;
+        AES_Column_t column = { byte, 0, 0, 0 };
+
+        // a table entry is the CRC register after shifting one byte through
+        crc_matches = crc_matches && crc8_table[i] == crc8_bitwise(&byte, 1);
+        crc_matches = crc_matches && crc32_table[i] == crc32_bitwise(0, &byte, 1);
+
+        AES_SubWord(column, sbox_encrypt);
+        uint32_t expected = (uint32_t)GF_Mult(0x02, column[0]) | ((uint32_t)column[0] << 8)
+            | ((uint32_t)column[0] << 16) | ((uint32_t)GF_Mult(0x03, column[0]) << 24);
+        te0_matches = te0_matches && aes_te0[i] == expected;
+    }
+    printf("Generated CRC tables: %s\n", crc_matches ? "ok" : "FAILED");
+    printf("Generated AES T-table: %s\n", te0_matches ? "ok" : "FAILED");
+
+    // and the table-driven CRCs agree with bitwise ones over odd lengths
+    srand(1);
+    for (uint32_t i = 0; i < sizeof(data); ++i) {
+        data[i] = (uint8_t)rand();
+    }
+    bool crc_functions_match = true;
+    for (uint32_t length = 0; length <= sizeof(data); length += 97) {
+        crc_functions_match = crc_functions_match
+            && crc8(data, length) == crc8_bitwise(data, length)
+            && crc32(data, length) == ~crc32_bitwise(0xFFFFFFFF, data, length);
+    }
+    printf("Table-driven CRC-8 and CRC-32: %s\n", crc_functions_match ? "ok" : "FAILED");
+
+    AES_Block_t round_keys[NUM_ROUND_KEYS_128];
+    AES_KeySchedule128((const uint8_t*)firmware_key_schedule[0], round_keys);
+    bool schedule_matches = memcmp(round_keys, firmware_key_schedule, sizeof(round_keys)) == 0;
+    printf("Generated firmware key schedule: %s\n", schedule_matches ? "ok" : "FAILED");
+
+    return crc_matches && te0_matches && crc_functions_match && schedule_matches;
+}
+
+/*******************************************************************************
+ * @brief Zero-IV AES-CBC-MAC with PKCS#7 padding, the signature scheme the
+ *        CMAC replaced, kept only to be timed against it
+ ******************************************************************************/
+static void cbc_mac(const AES_Block_t* round_keys, const uint8_t* data, uint32_t length, uint8_t mac[AES_BLOCK_SIZE]) {
+    AES_Block_t state = {0};
+    uint8_t block[AES_BLOCK_SIZE];
+    uint8_t bytes_to_pad = AES_BLOCK_SIZE - (length % AES_BLOCK_SIZE);
+
+    for (uint32_t offset = 0; offset < length + bytes_to_pad; offset += AES_BLOCK_SIZE) {
+        if (length - offset >= AES_BLOCK_SIZE && offset < length) {
+            memcpy(block, data + offset, AES_BLOCK_SIZE);
+        } else { // the padding block, or the tail padded in-block
+            uint32_t tail = (offset < length) ? length - offset : 0U;
+            memcpy(block, data + offset, tail);
+            memset(block + tail, bytes_to_pad, AES_BLOCK_SIZE - tail);
+        }
+
+        for (uint8_t i = 0; i < AES_BLOCK_SIZE; ++i) {
+            ((uint8_t*)state)[i] ^= block[i];
+        }
+        AES_EncryptBlock(state, round_keys);
+    }
+
+    memcpy(mac, state, AES_BLOCK_SIZE);
+}
+
+/*******************************************************************************
+ * @brief Times the CMAC against the CBC-MAC it replaced over the largest image
+ ******************************************************************************/
+static void bench_signature(void) {
+    uint8_t* image = malloc(MAX_FW_LENGTH);
+    AES_Block_t round_keys[NUM_ROUND_KEYS_128];
+    uint8_t mac[AES_BLOCK_SIZE];
+
+    if (image == NULL) {
+        return;
+    }
+    for (uint32_t i = 0; i < MAX_FW_LENGTH; ++i) {
+        image[i] = (uint8_t)(i * 7U);
+    }
+    AES_KeySchedule128(rfc4493_key, round_keys);
+
+    clock_t start = clock();
+    for (uint32_t run = 0; run < BENCH_RUNS; ++run) {
+        cbc_mac(round_keys, image, MAX_FW_LENGTH - run, mac);
+    }
+    double cbc_seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    start = clock();
+    for (uint32_t run = 0; run < BENCH_RUNS; ++run) {
+        aes_cmac_t cmac;
+        aes_cmac_setup(&cmac, rfc4493_key);
+        aes_cmac_update(&cmac, image, MAX_FW_LENGTH - run);
+        aes_cmac_final(&cmac, mac);
+    }
+    double cmac_seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    double megabytes = (double)MAX_FW_LENGTH * BENCH_RUNS / (1024.0 * 1024.0);
+    printf("CBC-MAC %.1f MB/s, AES-CMAC %.1f MB/s over %u byte images\n",
+        megabytes / cbc_seconds, megabytes / cmac_seconds, MAX_FW_LENGTH);
+    free(image);
+}
+
+int main(int argc, char** argv) {
+    if (argc == 2 && strcmp(argv[1], "selftest") == 0) {
+        bool passed = selftest_tables();
+        passed = selftest_cmac() && passed;
+        bench_signature();
+        return passed ? 0 : 1;
+    }
+
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <version no.HEX> <firmware image | directory>...\n", argv[0]);
+        fprintf(stderr, "       %s selftest\n", argv[0]);
+        return 1;
+    }
+
+    char* end;
+    unsigned long version = strtoul(argv[1], &end, 16);
+    if (*argv[1] == '\0' || *end != '\0' || version > 0xFFFFFFFFUL) {
+        fprintf(stderr, "Error: version '%s' is not a 32-bit hex number\n", argv[1]);
+        return 1;
+    }
+
+    int failures = 0;
+    for (int i = 2; i < argc; ++i) {
+        struct stat info;
+
+        if (stat(argv[i], &info) != 0) {
+            fprintf(stderr, "Error: '%s' does not exist\n", argv[i]);
+            ++failures;
+        } else if (S_ISDIR(info.st_mode)) {
+            failures += sign_directory(argv[i], (uint32_t)version);
+        } else if (!sign_file(argv[i], (uint32_t)version)) {
+            ++failures;
+        }
+    }
+
+    return failures > 0 ? 1 : 0;
+}
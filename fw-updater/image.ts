@@ -0,0 +1,119 @@
+// Loading firmware images for the updater. Whatever the file format, the result
+// is the application image as it sits in flash from MAIN_APP_START_ADDRESS, with
+// any gaps left erased (0xFF).
+import * as path from 'path';
+import * as fs from 'fs/promises';
+import { MAIN_APP_START_ADDRESS, MAX_FW_LENGTH } from './protocol';
+
+const ELF_MAGIC = Buffer.from([0x7f, 0x45, 0x4c, 0x46]);
+const ELF_CLASS_32 = 1;
+const ELF_DATA_LSB = 1;
+const ELF_PT_LOAD = 1;
+
+const HEX_RECORD_DATA = 0x00;
+const HEX_RECORD_EOF = 0x01;
+const HEX_RECORD_EXTENDED_SEGMENT = 0x02;
+const HEX_RECORD_EXTENDED_LINEAR = 0x04;
+
+type Chunk = { address: number; data: Buffer };
+
+// Lay chunks at absolute addresses out as an application image. Anything below
+// the application, such as the bootloader linked into app.elf, is left out.
+const flatten = (chunks: Chunk[]) => {
+  const inApp = chunks
+    .map(chunk => {
+      const skip = Math.max(0, MAIN_APP_START_ADDRESS - chunk.address);
+      return { offset: chunk.address + skip - MAIN_APP_START_ADDRESS, data: chunk.data.subarray(skip) };
+    })
+    .filter(chunk => chunk.data.length > 0);
+
+  const length = inApp.reduce((end, chunk) => Math.max(end, chunk.offset + chunk.data.length), 0);
+  if (length > MAX_FW_LENGTH) {
+    throw new Error(`Image spans ${length} bytes, more than the ${MAX_FW_LENGTH} available`);
+  }
+
+  const image = Buffer.alloc(length, 0xff);
+  for (const chunk of inApp) {
+    chunk.data.copy(image, chunk.offset);
+  }
+  return image;
+};
+
+// Loadable segments of a 32-bit little-endian ELF file, at their load addresses
+const elfChunks = (file: Buffer) => {
+  if (!file.subarray(0, 4).equals(ELF_MAGIC) || file[4] !== ELF_CLASS_32 || file[5] !== ELF_DATA_LSB) {
+    throw new Error('Not a 32-bit little-endian ELF file');
+  }
+
+  const programHeaderOffset = file.readUInt32LE(0x1c);
+  const programHeaderSize = file.readUInt16LE(0x2a);
+  const programHeaderCount = file.readUInt16LE(0x2c);
+  const chunks: Chunk[] = [];
+
+  for (let i = 0; i < programHeaderCount; i++) {
+    const header = programHeaderOffset + i * programHeaderSize;
+    const type = file.readUInt32LE(header);
+    const offset = file.readUInt32LE(header + 4);
+    const physicalAddress = file.readUInt32LE(header + 12);
+    const fileSize = file.readUInt32LE(header + 16);
+
+    // initialised data is loaded from flash, so its load address is what counts
+    if (type === ELF_PT_LOAD && fileSize > 0) {
+      chunks.push({ address: physicalAddress, data: file.subarray(offset, offset + fileSize) });
+    }
+  }
+
+  return chunks;
+};
+
+// Data records of an Intel HEX file, at their absolute addresses
+const hexChunks = (text: string) => {
+  const chunks: Chunk[] = [];
+  let base = 0;
+
+  for (const [lineIndex, line] of text.split(/\r?\n/).entries()) {
+    if (line.trim().length === 0) {
+      continue;
+    }
+
+    const record = Buffer.from(line.trim().slice(1), 'hex');
+    const checksum = record.reduce((sum, byte) => (sum + byte) & 0xff, 0);
+    if (!line.startsWith(':') || record.length < 5 || record.length !== record[0] + 5 || checksum !== 0) {
+      throw new Error(`Malformed HEX record on line ${lineIndex + 1}`);
+    }
+
+    const address = record.readUInt16BE(1);
+    const data = record.subarray(4, 4 + record[0]);
+    switch (record[3]) {
+      case HEX_RECORD_DATA:
+        chunks.push({ address: base + address, data });
+        break;
+      case HEX_RECORD_EOF:
+        return chunks;
+      case HEX_RECORD_EXTENDED_SEGMENT:
+        base = data.readUInt16BE(0) * 16;
+        break;
+      case HEX_RECORD_EXTENDED_LINEAR:
+        base = data.readUInt16BE(0) * 0x10000;
+        break;
+      default:
+        break; // start addresses mean nothing to the bootloader
+    }
+  }
+
+  return chunks;
+};
+
+// Read a signed .bin as written by fw-signer, or an Intel .hex or .elf file
+export const loadFirmware = async (filename: string) => {
+  const file = await fs.readFile(filename);
+
+  switch (path.extname(filename).toLowerCase()) {
+    case '.hex':
+      return flatten(hexChunks(file.toString('ascii')));
+    case '.elf':
+      return flatten(elfChunks(file));
+    default:
+      return file;
+  }
+};
@@ -1,399 +1,272 @@
-import {SerialPort} from 'serialport';
 import * as path from 'path'; // importing path module for file paths
-import * as fs from 'fs/promises'; // importing async file system module for reading files
-import { time } from 'console';
-import { write } from 'fs';
-
-// Constants for the packet protocol
-const PACKET_LENGTH_BYTES   = 1;
-const PACKET_DATA_BYTES     = 16;
-const PACKET_CRC_BYTES      = 1;
-const PACKET_CRC_INDEX      = PACKET_LENGTH_BYTES + PACKET_DATA_BYTES;
-const PACKET_LENGTH         = PACKET_LENGTH_BYTES + PACKET_DATA_BYTES + PACKET_CRC_BYTES;
-
-const PACKET_ACK_DATA0      = 0x15;
-const PACKET_RETX_DATA0     = 0x19;
-
-const FLASH_BASE             = (0x08000000); // Flash memory base address
-const BOOTLOADER_SIZE        = (0x00008000); // 32kB bootloader size
-const MAIN_APP_START_ADDRESS = (0x08008000); // 32kB bootloader, so main app starts at 0x08008000
-const VECTOR_TABLE_SIZE      = (0x000001B0); // 2080 bytes, which is the size of the vector table
-const FIRMWARE_INFO_SIZE     = (8 * 4);
-
-const BL_PACKET_SYNC_OBSERVED_DATA0      = (0x20);
-const BL_PACKET_FW_UPDATE_REQUEST_DATA0  = (0x31);
-const BL_PACKET_FW_UPDATE_RESPONSE_DATA0 = (0x37);
-const BL_PACKET_DEVICE_ID_REQUEST_DATA0  = (0x3C);
-const BL_PACKET_DEVICE_ID_RESPONSE_DATA0 = (0x3F);
-const BL_PACKET_FW_LENGTH_REQUEST_DATA0  = (0x42);
-const BL_PACKET_FW_LENGTH_RESPONSE_DATA0 = (0x45);
-const BL_PACKET_READY_FOR_DATA_DATA0     = (0x48);
-const BL_PACKET_UPDATE_SUCCESS_DATA0     = (0x54);
-const BL_PACKET_NACK_DATA0               = (0x99);
-
-const FWINFO_ADDRESS        = (FLASH_BASE + BOOTLOADER_SIZE + VECTOR_TABLE_SIZE)
-const FWINFO_VALIDATE_FROM  = (VECTOR_TABLE_SIZE + FIRMWARE_INFO_SIZE)
-
-const FWINFO_SENTINEL_OFFSET  = (VECTOR_TABLE_SIZE + (0 * 4));
-const FWINFO_DEVICE_ID_OFFSET = (VECTOR_TABLE_SIZE + (1 * 4));
-const FWINFO_VERSION_OFFSET   = (VECTOR_TABLE_SIZE + (2 * 4));
-const FWINFO_LENGTH_OFFSET    = (VECTOR_TABLE_SIZE + (3 * 4));
-const FWINFO_RESERVED0_OFFSET = (VECTOR_TABLE_SIZE + (4 * 4));
-const FWINFO_RESERVED1_OFFSET = (VECTOR_TABLE_SIZE + (5 * 4));
-const FWINFO_RESERVED2_OFFSET = (VECTOR_TABLE_SIZE + (6 * 4));
-const FWINFO_RESERVED3_OFFSET = (VECTOR_TABLE_SIZE + (7 * 4));
-const FWINFO_CRC32_OFFSET     = (VECTOR_TABLE_SIZE + (9 * 4));
-const FWINFO_SENTINEL         = (0xDEADC0DE) // Example sentinel value to identify firmware info structure
-
-
-// Validation constants
-const DEVICE_ID = (0xA3); // arbitrary device id used to identify for fw uconst
-
-const SYNC_SEQ = Buffer.from([0xC4, 0x55, 0x7E, 0x10]);
-
-const DEFAULT_TIMEOUT = (5000);  // default timeout at 5s
-const SHORT_TIMEOUT   = (1000);  // short timeout at 1s
-const LONG_TIMEOUT    = (15000); // long timeout at 15s
-
-// Bootloader constants
-const BL_SIZE = 0x8000; // 32kB bootloader size
+import { performance } from 'perf_hooks';
+import { Logger, Link, SerialLink, Session, UpdateOptions } from './session';
+import { SimulatedDevice, Impairments, NO_IMPAIRMENTS, parseImpairments } from './simulator';
+import { FrameStream, Framing, Layout, HANDOFF_BAUD_RATES } from './protocol';
+import { loadFirmware } from './image';
+import { benchmarkFraming, compareLayout } from './bench';
+import { renderTrace } from './trace';
 
 // Details about the serial port connection
 // const serialPath1           = "/dev/tty.usbmodem21401";
 const serialPath2           = "/dev/tty.usbserial-B00001TO";
 const baudRate              = 115200;
 
-// CRC8 implementation
-const crc8 = (data: Buffer | Array<number>) => {
-  let crc = 0;
-
-  for (const byte of data) {
-    crc = (crc ^ byte) & 0xff;
-    for (let i = 0; i < 8; i++) {
-      if (crc & 0x80) {
-        crc = ((crc << 1) ^ 0x07) & 0xff;
-      } else {
-        crc = (crc << 1) & 0xff;
-      }
-    }
-  }
+const PROGRESS_STEP = 10; // percent between progress reports
 
-  return crc;
+type Target = {
+  name: string;
+  link: Link;
+  device?: SimulatedDevice; // set when simulating, to check the result
 };
 
-// CRC32 implementation
-const crc32 = (data: Buffer, length: number) => {
-  let byte;
-  let crc = 0xffffffff;
-  let mask;
+// Report progress every PROGRESS_STEP percent, rather than for every packet
+const progressReporter = (name: string) => {
+  let lastReported = 0;
 
-  for (let i = 0; i < length; i++) {
-    byte = data[i];
-    crc = (crc ^ byte) >>> 0;
-
-    for (let j = 0; j < 8; j++) {
-      mask = (-(crc & 1)) >>> 0;
-      crc = ((crc >>> 1) ^ (0xedb88320 & mask)) >>> 0;
+  return (bytesWritten: number, fwLength: number) => {
+    const percent = Math.floor((bytesWritten * 100) / fwLength);
+    if (percent >= lastReported + PROGRESS_STEP || bytesWritten === fwLength) {
+      lastReported = percent - (percent % PROGRESS_STEP);
+      Logger.info(`${name}: ${percent}% (${bytesWritten}/${fwLength} bytes)`);
     }
-  }
-
-  return (~crc) >>> 0;
-}
-
-// Async delay function, which gives the event loop time to process outside input
-const delay = (ms: number) => new Promise(resolve => setTimeout(resolve, ms));
-
-class Logger {
-  static info(message: string) {console.log(`[.] ${message}`); }
-  static success(message: string) {console.log(`[$] ${message}`); }
-  static error(message: string) {console.error(`[!] ${message}`); }
-}
-
-// Class for serialising and deserialising packets
-class Packet {
-  length: number;
-  data: Buffer;
-  crc: number;
-
-  static retx = new Packet(1, Buffer.from([PACKET_RETX_DATA0])).toBuffer();
-  static ack = new Packet(1, Buffer.from([PACKET_ACK_DATA0])).toBuffer();
-
-  constructor(length: number, data: Buffer, crc?: number) {
-    this.length = length;
-    this.data = data;
-
-    const bytesToPad = PACKET_DATA_BYTES - this.data.length;
-    const padding = Buffer.alloc(bytesToPad).fill(0xff);
-    this.data = Buffer.concat([this.data, padding]);
+  };
+};
 
-    if (typeof crc === 'undefined') {
-      this.crc = this.computeCrc();
-    } else {
-      this.crc = crc;
+// Update one device, catching its failure so the others carry on
+const flashTarget = async (target: Target, fwImage: Buffer, frames: FrameStream, options: UpdateOptions) => {
+  const session = new Session(target.name, target.link);
+  const start = performance.now();
+  let error: Error | null = null;
+  let ms = 0;
+
+  try {
+    await session.update(fwImage, frames, options, progressReporter(target.name));
+    if (target.device && !target.device.holds(fwImage)) {
+      throw new Error('Simulated device does not hold the image it was sent');
     }
+  } catch (err) {
+    error = err as Error;
+  } finally {
+    ms = performance.now() - start;
+    await session.close();
   }
 
-  computeCrc() {
-    const allData = [this.length, ...this.data];
-    return crc8(allData);
+  // how the protocol coped with the line, for comparing impairment scenarios
+  const goodput = error === null ? (fwImage.length * 1000) / ms : 0;
+  if (target.device) {
+    const { corruptedBytes, droppedBytes, duplicatedBytes, insertedBytes } = target.device.injected;
+    Logger.info(`${target.name}: goodput ${goodput.toFixed(0)} B/s, RETX from device ${target.device.retxSent}, `
+      + `from host ${session.retxSent}, frames resent ${session.retransmits}, unanswered ${session.commandsResent}; injected ${corruptedBytes} corrupted, `
+      + `${droppedBytes} dropped, ${duplicatedBytes} duplicated, ${insertedBytes} inserted bytes`);
   }
 
-  toBuffer() {
-    return Buffer.concat([ Buffer.from([this.length]), this.data, Buffer.from([this.crc]) ]);
-  }
+  return { name: target.name, ms, error, goodput };
+};
 
-  isSingleBytePacket(byte: number) {
-    if (this.length !== 1) return false;
-    if (this.data[0] !== byte) return false;
-    for (let i = 1; i < PACKET_DATA_BYTES; i++) {
-      if (this.data[i] !== 0xff) return false;
+// Update the same simulated devices over identically impaired lines, once with
+// each framing, and report the goodput of each. Failed updates count as 0 B/s
+const compareFraming = async (fwImage: Buffer, layout: Layout, count: number, impairments: Impairments,
+  seed: number, options: UpdateOptions) => {
+  const rows: string[] = [];
+
+  for (const framing of ['raw', 'cobs'] as Framing[]) {
+    const frames = new FrameStream(fwImage, framing, layout);
+    const targets = Array.from({ length: count }, (_, i) => {
+      const device = new SimulatedDevice(baudRate, impairments, seed + i);
+      return { name: `${framing}${i}`, link: device.link, device };
+    });
+    const results = await Promise.all(targets.map(target =>
+      flashTarget(target, fwImage, frames, { ...options, cobs: framing === 'cobs' })));
+
+    for (const result of results.filter(result => result.error !== null)) {
+      Logger.error(`${result.name}: failed: ${result.error!.message}`);
     }
-    return true;
+    const updated = results.filter(result => result.error === null).length;
+    const goodputs = results.map(result => result.goodput);
+    const mean = goodputs.reduce((sum, goodput) => sum + goodput, 0) / count;
+    rows.push(`${framing.padEnd(8)} ${`${updated}/${count}`.padStart(9)} ${mean.toFixed(0).padStart(10)} `
+      + `${Math.min(...goodputs).toFixed(0).padStart(10)} ${Math.max(...goodputs).toFixed(0).padStart(10)}`);
   }
 
-  isAck() {
-    return this.isSingleBytePacket(PACKET_ACK_DATA0);
-  }
-
-  isRetx() {
-    return this.isSingleBytePacket(PACKET_RETX_DATA0);
-  }
-
-  static createSingleBytePacket(byte: number) {
-    return new Packet(1, Buffer.from([byte]));
-  }
-}
-
-// Serial port instance
-const uart = new SerialPort({ path: serialPath2, baudRate });
-
-// Packet buffer
-let packets: Packet[] = [];
-
-let lastPacket: Buffer = Packet.ack;
-const writePacket = (packet: Buffer) => {
-  uart.write(packet);
-  lastPacket = packet;
+  Logger.info(`framing    updated  mean B/s    min B/s    max B/s`);
+  rows.forEach(row => Logger.info(row));
 };
 
-// Serial data buffer, with a splice-like function for consuming data
-let rxBuffer = Buffer.from([]);
-const consumeFromBuffer = (n: number) => {
-  const consumed = rxBuffer.slice(0, n);
-  rxBuffer = rxBuffer.slice(n);
-  return consumed;
-}
-
-// This function fires whenever data is received over the serial port. The whole
-// packet state machine runs here.
-uart.on('data', data => {
-  // Logger.info(`Received ${data.length} bytes through uart`);
-  // Add the data to the packet
-  rxBuffer = Buffer.concat([rxBuffer, data]);
-
-  // Can we build a packet?
-  while (rxBuffer.length >= PACKET_LENGTH) {
-    // Logger.info(`Building a packet`);
-    const raw = consumeFromBuffer(PACKET_LENGTH);
-    const packet = new Packet(raw[0], raw.slice(1, 1+PACKET_DATA_BYTES), raw[PACKET_CRC_INDEX]);
-    const computedCrc = packet.computeCrc();
-
-    // Need retransmission?
-    if (packet.crc !== computedCrc) {
-      // Logger.error(`CRC failed, computed 0x${computedCrc.toString(16)}, got 0x${packet.crc.toString(16)}`);
-      writePacket(Packet.retx);
-      continue;
-    }
-
-    // Are we being asked to retransmit?
-    if (packet.isRetx()) {
-      // Logger.info(`Retransmitting last packet`);
-      writePacket(lastPacket);
-      continue;
-    }
+// Compare one device's flash with the image, reporting any ranges which differ
+const verifyTarget = async (target: Target, fwImage: Buffer, options: UpdateOptions) => {
+  const session = new Session(target.name, target.link);
+  const start = performance.now();
+  let error: Error | null = null;
 
-    // If this is an ack, move on
-    if (packet.isAck()) {
-      // Logger.info(`It was an ack, nothing to do`);
-      continue;
+  try {
+    const mismatched = await session.verify(fwImage, options);
+    for (const range of mismatched) {
+      Logger.error(`${target.name}: ${range.length} bytes at offset 0x${range.offset.toString(16)} differ`);
     }
-
-    // If this is a nack, exit program
-    if (packet.isSingleBytePacket(BL_PACKET_NACK_DATA0)) {
-      Logger.error(`Received NACK packet, exiting...`)
-      process.exit(1);
+    if (mismatched.length > 0) {
+      throw new Error(`Flash differs from the image in ${mismatched.length} ranges`);
     }
-
-    // Otherwise write the packet in to the buffer, and send an ack
-    // Logger.info(`Storing packet and ack'ing`);
-    packets.push(packet);
-    writePacket(Packet.ack);
+  } catch (err) {
+    error = err as Error;
+  } finally {
+    await session.close();
   }
-});
 
-// Function to allow us to await a packet
-const waitForPacket = async (timeout = DEFAULT_TIMEOUT) => {
-  let timeWaited = 0;
-
-  while (packets.length < 1) {
-    await delay(1);
-    timeWaited += 1;
+  return { name: target.name, ms: performance.now() - start, error };
+};
 
-    if (timeWaited >= timeout) {
-      // Logger.error(`Timeout waiting for packet after ${timeout}ms`);
-      throw Error('Timed out waiting for packet');  
-      // process.exit(1);
-    }
+// Read out and render one device's event trace
+const traceTarget = async (target: Target, options: UpdateOptions) => {
+  const session = new Session(target.name, target.link);
+  const start = performance.now();
+  let error: Error | null = null;
+
+  try {
+    const { cpuMHz, records } = await session.readTrace(options);
+    renderTrace(target.name, records, cpuMHz);
+  } catch (err) {
+    error = err as Error;
+  } finally {
+    await session.close();
   }
 
-  return packets.splice(0, 1)[0]; // packets[0]
-}
-
-const waitForSingleBytePacket = (byte: number, timeout = DEFAULT_TIMEOUT) => (
-  waitForPacket(timeout)
-    .then(packet => {
-      if (packet.length != 1 || packet.data[0] != byte) {
-        throw new Error(`Expected single byte packet with data 0x${byte.toString(16)}, got packet: ${packet}`);
-      }
-    })
-    .catch(err => {
-      Logger.error(`Error waiting for single byte packet: ${err.message}`);
-      console.log(rxBuffer);
-      console.log(packets);
-      process.exit(1);
-    })
-);
-
-// console.log(Packet.ack) // DEBUG
-
-const syncWithBootloader = async (timeout = DEFAULT_TIMEOUT) => {
-  let timeWaited = 0;
-
-  while (true) {
-    uart.write(SYNC_SEQ);
-    await delay(SHORT_TIMEOUT); // device should respond within < 1s
-    timeWaited += SHORT_TIMEOUT;
+  return { name: target.name, ms: performance.now() - start, error };
+};
 
-    if (packets.length > 0) { // if we have a packet, then we can assume we are in sync}
-      const packet = packets.splice(0, 1)[0];
+// Do everything in an async function so we can have loops, awaits etc
+const main = async () => {
+  const args = process.argv.slice(2);
+  const positional = args.filter(arg => !arg.startsWith('--'));
+  const option = (name: string) => args.find(arg => arg === name || arg.startsWith(`${name}=`));
+  const optionValue = (name: string) => {
+    const arg = option(name);
+    return arg?.includes('=') ? arg.slice(arg.indexOf('=') + 1) : undefined;
+  };
+
+  // --from-app[=<baud>] asks the running application to enter the bootloader
+  const fromAppArg = option('--from-app');
+  // --cobs switches to COBS framing, which recovers from lost bytes
+  const useCobs = option('--cobs') !== undefined;
+  // --port=<path> may be repeated, to update several devices at once
+  const ports = args.filter(arg => arg.startsWith('--port=')).map(arg => arg.split('=')[1]);
+  // --simulate=<n> updates n simulated devices instead of real ones
+  const simulateCount = Number(optionValue('--simulate') ?? 0);
+  // --impair=<spec> degrades the simulated lines, reproducibly from --seed=<n>
+  const impairments = option('--impair') === undefined ? NO_IMPAIRMENTS : parseImpairments(optionValue('--impair') ?? '');
+  const seed = Number(optionValue('--seed') ?? 1);
+  // --sparse sends only what is not erased flash
+  const sparse = option('--sparse') !== undefined;
+  // --blocks sends numbered blocks, then again any the device reports missing
+  const blocks = option('--blocks') !== undefined;
+  // --legacy-handshake uses the exchanges older bootloaders expect
+  const legacyHandshake = option('--legacy-handshake') !== undefined;
+  // --verify compares flash with the image using CRCs computed on the device
+  const verify = option('--verify') !== undefined;
+  // --trace reads out and renders the device's event trace, needing no image
+  const trace = option('--trace') !== undefined;
+  // --bench times framing the image, per packet as before and all at once, and
+  // with --sparse or --blocks compares what that transfer sends with all of it
+  const bench = option('--bench') !== undefined;
+  // --compare-framing updates the simulated devices with raw and then COBS
+  // framing over the same impaired lines, and compares their goodput
+  const compare = option('--compare-framing') !== undefined;
+
+  if (positional.length < 1 && !trace) {
+    console.log(`usage: ${process.argv[0]} [--from-app[=<baud>]] [--cobs] [--legacy-handshake] [--sparse | --blocks] [--verify | --trace] [--port=<path>]... [--simulate=<n> [--impair=ber=,drop=,dup=,ins=,latency=,jitter=] [--seed=<n>] [--compare-framing]] [--bench] <signed firmware .bin/.hex/.elf>`);
+    process.exit(1);
+  }
+  const fromAppBaudRate = fromAppArg === undefined ? undefined
+    : fromAppArg.includes('=') ? Number(fromAppArg.split('=')[1]) : baudRate;
+  if (fromAppBaudRate !== undefined && !HANDOFF_BAUD_RATES.includes(fromAppBaudRate)) {
+    Logger.error(`--from-app baud rate must be one of ${HANDOFF_BAUD_RATES.join(', ')}`);
+    process.exit(1);
+  }
+  if (sparse && blocks) {
+    Logger.error('--sparse and --blocks are two ways to skip erased flash, choose one');
+    process.exit(1);
+  }
 
-      if (packet.isSingleBytePacket(BL_PACKET_SYNC_OBSERVED_DATA0)) {
-        Logger.info("Bootloader sync observed");
-        return;
-      } else {
-        Logger.error(`Bootloader sync failed, got packet: ${packet}`);
-        process.exit(1);
-      }
+  // calculate the firmware length, once for every device
+  let fwImage = Buffer.alloc(0);
+  if (!trace) {
+    Logger.info('Reading firmware image, calculating firmware length...');
+    fwImage = await loadFirmware(path.join(process.cwd(), positional[0]));
+    Logger.success(`Firmware length is ${fwImage.length} bytes`);
+  }
+  const fwLength = fwImage.length;
 
+  const layout: Layout = sparse ? 'sparse' : blocks ? 'blocks' : 'sequential';
+  if (bench) {
+    benchmarkFraming(fwImage);
+    if (layout !== 'sequential') {
+      compareLayout(fwImage, layout, baudRate);
     }
+    return;
+  }
 
-    // if we haven't received packet after given timeout, then exit
-    if (timeWaited >= timeout) {
-      Logger.error(`Bootloader sync timed out after ${timeout}ms`);
+  const options: UpdateOptions = {
+    baudRate,
+    cobs: useCobs,
+    legacyHandshake,
+    sparse,
+    blocks,
+    fromAppBaudRate,
+  };
+
+  if (compare) {
+    if (simulateCount === 0 || verify || trace) {
+      Logger.error('--compare-framing updates simulated devices, add --simulate=<n>');
       process.exit(1);
     }
+    await compareFraming(fwImage, layout, simulateCount, impairments, seed, options);
+    return;
   }
-}
 
-const waitForFlashErase = (timeout = LONG_TIMEOUT) => {
-  let timeWaited = 0;
-  let totalTimeWaited = 0;
-
-  while (packets.length < 0) {
-    if (timeWaited >= 1000) {
-      Logger.info(`Waiting for flash erase to complete...`)
-      timeWaited = 0;
-    }
-    timeWaited += 1;
-    totalTimeWaited += 1;
-  }
-  
-  // const packet = packets.splice(0, 1)[0];
-  // if (packet.isSingleBytePacket(BL_PACKET_READY_FOR_DATA_DATA0)) {
-  //   Logger.success("Flash erase complete, ready for data");
-  //   return;
-  // } else {
-  //   Logger.error(`Flash erase failed, got packet: ${packet}`);
-  //   process.exit(1);
-  // }
+  // every frame of the image, checksummed once and shared by all the sessions
+  const frames = new FrameStream(fwImage, useCobs ? 'cobs' : 'raw', layout);
+  if (sparse || blocks) {
+    Logger.info(`${sparse ? 'Sparse' : 'Block'} transfer: ${frames.bytesSent} of ${fwLength} bytes in ${frames.count} packets`);
   }
 
-// Do everything in an async function so we can have loops, awaits etc
-const main = async () => {
-  if (process.argv.length < 3) {
-    console.log(`usage: ${process.argv[0]} <signed firmware>`);
-    process.exit(1);
+  let targets: Target[];
+  if (simulateCount > 0) {
+    targets = Array.from({ length: simulateCount }, (_, i) => {
+      const device = new SimulatedDevice(baudRate, impairments, seed + i);
+      if (verify) {
+        // already programmed, with one byte corrupted on every device but the
+        // first, so that there is something to find
+        device.load(fwImage);
+        if (i > 0) {
+          device.flash[(seed * 7919 * i) % fwLength] ^= 0x01;
+        }
+      }
+      return { name: `sim${i}`, link: device.link, device };
+    });
+  } else {
+    targets = (ports.length > 0 ? ports : [serialPath2])
+      .map(port => ({ name: port, link: new SerialLink(port, baudRate) }));
   }
-  const firmwareFilename = process.argv[2];
 
-  // calculate the firmware length
-  Logger.info('Reading firmware image, calculating firmware length...');
-  // throw away the bootloader part of the firmware image
-  const fwImage = await fs.readFile(path.join(process.cwd(), firmwareFilename));
-  const fwLength = fwImage.length;
-  Logger.success(`Firmware length is ${fwLength} bytes`);
-
-  // Start the bootloader update process
-
-  // Begin by attempting serial sync with bootloader
-  Logger.info('Attempting to sync with bootloader...');
-  await syncWithBootloader();
-  Logger.success('Bootloader sync successful!');
-
-  // Sync successful, now request for firmware update
-  Logger.info('Requesting firmware update...');
-  const fwUpdatePacket = Packet.createSingleBytePacket(BL_PACKET_FW_UPDATE_REQUEST_DATA0);
-  writePacket(fwUpdatePacket.toBuffer());
-  await waitForSingleBytePacket(BL_PACKET_FW_UPDATE_RESPONSE_DATA0);
-  Logger.success('Firmware update request successful...');
-
-  // If request found, validate firmware device ID
-  Logger.info('Awaiting device ID request...');
-  await waitForSingleBytePacket(BL_PACKET_DEVICE_ID_REQUEST_DATA0);
-  Logger.success('Device ID request received, sending device ID...');
-  const deviceID = fwImage[FWINFO_DEVICE_ID_OFFSET];
-  const deviceIdPacket = new Packet(2, Buffer.from([BL_PACKET_DEVICE_ID_RESPONSE_DATA0, deviceID]));
-  writePacket(deviceIdPacket.toBuffer());
-  // Logger.success('Device ID requested and validated...');
-  Logger.info(`Device ID ${deviceID.toString(16)} sent...`); // formats in hex
-
-  // Receive firmware length request, then send calculated firmware length
-  Logger.info('Awaiting firmware length request...');
-  await waitForSingleBytePacket(BL_PACKET_FW_LENGTH_REQUEST_DATA0);
-  Logger.success('Firmware length request received...');
-  // 1 byte for packet tag, 4 bytes for little-endian uint32 firmware length
-  const fwLengthPacketBuffer = Buffer.alloc(5);
-  fwLengthPacketBuffer[0] = BL_PACKET_FW_LENGTH_RESPONSE_DATA0; // packet tag
-  fwLengthPacketBuffer.writeUInt32LE(fwLength, 1); // firmware length
-  const fwLengthPacket = new Packet(5, fwLengthPacketBuffer);
-  writePacket(fwLengthPacket.toBuffer());
-  Logger.info('Sending firmware length...');
-
-  // at this point, bootloader should be erasing main application flash
-  Logger.info('Main application erasing...');
-  // TODO: Replace with loop
-  // await waitForFlashErase();
-  // Logger.success('Main application flash erased, ready for data...');
-
-  // Now we can start sending the firmware data
-  let bytesWritten = 0;
-  while (bytesWritten < fwLength) {
-    await waitForSingleBytePacket(BL_PACKET_READY_FOR_DATA_DATA0);
-
-    const dataBytes = fwImage.slice(bytesWritten, bytesWritten + PACKET_DATA_BYTES);
-    const dataLength = dataBytes.length;
-    const packet = new Packet(dataLength, dataBytes);
-
-    writePacket(packet.toBuffer());
-    bytesWritten += dataLength;
-
-    Logger.info(`Writing ${dataLength} bytes (${bytesWritten}/${fwLength})...`);
+  const start = performance.now();
+  const results = await Promise.all(targets.map(target => trace ? traceTarget(target, options)
+    : verify ? verifyTarget(target, fwImage, options)
+    : flashTarget(target, fwImage, frames, options)));
+  const totalSeconds = (performance.now() - start) / 1000;
+
+  const done = trace ? 'traced' : verify ? 'verified' : 'updated';
+  for (const result of results) {
+    const seconds = (result.ms / 1000).toFixed(2);
+    if (result.error === null) {
+      Logger.success(`${result.name}: ${done} in ${seconds}s`);
+    } else {
+      Logger.error(`${result.name}: failed after ${seconds}s: ${result.error.message}`);
+    }
   }
 
-  await waitForSingleBytePacket(BL_PACKET_UPDATE_SUCCESS_DATA0);
-  Logger.success('Firmware update successful!');
+  const failed = results.filter(result => result.error !== null).length;
+  Logger.info(`${results.length - failed}/${results.length} devices ${done} in ${totalSeconds.toFixed(2)}s`);
+  process.exitCode = failed > 0 ? 1 : 0;
 }
 
-main()
-  // .catch(e => {throw e})
-  .finally(() => uart.close());
\ No newline at end of file
+main();
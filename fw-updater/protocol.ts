@@ -0,0 +1,523 @@
+// Wire protocol shared by the updater and the simulated device: packet layout,
+// special packet values, framing and checksums
+
+// Constants for the packet protocol
+export const PACKET_LENGTH_BYTES   = 1;
+export const PACKET_DATA_BYTES     = 16;
+export const PACKET_CRC_BYTES      = 1;
+export const PACKET_CRC_INDEX      = PACKET_LENGTH_BYTES + PACKET_DATA_BYTES;
+export const PACKET_LENGTH         = PACKET_LENGTH_BYTES + PACKET_DATA_BYTES + PACKET_CRC_BYTES;
+
+export const PACKET_ACK_DATA0      = 0x15;
+export const PACKET_RETX_DATA0     = 0x19;
+
+// COBS framing, see comms.h
+export const PACKET_COBS_DELIMITER = 0x00;
+export const PACKET_COBS_FRAME_LENGTH = PACKET_LENGTH + 2; // including the delimiter
+export const BL_FW_UPDATE_OPTION_COBS = 0x01;
+
+export const FLASH_BASE             = (0x08000000); // Flash memory base address
+export const BOOTLOADER_SIZE        = (0x00008000); // 32kB bootloader size
+export const MAIN_APP_START_ADDRESS = (0x08008000); // 32kB bootloader, so main app starts at 0x08008000
+export const VECTOR_TABLE_SIZE      = (0x000001B0); // 2080 bytes, which is the size of the vector table
+export const FIRMWARE_INFO_SIZE     = (8 * 4);
+
+export const BL_PACKET_SYNC_OBSERVED_DATA0      = (0x20);
+export const BL_PACKET_FW_UPDATE_REQUEST_DATA0  = (0x31);
+export const BL_PACKET_FW_UPDATE_RESPONSE_DATA0 = (0x37);
+export const BL_PACKET_DEVICE_ID_REQUEST_DATA0  = (0x3C);
+export const BL_PACKET_DEVICE_ID_RESPONSE_DATA0 = (0x3F);
+export const BL_PACKET_FW_LENGTH_REQUEST_DATA0  = (0x42);
+export const BL_PACKET_FW_LENGTH_RESPONSE_DATA0 = (0x45);
+export const BL_PACKET_READY_FOR_DATA_DATA0     = (0x48);
+export const BL_PACKET_UPDATE_SUCCESS_DATA0     = (0x54);
+export const BL_PACKET_NACK_DATA0               = (0x99);
+export const BL_PACKET_BEGIN_SESSION_DATA0      = (0x60);
+export const BL_PACKET_SESSION_RESPONSE_DATA0   = (0x63);
+
+// Single round trip handshake, see comms.h for the layouts
+export const BL_BEGIN_SESSION_LENGTH    = 11;
+export const BL_SESSION_RESPONSE_LENGTH = 13;
+export const BL_CAPABILITY_COBS         = 0x01;
+export const BL_CAPABILITY_SPARSE       = 0x02;
+export const BL_CAPABILITY_BLOCKS       = 0x04;
+export const BL_CAPABILITY_QUERY_CRC    = 0x08;
+export const BL_CAPABILITY_STATS        = 0x10;
+export const BL_CAPABILITY_TRACE        = 0x20;
+export const BL_CAPABILITY_SEQUENCE     = 0x40;
+
+// Sparse transfers, see comms.h
+export const BL_FW_UPDATE_OPTION_SPARSE = 0x02;
+export const BL_PACKET_EXTENT_DATA0     = 0x66;
+export const BL_EXTENT_LENGTH           = 9;
+export const SPARSE_MIN_GAP             = 2 * 16; // erased bytes worth an extent header
+
+// Block transfers, see comms.h
+export const BL_FW_UPDATE_OPTION_BLOCKS   = 0x04;
+export const BL_PACKET_WRITE_BLOCK_DATA0  = 0x69;
+export const BL_PACKET_QUERY_BLOCKS_DATA0 = 0x6C;
+export const BL_PACKET_BLOCKS_DATA0       = 0x6F;
+export const BL_PACKET_END_TRANSFER_DATA0 = 0x72;
+export const BL_BLOCK_SIZE                = 64;
+export const BL_WRITE_BLOCK_LENGTH        = 3;
+export const BL_QUERY_BLOCKS_LENGTH       = 3;
+export const BL_BLOCKS_LENGTH             = 16;
+export const BL_BLOCKS_PER_QUERY          = (BL_BLOCKS_LENGTH - 3) * 8;
+
+// CRC-32 of a range of flash, computed on the device, see comms.h
+export const BL_PACKET_QUERY_CRC_DATA0    = 0x75;
+export const BL_PACKET_CRC_DATA0          = 0x78;
+export const BL_QUERY_CRC_LENGTH          = 9;
+export const BL_CRC_LENGTH                = 13;
+
+// Device statistics, see comms.h for the layout
+export const BL_FW_UPDATE_OPTION_STATS    = 0x08;
+export const BL_PACKET_QUERY_STATS_DATA0  = 0x7B;
+export const BL_PACKET_STATS_DATA0        = 0x7E;
+export const BL_STATS_LENGTH              = 16;
+
+// Reading out the device's event trace, see comms.h and trace.ts
+export const BL_PACKET_QUERY_TRACE_DATA0  = 0x81;
+export const BL_PACKET_TRACE_DATA0        = 0x84;
+export const BL_QUERY_TRACE_LENGTH        = 3;
+export const BL_TRACE_LENGTH              = 14;
+
+// Sequenced transfers, in which a packet resent after a lost ACK is dropped
+// rather than taken twice, see comms.h
+export const BL_FW_UPDATE_OPTION_SEQUENCE = 0x10;
+export const BL_PACKET_SEQUENCE_BIT       = 0x80;
+export const BL_READY_SEQUENCED_LENGTH    = 5;
+
+export type DeviceStats = {
+  rxKiB: number;
+  txKiB: number;
+  overruns: number;
+  rxDropped: number;
+  crcErrors: number;
+  retxSent: number;
+  retxReceived: number;
+  ringHighWater: number;
+  ringFull: number;
+  eraseMs: number;
+  programMs: number;
+};
+
+// Lay out device statistics as a stats packet's data, the device's side
+export const encodeStats = (stats: DeviceStats) => {
+  const data = Buffer.alloc(BL_STATS_LENGTH);
+  const u8 = (value: number) => Math.min(value, 0xff);
+  const u16 = (value: number) => Math.min(Math.floor(value), 0xffff);
+
+  data[0] = BL_PACKET_STATS_DATA0;
+  data.writeUInt16LE(u16(stats.rxKiB), 1);
+  data.writeUInt16LE(u16(stats.txKiB), 3);
+  data[5] = u8(stats.overruns);
+  data[6] = u8(stats.rxDropped);
+  data[7] = u8(stats.crcErrors);
+  data[8] = u8(stats.retxSent);
+  data[9] = u8(stats.retxReceived);
+  data[10] = u8(stats.ringHighWater);
+  data[11] = u8(stats.ringFull);
+  data.writeUInt16LE(u16(stats.eraseMs), 12);
+  data.writeUInt16LE(u16(stats.programMs), 14);
+  return data;
+};
+
+export const decodeStats = (data: Buffer): DeviceStats => ({
+  rxKiB: data.readUInt16LE(1),
+  txKiB: data.readUInt16LE(3),
+  overruns: data[5],
+  rxDropped: data[6],
+  crcErrors: data[7],
+  retxSent: data[8],
+  retxReceived: data[9],
+  ringHighWater: data[10],
+  ringFull: data[11],
+  eraseMs: data.readUInt16LE(12),
+  programMs: data.readUInt16LE(14),
+});
+
+export const FWINFO_ADDRESS        = (FLASH_BASE + BOOTLOADER_SIZE + VECTOR_TABLE_SIZE)
+export const FWINFO_VALIDATE_FROM  = (VECTOR_TABLE_SIZE + FIRMWARE_INFO_SIZE)
+export const MIN_FW_LENGTH         = (VECTOR_TABLE_SIZE + 16 + 16) // info block and signature
+
+export const FWINFO_SENTINEL_OFFSET  = (VECTOR_TABLE_SIZE + (0 * 4));
+export const FWINFO_DEVICE_ID_OFFSET = (VECTOR_TABLE_SIZE + (1 * 4));
+export const FWINFO_VERSION_OFFSET   = (VECTOR_TABLE_SIZE + (2 * 4));
+export const FWINFO_LENGTH_OFFSET    = (VECTOR_TABLE_SIZE + (3 * 4));
+export const FWINFO_RESERVED0_OFFSET = (VECTOR_TABLE_SIZE + (4 * 4));
+export const FWINFO_RESERVED1_OFFSET = (VECTOR_TABLE_SIZE + (5 * 4));
+export const FWINFO_RESERVED2_OFFSET = (VECTOR_TABLE_SIZE + (6 * 4));
+export const FWINFO_RESERVED3_OFFSET = (VECTOR_TABLE_SIZE + (7 * 4));
+export const FWINFO_CRC32_OFFSET     = (VECTOR_TABLE_SIZE + (9 * 4));
+export const FWINFO_SENTINEL         = (0xDEADC0DE) // Example sentinel value to identify firmware info structure
+
+
+// Validation constants
+export const DEVICE_ID = (0xA3); // arbitrary device id used to identify for fw uconst
+export const MAX_FW_LENGTH = ((1024 * 512) - BOOTLOADER_SIZE); // see firmware-info.h
+
+export const SYNC_SEQ = Buffer.from([0xC4, 0x55, 0x7E, 0x10]);
+
+// "enter bootloader" command understood by a running application, see handoff.h
+export const HANDOFF_COMMAND_SEQ = Buffer.from([0xB0, 0x07, 0x1D, 0xE5]);
+// baud rates it accepts, HANDOFF_BAUD_RATES in handoff.h
+export const HANDOFF_BAUD_RATES = [9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600];
+
+export const DEFAULT_TIMEOUT = (5000);  // default timeout at 5s
+export const SHORT_TIMEOUT   = (1000);  // short timeout at 1s
+export const LONG_TIMEOUT    = (15000); // long timeout at 15s
+
+// Bootloader constants
+export const BL_SIZE = 0x8000; // 32kB bootloader size
+
+export type Framing = 'raw' | 'cobs';
+
+// CRC8 of every single byte value, polynomial 0x07
+const CRC8_TABLE = (() => {
+  const table = new Uint8Array(256);
+
+  for (let byte = 0; byte < 256; byte++) {
+    let crc = byte;
+    for (let i = 0; i < 8; i++) {
+      if (crc & 0x80) {
+        crc = ((crc << 1) ^ 0x07) & 0xff;
+      } else {
+        crc = (crc << 1) & 0xff;
+      }
+    }
+    table[byte] = crc;
+  }
+
+  return table;
+})();
+
+// CRC8 implementation, a byte at a time through CRC8_TABLE. Pass the CRC of
+// preceding data as crc to continue it.
+export const crc8 = (data: Uint8Array | Array<number>, crc = 0) => {
+  for (let i = 0; i < data.length; i++) {
+    crc = CRC8_TABLE[crc ^ data[i]];
+  }
+
+  return crc;
+};
+
+// CRC32 implementation
+export const crc32 = (data: Buffer, length: number) => {
+  let byte;
+  let crc = 0xffffffff;
+  let mask;
+
+  for (let i = 0; i < length; i++) {
+    byte = data[i];
+    crc = (crc ^ byte) >>> 0;
+
+    for (let j = 0; j < 8; j++) {
+      mask = (-(crc & 1)) >>> 0;
+      crc = ((crc >>> 1) ^ (0xedb88320 & mask)) >>> 0;
+    }
+  }
+
+  return (~crc) >>> 0;
+}
+
+// COBS encode a packet into frame at offset, so that it contains no delimiter
+// bytes, and terminate it. Returns the length of the frame.
+export const cobsEncodeInto = (data: Buffer, frame: Buffer, offset = 0) => {
+  let codeIndex = offset;
+  let writeIndex = offset + 1;
+  let code = 1;
+
+  for (const byte of data) {
+    if (byte === PACKET_COBS_DELIMITER) {
+      frame[codeIndex] = code;
+      codeIndex = writeIndex++;
+      code = 1;
+    } else {
+      frame[writeIndex++] = byte;
+      code++;
+    }
+  }
+  frame[codeIndex] = code;
+  frame[writeIndex++] = PACKET_COBS_DELIMITER;
+
+  return writeIndex - offset;
+};
+
+// COBS encode a packet, so that it contains no delimiter bytes, and terminate it
+export const cobsEncode = (data: Buffer) => {
+  const frame = Buffer.alloc(data.length + 2);
+  cobsEncodeInto(data, frame);
+  return frame;
+};
+
+// Decode a COBS frame (without its delimiter), or null if it is malformed
+export const cobsDecode = (frame: Buffer) => {
+  const data: number[] = [];
+  let readIndex = 0;
+
+  while (readIndex < frame.length) {
+    const code = frame[readIndex++];
+    if (readIndex + code - 1 > frame.length) {
+      return null;
+    }
+    for (let i = 1; i < code; i++) {
+      data.push(frame[readIndex++]);
+    }
+    // the last run of the frame has no zero following it
+    if (readIndex < frame.length) {
+      data.push(PACKET_COBS_DELIMITER);
+    }
+  }
+
+  return Buffer.from(data);
+};
+
+// Async delay function, which gives the event loop time to process outside input
+export const delay = (ms: number) => new Promise(resolve => setTimeout(resolve, ms));
+
+// Class for serialising and deserialising packets
+export class Packet {
+  length: number;
+  data: Buffer;
+  crc: number;
+
+  static retx = new Packet(1, Buffer.from([PACKET_RETX_DATA0])).toBuffer();
+  static ack = new Packet(1, Buffer.from([PACKET_ACK_DATA0])).toBuffer();
+
+  constructor(length: number, data: Buffer, crc?: number) {
+    this.length = length;
+    this.data = data;
+
+    const bytesToPad = PACKET_DATA_BYTES - this.data.length;
+    const padding = Buffer.alloc(bytesToPad).fill(0xff);
+    this.data = Buffer.concat([this.data, padding]);
+
+    if (typeof crc === 'undefined') {
+      this.crc = this.computeCrc();
+    } else {
+      this.crc = crc;
+    }
+  }
+
+  computeCrc() {
+    return crc8(this.data, CRC8_TABLE[this.length & 0xff]);
+  }
+
+  toBuffer() {
+    return Buffer.concat([ Buffer.from([this.length]), this.data, Buffer.from([this.crc]) ]);
+  }
+
+  isSingleBytePacket(byte: number) {
+    if (this.length !== 1) return false;
+    if (this.data[0] !== byte) return false;
+    for (let i = 1; i < PACKET_DATA_BYTES; i++) {
+      if (this.data[i] !== 0xff) return false;
+    }
+    return true;
+  }
+
+  isAck() {
+    return this.isSingleBytePacket(PACKET_ACK_DATA0);
+  }
+
+  isRetx() {
+    return this.isSingleBytePacket(PACKET_RETX_DATA0);
+  }
+
+  static createSingleBytePacket(byte: number) {
+    return new Packet(1, Buffer.from([byte]));
+  }
+}
+
+// A range of the image holding something other than erased flash
+export type Extent = { offset: number; length: number };
+
+// Ranges of the image which are not erased (0xFF) flash. Gaps shorter than
+// minGap are sent rather than skipped, as an extent header costs a packet too.
+export const findExtents = (image: Buffer, minGap = SPARSE_MIN_GAP) => {
+  const extents: Extent[] = [];
+  let offset = 0;
+
+  while (offset < image.length) {
+    while (offset < image.length && image[offset] === 0xff) {
+      offset++;
+    }
+    if (offset === image.length) {
+      break;
+    }
+
+    let end = offset;
+    let erasedRun = 0;
+    while (end + erasedRun < image.length && erasedRun < minGap) {
+      if (image[end + erasedRun] === 0xff) {
+        erasedRun++;
+      } else {
+        end += erasedRun + 1;
+        erasedRun = 0;
+      }
+    }
+
+    extents.push({ offset, length: end - offset });
+    offset = end;
+  }
+
+  return extents;
+};
+
+// Blocks of the image which are not entirely erased (0xFF) flash, as ranges.
+// Erased blocks need not be sent at all, the device having erased them already.
+export const findBlocks = (image: Buffer) => {
+  const blocks: Extent[] = [];
+
+  for (let offset = 0; offset < image.length; offset += BL_BLOCK_SIZE) {
+    const length = Math.min(BL_BLOCK_SIZE, image.length - offset);
+    if (image.subarray(offset, offset + length).some(byte => byte !== 0xff)) {
+      blocks.push({ offset, length });
+    }
+  }
+
+  return blocks;
+};
+
+// How the image is laid out in frames: all of it in order, extents in order,
+// or blocks which the device accepts in any order
+export type Layout = 'sequential' | 'sparse' | 'blocks';
+
+// Every data packet of an image, framed and checksummed up front into one
+// contiguous buffer, so that sending a packet is writing a view into it. A
+// sparse layout sends only the extents which are not erased, each after an
+// extent header, and a block layout every block which is not erased, each
+// after a write block command. A sequenced transfer also needs every frame
+// with BL_PACKET_SEQUENCE_BIT set, built from the first the first time asked.
+export class FrameStream {
+  readonly framing: Framing;
+  readonly buffer: Buffer;
+  readonly frameLength: number;
+  readonly count: number;
+  readonly imageLength: number;
+  readonly layout: Layout;
+  readonly bytesSent: number; // image bytes carried, short of imageLength unless sequential
+  private progress: Uint32Array; // image bytes done once each frame is sent
+  private blockFrames = new Map<number, number>(); // block number to its first frame
+  private scratch = Buffer.alloc(PACKET_LENGTH); // packet before COBS encoding
+  private sequencedBuffer: Buffer | null = null; // frames with the sequence bit set
+
+  constructor(image: Buffer, framing: Framing, layout: Layout = 'sequential') {
+    this.framing = framing;
+    this.frameLength = framing === 'cobs' ? PACKET_COBS_FRAME_LENGTH : PACKET_LENGTH;
+    this.imageLength = image.length;
+    this.layout = layout;
+
+    const ranges = layout === 'sparse' ? findExtents(image)
+      : layout === 'blocks' ? findBlocks(image)
+      : [{ offset: 0, length: image.length }];
+    const headers = layout === 'sparse' ? ranges.length + 1 // and the end
+      : layout === 'blocks' ? ranges.length
+      : 0;
+    this.bytesSent = ranges.reduce((total, range) => total + range.length, 0);
+    this.count = headers + ranges.reduce((total, range) => total + Math.ceil(range.length / PACKET_DATA_BYTES), 0);
+    this.buffer = Buffer.alloc(this.count * this.frameLength);
+    this.progress = new Uint32Array(this.count);
+
+    let index = 0;
+    for (const range of ranges) {
+      if (layout !== 'sequential') {
+        this.progress[index] = range.offset;
+      }
+      if (layout === 'sparse') {
+        this.writeExtentHeader(index++, range);
+      } else if (layout === 'blocks') {
+        this.blockFrames.set(range.offset / BL_BLOCK_SIZE, index);
+        this.writeBlockHeader(index++, range.offset / BL_BLOCK_SIZE);
+      }
+
+      for (let dataStart = range.offset; dataStart < range.offset + range.length; dataStart += PACKET_DATA_BYTES) {
+        const dataEnd = Math.min(dataStart + PACKET_DATA_BYTES, range.offset + range.length);
+        this.progress[index] = dataEnd;
+        this.writePacket(index++, image, dataStart, dataEnd);
+      }
+    }
+
+    if (layout === 'sparse') {
+      this.progress[index] = image.length;
+      this.writeExtentHeader(index++, { offset: image.length, length: 0 });
+    }
+  }
+
+  // A frame, with the sequence bit of its length byte given, 0 or BL_PACKET_SEQUENCE_BIT
+  frame(index: number, sequence = 0) {
+    const buffer = sequence === 0 ? this.buffer : (this.sequencedBuffer ??= this.withSequenceBit());
+    return buffer.subarray(index * this.frameLength, (index + 1) * this.frameLength);
+  }
+
+  // Bytes of the image the device has been given once frame index is sent
+  progressAfter(index: number) {
+    return this.progress[index];
+  }
+
+  // Blocks in the image, whether or not they are sent
+  get blockCount() {
+    return Math.ceil(this.imageLength / BL_BLOCK_SIZE);
+  }
+
+  // Frames [start, end) carrying a block, its write block command first, or
+  // null if the block is erased and so not sent
+  framesOfBlock(block: number) {
+    const start = this.blockFrames.get(block);
+    if (start === undefined) {
+      return null;
+    }
+
+    const length = Math.min(BL_BLOCK_SIZE, this.imageLength - block * BL_BLOCK_SIZE);
+    return { start, end: start + 1 + Math.ceil(length / PACKET_DATA_BYTES) };
+  }
+
+  private withSequenceBit() {
+    const buffer = Buffer.alloc(this.buffer.length);
+
+    for (let index = 0; index < this.count; index++) {
+      const frame = this.frame(index);
+      const packet = this.framing === 'cobs' ? cobsDecode(frame.subarray(0, frame.length - 1))! : Buffer.from(frame);
+      packet[0] |= BL_PACKET_SEQUENCE_BIT;
+      packet[PACKET_CRC_INDEX] = crc8(packet.subarray(0, PACKET_CRC_INDEX));
+
+      if (this.framing === 'cobs') {
+        cobsEncodeInto(packet, buffer, index * this.frameLength);
+      } else {
+        packet.copy(buffer, index * this.frameLength);
+      }
+    }
+
+    return buffer;
+  }
+
+  private writeBlockHeader(index: number, block: number) {
+    const header = Buffer.alloc(BL_WRITE_BLOCK_LENGTH);
+    header[0] = BL_PACKET_WRITE_BLOCK_DATA0;
+    header.writeUInt16LE(block, 1);
+    this.writePacket(index, header, 0, BL_WRITE_BLOCK_LENGTH);
+  }
+
+  private writeExtentHeader(index: number, extent: Extent) {
+    const header = Buffer.alloc(BL_EXTENT_LENGTH);
+    header[0] = BL_PACKET_EXTENT_DATA0;
+    header.writeUInt32LE(extent.offset, 1);
+    header.writeUInt32LE(extent.length, 5);
+    this.writePacket(index, header, 0, BL_EXTENT_LENGTH);
+  }
+
+  private writePacket(index: number, source: Buffer, dataStart: number, dataEnd: number) {
+    const packet = this.framing === 'cobs' ? this.scratch : this.frame(index);
+    const dataLength = dataEnd - dataStart;
+
+    packet[0] = dataLength;
+    source.copy(packet, PACKET_LENGTH_BYTES, dataStart, dataEnd);
+    packet.fill(0xff, PACKET_LENGTH_BYTES + dataLength, PACKET_CRC_INDEX);
+    packet[PACKET_CRC_INDEX] = crc8(packet.subarray(0, PACKET_CRC_INDEX));
+
+    if (this.framing === 'cobs') {
+      cobsEncodeInto(packet, this.buffer, index * this.frameLength);
+    }
+  }
+}
@@ -0,0 +1,915 @@
+import { SerialPort } from 'serialport';
+import * as crypto from 'crypto'; // session tokens for application handoff
+import {
+  PACKET_DATA_BYTES, PACKET_CRC_INDEX, PACKET_LENGTH, PACKET_COBS_DELIMITER,
+  BL_FW_UPDATE_OPTION_COBS, BL_PACKET_SYNC_OBSERVED_DATA0,
+  BL_PACKET_FW_UPDATE_REQUEST_DATA0, BL_PACKET_FW_UPDATE_RESPONSE_DATA0,
+  BL_PACKET_DEVICE_ID_REQUEST_DATA0, BL_PACKET_DEVICE_ID_RESPONSE_DATA0,
+  BL_PACKET_FW_LENGTH_REQUEST_DATA0, BL_PACKET_FW_LENGTH_RESPONSE_DATA0,
+  BL_PACKET_READY_FOR_DATA_DATA0, BL_PACKET_UPDATE_SUCCESS_DATA0,
+  BL_PACKET_NACK_DATA0, BL_PACKET_BEGIN_SESSION_DATA0, BL_PACKET_SESSION_RESPONSE_DATA0,
+  BL_BEGIN_SESSION_LENGTH, BL_SESSION_RESPONSE_LENGTH, BL_CAPABILITY_COBS, BL_CAPABILITY_SPARSE,
+  BL_FW_UPDATE_OPTION_SPARSE, BL_FW_UPDATE_OPTION_BLOCKS, BL_CAPABILITY_BLOCKS,
+  BL_PACKET_QUERY_BLOCKS_DATA0, BL_PACKET_BLOCKS_DATA0, BL_PACKET_END_TRANSFER_DATA0,
+  BL_QUERY_BLOCKS_LENGTH, BL_BLOCKS_LENGTH, BL_BLOCKS_PER_QUERY,
+  BL_PACKET_QUERY_CRC_DATA0, BL_PACKET_CRC_DATA0, BL_QUERY_CRC_LENGTH, BL_CRC_LENGTH, Extent, crc32,
+  BL_FW_UPDATE_OPTION_STATS, BL_CAPABILITY_STATS, BL_PACKET_QUERY_STATS_DATA0, BL_PACKET_STATS_DATA0,
+  BL_STATS_LENGTH, DeviceStats, decodeStats,
+  BL_PACKET_QUERY_TRACE_DATA0, BL_PACKET_TRACE_DATA0, BL_QUERY_TRACE_LENGTH, BL_TRACE_LENGTH,
+  BL_CAPABILITY_QUERY_CRC, BL_FW_UPDATE_OPTION_SEQUENCE, BL_CAPABILITY_SEQUENCE, BL_PACKET_SEQUENCE_BIT,
+  BL_READY_SEQUENCED_LENGTH,
+  FWINFO_DEVICE_ID_OFFSET, FWINFO_VERSION_OFFSET, SYNC_SEQ, HANDOFF_COMMAND_SEQ,
+  DEFAULT_TIMEOUT, SHORT_TIMEOUT, Packet, FrameStream, Framing, crc8, cobsEncode, cobsDecode,
+} from './protocol';
+import { TraceRecord } from './trace';
+
+const RX_RING_CAPACITY = (64 * 1024); // far more than the device ever has in flight
+const BLOCK_RESEND_ROUNDS = 3; // times missing blocks are sent again before giving up
+const BISECT_MIN_LENGTH = 256;  // bytes, ranges this short are not split further
+const BISECT_MAX_RANGES = 16;   // mismatched ranges to narrow down at once
+const QUERY_ATTEMPTS = 3;       // times a query is asked whose answer was lost
+const RESEND_ATTEMPTS = 5;      // waits for an answer before a command is given up on
+
+export class Logger {
+  static info(message: string) {console.log(`[.] ${message}`); }
+  static success(message: string) {console.log(`[$] ${message}`); }
+  static error(message: string) {console.error(`[!] ${message}`); }
+}
+
+// Fixed-size ring of received bytes, so a burst of data costs one copy rather
+// than a Buffer.concat and slice of everything still unparsed
+class RxRing {
+  private buffer: Buffer;
+  private head = 0; // index of the oldest byte
+  private count = 0;
+
+  constructor(capacity = RX_RING_CAPACITY) {
+    this.buffer = Buffer.alloc(capacity);
+  }
+
+  get length() {
+    return this.count;
+  }
+
+  // Append received data, returning false if there is no room for it
+  write(data: Buffer) {
+    if (data.length > this.buffer.length - this.count) {
+      return false;
+    }
+
+    const tail = (this.head + this.count) % this.buffer.length;
+    const firstPart = Math.min(data.length, this.buffer.length - tail);
+    data.copy(this.buffer, tail, 0, firstPart);
+    data.copy(this.buffer, 0, firstPart);
+    this.count += data.length;
+    return true;
+  }
+
+  at(index: number) {
+    return this.buffer[(this.head + index) % this.buffer.length];
+  }
+
+  indexOf(byte: number) {
+    for (let i = 0; i < this.count; i++) {
+      if (this.at(i) === byte) return i;
+    }
+    return -1;
+  }
+
+  // Copy out n bytes starting at offset, without consuming them
+  peek(offset: number, n: number) {
+    const out = Buffer.allocUnsafe(n);
+    const start = (this.head + offset) % this.buffer.length;
+    const firstPart = Math.min(n, this.buffer.length - start);
+    this.buffer.copy(out, 0, start, start + firstPart);
+    this.buffer.copy(out, firstPart, 0, n - firstPart);
+    return out;
+  }
+
+  // Copy out and consume the oldest n bytes
+  consume(n: number) {
+    const out = this.peek(0, n);
+    this.discard(n);
+    return out;
+  }
+
+  discard(n: number) {
+    this.head = (this.head + n) % this.buffer.length;
+    this.count -= n;
+  }
+}
+
+type Waiter = {
+  resolve: (packet: Packet) => void;
+  reject: (err: Error) => void;
+};
+
+// Packets received and acknowledged, waiting to be handled. A waiter is resolved
+// the moment its packet is parsed, rather than on the next poll.
+class PacketQueue {
+  private packets: Packet[] = [];
+  private waiters: Waiter[] = [];
+  private error: Error | null = null;
+
+  get length() {
+    return this.packets.length;
+  }
+
+  get failed() {
+    return this.error !== null;
+  }
+
+  push(packet: Packet) {
+    const waiter = this.waiters.shift();
+    if (waiter) {
+      waiter.resolve(packet);
+    } else {
+      this.packets.push(packet);
+    }
+  }
+
+  // Fail every current and future wait, once the session cannot continue
+  fail(err: Error) {
+    this.error = err;
+    for (const waiter of this.waiters.splice(0)) {
+      waiter.reject(err);
+    }
+  }
+
+  next(timeout = DEFAULT_TIMEOUT) {
+    const packet = this.packets.shift();
+    if (packet !== undefined) {
+      return Promise.resolve(packet);
+    }
+    if (this.error !== null) {
+      return Promise.reject(this.error);
+    }
+
+    return new Promise<Packet>((resolve, reject) => {
+      const waiter: Waiter = {
+        resolve: received => {
+          clearTimeout(timer);
+          resolve(received);
+        },
+        reject: err => {
+          clearTimeout(timer);
+          reject(err);
+        },
+      };
+      const timer = setTimeout(() => {
+        this.waiters.splice(this.waiters.indexOf(waiter), 1);
+        reject(new Error('Timed out waiting for packet'));
+      }, timeout);
+      this.waiters.push(waiter);
+    });
+  }
+}
+
+// Byte stream to one device, either a serial port or a simulated device
+export interface Link {
+  write(data: Buffer): void;
+  onData(handler: (data: Buffer) => void): void;
+  onError(handler: (err: Error) => void): void;
+  // Waits for pending writes to go out at the old rate first
+  setBaudRate(baudRate: number): Promise<void>;
+  close(): Promise<void>;
+}
+
+export class SerialLink implements Link {
+  private port: SerialPort;
+
+  constructor(path: string, baudRate: number) {
+    this.port = new SerialPort({ path, baudRate });
+  }
+
+  write(data: Buffer) {
+    this.port.write(data);
+  }
+
+  onData(handler: (data: Buffer) => void) {
+    this.port.on('data', handler);
+  }
+
+  onError(handler: (err: Error) => void) {
+    this.port.on('error', handler);
+  }
+
+  async setBaudRate(baudRate: number) {
+    await new Promise<void>(resolve => this.port.drain(() => resolve()));
+    await new Promise<void>(resolve => this.port.update({ baudRate }, () => resolve()));
+  }
+
+  close() {
+    return new Promise<void>(resolve => this.port.close(() => resolve()));
+  }
+}
+
+export type UpdateOptions = {
+  baudRate: number;          // rate the link was opened at
+  fromAppBaudRate?: number;  // ask the running application to enter the bootloader
+  cobs?: boolean;            // switch to COBS framing for the transfer
+  legacyHandshake?: boolean; // separate update request, device ID and length exchanges
+  sparse?: boolean;          // send only the extents of the image which are not erased flash
+  blocks?: boolean;          // send blocks by number, then again any the device is missing
+};
+
+const isSessionResponse = (packet: Packet) =>
+  packet.length === BL_SESSION_RESPONSE_LENGTH && packet.data[0] === BL_PACKET_SESSION_RESPONSE_DATA0;
+
+const hex32 = (value: number) => `0x${value.toString(16).padStart(8, '0')}`;
+
+export type ProgressHandler = (bytesWritten: number, fwLength: number) => void;
+
+// One firmware update over one link. All protocol state lives here, so any
+// number of sessions can run side by side in one process.
+export class Session {
+  readonly name: string;
+  private link: Link;
+  private rxBuffer = new RxRing();
+  private packets = new PacketQueue();
+  private lastFrame: Buffer = Packet.ack; // as written, for retransmission
+  private lastTaken: Buffer | null = null; // last packet passed on, as received
+
+  // RETX packets sent to the device, and frames sent again when it asked
+  retxSent = 0;
+  retransmits = 0;
+  commandsResent = 0; // of a sequenced transfer, after no answer came
+
+  // The device's own counters, once it has reported them
+  deviceStats: DeviceStats | null = null;
+
+  // Framing in use, and the framing to switch to once the bootloader responds
+  // to the update request
+  private framing: Framing = 'raw';
+  private pendingFraming: Framing | null = null;
+
+  // Whether the transfer is sequenced, see comms.h, and the commands sent in
+  // it, which sets the sequence bit of the next and the count READY should hold
+  private sequenced = false;
+  private commandsSent = 0;
+  private lastCommand: Buffer | null = null; // as written, for resending
+
+  // Session token of an application handoff we are waiting on, if any. The
+  // application echoes what it receives, so until the bootloader announces the
+  // session the receive buffer is scanned for the announcement packet rather
+  // than parsed in fixed packet-sized steps.
+  private awaitingSessionToken: number | null = null;
+
+  constructor(name: string, link: Link) {
+    this.name = name;
+    this.link = link;
+    link.onData(data => this.onData(data));
+    link.onError(err => this.packets.fail(err));
+  }
+
+  private info(message: string) { Logger.info(`${this.name}: ${message}`); }
+  private success(message: string) { Logger.success(`${this.name}: ${message}`); }
+
+  close() {
+    return this.link.close();
+  }
+
+  private writePacket(packet: Buffer) {
+    this.writeFrame(this.framing === 'cobs' ? cobsEncode(packet) : packet);
+  }
+
+  // Write a packet for the device's state machine, as against ACK and RETX
+  // for its packet layer, with the sequence bit when the transfer is sequenced
+  private writeCommand(packet: Buffer) {
+    const sequence = this.nextSequence();
+    if (sequence !== 0) {
+      packet = Buffer.from(packet);
+      packet[0] |= sequence;
+      packet[PACKET_CRC_INDEX] = crc8(packet.subarray(0, PACKET_CRC_INDEX));
+    }
+    this.writePacket(packet);
+    this.lastCommand = this.lastFrame;
+  }
+
+  // Sequence bit for the next command, counting it as sent
+  private nextSequence() {
+    const sequence = this.sequenced && (this.commandsSent & 1) ? BL_PACKET_SEQUENCE_BIT : 0;
+    this.commandsSent++;
+    return sequence;
+  }
+
+  // Write a frame already encoded for the framing in use
+  private writeFrame(frame: Buffer) {
+    this.link.write(frame);
+    this.lastFrame = frame;
+  }
+
+  private scanForSessionAnnouncement(token: number) {
+    const rxBuffer = this.rxBuffer;
+
+    for (let i = 0; i + PACKET_LENGTH <= rxBuffer.length; i++) {
+      const raw = rxBuffer.peek(i, PACKET_LENGTH);
+      const packet = new Packet(raw[0], raw.slice(1, 1+PACKET_DATA_BYTES), raw[PACKET_CRC_INDEX]);
+
+      if (packet.length === 5
+        && packet.data[0] === BL_PACKET_SYNC_OBSERVED_DATA0
+        && packet.data.readUInt32LE(1) === token
+        && packet.crc === packet.computeCrc()) {
+        rxBuffer.discard(i + PACKET_LENGTH);
+        return packet;
+      }
+    }
+
+    // keep only what could still be the start of the announcement
+    rxBuffer.discard(Math.max(0, rxBuffer.length - (PACKET_LENGTH - 1)));
+    return null;
+  }
+
+  // Take the next frame from the receive buffer according to the framing in use,
+  // or null if none has completely arrived. A COBS frame which does not decode to
+  // a packet comes back with the wrong length, to be treated as corrupted.
+  private takeFrame(): Buffer | null {
+    const rxBuffer = this.rxBuffer;
+
+    if (this.framing === 'raw') {
+      return rxBuffer.length >= PACKET_LENGTH ? rxBuffer.consume(PACKET_LENGTH) : null;
+    }
+
+    while (true) {
+      const end = rxBuffer.indexOf(PACKET_COBS_DELIMITER);
+      if (end < 0) {
+        return null;
+      }
+
+      const frame = rxBuffer.consume(end + 1).subarray(0, end);
+      if (frame.length > 0) { // empty frames only flush the line
+        return cobsDecode(frame) ?? Buffer.alloc(0);
+      }
+    }
+  }
+
+  // This function fires whenever data is received from the device. The whole
+  // packet state machine runs here.
+  private onData(data: Buffer) {
+    // Add the data to the packet
+    if (!this.rxBuffer.write(data)) {
+      this.packets.fail(new Error(`Receive buffer overflow, ${this.rxBuffer.length} bytes unparsed`));
+      return;
+    }
+
+    if (this.awaitingSessionToken !== null) {
+      const announcement = this.scanForSessionAnnouncement(this.awaitingSessionToken);
+      if (announcement === null) {
+        return;
+      }
+      this.awaitingSessionToken = null;
+      this.packets.push(announcement);
+    }
+
+    // Can we build a packet?
+    let raw: Buffer | null;
+    while ((raw = this.takeFrame()) !== null) {
+      // A COBS frame with bytes lost or gained is resent like a corrupted one
+      if (raw.length !== PACKET_LENGTH) {
+        this.retxSent++;
+        this.writePacket(Packet.retx);
+        continue;
+      }
+
+      const packet = new Packet(raw[0], raw.slice(1, 1+PACKET_DATA_BYTES), raw[PACKET_CRC_INDEX]);
+      const computedCrc = packet.computeCrc();
+
+      // Need retransmission?
+      if (packet.crc !== computedCrc) {
+        this.retxSent++;
+        this.writePacket(Packet.retx);
+        continue;
+      }
+
+      // Are we being asked to retransmit?
+      if (packet.isRetx()) {
+        this.retransmits++;
+        this.writeFrame(this.lastFrame);
+        continue;
+      }
+
+      // If this is an ack, move on
+      if (packet.isAck()) {
+        continue;
+      }
+
+      // If this is a nack, the session is over
+      if (packet.isSingleBytePacket(BL_PACKET_NACK_DATA0)) {
+        this.packets.fail(new Error('Received NACK packet'));
+        continue;
+      }
+
+      // The bootloader switches framing right after its update or session
+      // response, so everything from its acknowledgement on uses the new framing
+      if (this.pendingFraming !== null
+        && (packet.isSingleBytePacket(BL_PACKET_FW_UPDATE_RESPONSE_DATA0) || isSessionResponse(packet))) {
+        this.framing = this.pendingFraming;
+        this.pendingFraming = null;
+      }
+
+      // No two packets in a row of a sequenced transfer are alike, so one like
+      // the last must have been resent after our ACK was lost. Acknowledging
+      // it again would only overwrite the frame the device may yet ask for.
+      if (this.sequenced && this.lastTaken !== null && raw.equals(this.lastTaken)) {
+        continue;
+      }
+      this.lastTaken = raw;
+
+      // Otherwise write the packet in to the buffer, and send an ack
+      this.packets.push(packet);
+      this.writePacket(Packet.ack);
+    }
+  }
+
+  // Function to allow us to await a packet
+  private waitForPacket(timeout = DEFAULT_TIMEOUT) {
+    return this.packets.next(timeout);
+  }
+
+  // Wait for the device's answer to the last command. A sequenced transfer
+  // stalls with a command or its answer lost whole, as when a COBS delimiter
+  // is corrupted, but the device drops a command it has taken already and
+  // sends READY again, so the command is simply resent after a while.
+  private async waitForAnswer() {
+    if (!this.sequenced || this.lastCommand === null) {
+      return this.waitForPacket();
+    }
+
+    for (let attempt = 1; ; attempt++) {
+      const packet = await this.waitForPacket(SHORT_TIMEOUT).catch((err: Error) => {
+        if (this.packets.failed || attempt === RESEND_ATTEMPTS) {
+          throw err;
+        }
+        return null;
+      });
+      if (packet !== null) {
+        return packet;
+      }
+
+      this.commandsResent++;
+      this.writeFrame(this.lastCommand);
+    }
+  }
+
+  private async waitForSingleBytePacket(byte: number, timeout = DEFAULT_TIMEOUT) {
+    const packet = await this.waitForPacket(timeout).catch((err: Error): never => {
+      throw new Error(`Error waiting for single byte packet 0x${byte.toString(16)}: ${err.message}`
+        + ` (${this.rxBuffer.length} bytes unparsed)`);
+    });
+
+    if (packet.length != 1 || packet.data[0] != byte) {
+      throw new Error(`Expected single byte packet with data 0x${byte.toString(16)}, got packet: ${packet.toBuffer().toString('hex')}`);
+    }
+  }
+
+  // Wait for the device to be ready for the next command of the transfer. In
+  // a sequenced transfer it also says how many it has taken, which should be
+  // every one sent.
+  private async waitForReady() {
+    if (!this.sequenced) {
+      return this.waitForSingleBytePacket(BL_PACKET_READY_FOR_DATA_DATA0);
+    }
+
+    const packet = await this.waitForAnswer().catch((err: Error): never => {
+      throw new Error(`Error waiting for READY: ${err.message} (${this.rxBuffer.length} bytes unparsed)`);
+    });
+    if (packet.length !== BL_READY_SEQUENCED_LENGTH || packet.data[0] !== BL_PACKET_READY_FOR_DATA_DATA0) {
+      throw new Error(`Expected READY, got packet: ${packet.toBuffer().toString('hex')}`);
+    }
+    const taken = packet.data.readUInt32LE(1);
+    if (taken !== this.commandsSent) {
+      throw new Error(`Device took ${taken} packets of the ${this.commandsSent} sent`);
+    }
+  }
+
+  private async syncWithBootloader(timeout = DEFAULT_TIMEOUT) {
+    let timeWaited = 0;
+
+    while (true) {
+      this.link.write(SYNC_SEQ);
+      // device should respond within < 1s
+      const packet = await this.waitForPacket(SHORT_TIMEOUT).catch(() => null);
+      timeWaited += SHORT_TIMEOUT;
+
+      if (packet !== null) { // if we have a packet, then we can assume we are in sync
+        if (packet.isSingleBytePacket(BL_PACKET_SYNC_OBSERVED_DATA0)) {
+          this.info("Bootloader sync observed");
+          return;
+        }
+        throw new Error(`Bootloader sync failed, got packet: ${packet.toBuffer().toString('hex')}`);
+      }
+
+      // if we haven't received packet after given timeout, then give up
+      if (timeWaited >= timeout) {
+        throw new Error(`Bootloader sync timed out after ${timeout}ms`);
+      }
+    }
+  }
+
+  // Ask a running application to reset into the bootloader, which then skips
+  // sync and announces the session at the requested baud rate
+  private async requestUpdateFromApp(fwLength: number, sessionBaudRate: number, baudRate: number, timeout = DEFAULT_TIMEOUT) {
+    const token = crypto.randomBytes(4).readUInt32LE(0);
+
+    const params = Buffer.alloc(12);
+    params.writeUInt32LE(sessionBaudRate, 0);
+    params.writeUInt32LE(fwLength, 4);
+    params.writeUInt32LE(token, 8);
+
+    this.awaitingSessionToken = token;
+    this.link.write(Buffer.concat([HANDOFF_COMMAND_SEQ, params, Buffer.from([crc8(params)])]));
+
+    if (sessionBaudRate !== baudRate) {
+      await this.link.setBaudRate(sessionBaudRate);
+    }
+
+    const packet = await this.waitForPacket(timeout).catch((): never => {
+      throw new Error(`Application did not hand over to the bootloader after ${timeout}ms`);
+    });
+    this.info(`Bootloader session 0x${token.toString(16)} announced (${packet.length} bytes)`);
+  }
+
+  // Run a whole firmware update, throwing if it fails at any point. The data
+  // frames are prepared up front, see FrameStream, and may be shared by sessions.
+  async update(fwImage: Buffer, frames: FrameStream, options: UpdateOptions, onProgress?: ProgressHandler) {
+    const fwLength = fwImage.length;
+
+    if (frames.framing !== (options.cobs ? 'cobs' : 'raw')) {
+      throw new Error(`Firmware frames prepared for ${frames.framing} framing`);
+    }
+    if ((options.sparse || options.blocks) && options.legacyHandshake) {
+      throw new Error('Sparse and block transfers need the begin session handshake');
+    }
+    if (options.sparse && options.blocks) {
+      throw new Error('A transfer is either sparse or in blocks, not both');
+    }
+    if (frames.layout !== (options.sparse ? 'sparse' : options.blocks ? 'blocks' : 'sequential')) {
+      throw new Error(`Firmware frames prepared for a ${frames.layout} transfer`);
+    }
+
+    // Start the bootloader update process
+    await this.enterBootloader(fwLength, options);
+
+    let capabilities = 0;
+    if (options.legacyHandshake) {
+      await this.legacyHandshake(fwImage, options);
+    } else {
+      capabilities = await this.beginSession(fwImage, options);
+    }
+
+    // at this point, bootloader should be erasing main application flash
+    this.info('Main application erasing...');
+
+    // Now we can start sending the firmware data. A bootloader which sequences
+    // transfers also answers queries between extents, so flash can be checked
+    // before the zero length extent ends a sparse transfer.
+    if (options.sparse && (capabilities & BL_CAPABILITY_SEQUENCE)) {
+      await this.sendFrames(frames, 0, frames.count - 1, onProgress);
+      await this.checkTransfer(fwImage);
+      await this.sendFrames(frames, frames.count - 1, frames.count, onProgress);
+    } else {
+      await this.sendFrames(frames, 0, frames.count, onProgress);
+    }
+
+    if (options.blocks) {
+      await this.completeBlocks(fwImage, frames, capabilities);
+    }
+
+    // asked for in the begin session command, if the bootloader has them. The
+    // device only resends its latest packet, so they are lost rather than
+    // resent if corrupted, the success following them being latest by then.
+    let succeeded = false;
+    if (capabilities & BL_CAPABILITY_STATS) {
+      succeeded = !(await this.receiveStats(BL_PACKET_UPDATE_SUCCESS_DATA0));
+    }
+
+    // the bootloader checks the image itself before claiming success, and
+    // answers NACK if it is not valid
+    if (!succeeded) {
+      await this.waitForSingleBytePacket(BL_PACKET_UPDATE_SUCCESS_DATA0);
+    }
+    this.success('Firmware update successful!');
+  }
+
+  // Check the device's flash holds the whole image, before the transfer ends
+  private async checkTransfer(fwImage: Buffer) {
+    await this.waitForReady();
+
+    const range = { offset: 0, length: fwImage.length };
+    const crc = await this.queryCrc(range);
+    const expected = crc32(fwImage, fwImage.length);
+    if (crc !== expected) {
+      throw new Error(`Device flash has CRC-32 ${hex32(crc)}, expected ${hex32(expected)}, image corrupted in transfer`);
+    }
+    this.info(`Device flash matches the image, CRC-32 ${hex32(crc)}`);
+  }
+
+  // Compare the device's flash with an image, without changing or reading it
+  // back, returning the ranges which differ. Mismatched ranges are bisected
+  // down to BISECT_MIN_LENGTH bytes using CRC-32s computed on the device.
+  async verify(fwImage: Buffer, options: UpdateOptions) {
+    await this.enterBootloader(fwImage.length, options);
+
+    const mismatched: Extent[] = [];
+    const pending: Extent[] = [{ offset: 0, length: fwImage.length }];
+    let queries = 0;
+
+    while (pending.length > 0) {
+      const range = pending.shift()!;
+      const expected = crc32(fwImage.subarray(range.offset, range.offset + range.length), range.length);
+      queries++;
+      if (await this.queryCrc(range) === expected) {
+        continue;
+      }
+
+      if (range.length <= BISECT_MIN_LENGTH || mismatched.length + pending.length >= BISECT_MAX_RANGES) {
+        mismatched.push(range);
+        continue;
+      }
+      const half = Math.ceil(range.length / 2);
+      pending.push({ offset: range.offset, length: half });
+      pending.push({ offset: range.offset + half, length: range.length - half });
+    }
+
+    this.writePacket(Packet.createSingleBytePacket(BL_PACKET_QUERY_STATS_DATA0).toBuffer());
+    await this.receiveStats();
+
+    // leave the bootloader as it was, nothing having been erased
+    this.writePacket(Packet.createSingleBytePacket(BL_PACKET_END_TRANSFER_DATA0).toBuffer());
+    await this.waitForSingleBytePacket(BL_PACKET_UPDATE_SUCCESS_DATA0);
+
+    this.info(`Verified in ${queries} CRC queries`);
+    return mismatched.sort((a, b) => a.offset - b.offset);
+  }
+
+  // Read out the device's event trace, oldest record first. The device stops
+  // tracing at the first query, until it next boots.
+  async readTrace(options: UpdateOptions) {
+    await this.enterBootloader(0, options);
+
+    const records: TraceRecord[] = [];
+    let count = 1; // until the device says how many it holds
+    let cpuMHz = 0;
+
+    for (let index = 0; index < count; index++) {
+      const query = Buffer.alloc(BL_QUERY_TRACE_LENGTH);
+      query[0] = BL_PACKET_QUERY_TRACE_DATA0;
+      query.writeUInt16LE(index, 1);
+      this.writePacket(new Packet(BL_QUERY_TRACE_LENGTH, query).toBuffer());
+
+      const response = await this.waitForPacket().catch((err: Error): never => {
+        throw new Error(`No trace record ${index}: ${err.message}`);
+      });
+      if (response.length !== BL_TRACE_LENGTH || response.data[0] !== BL_PACKET_TRACE_DATA0
+        || response.data.readUInt16LE(1) !== index) {
+        throw new Error(`Expected trace record ${index}, got packet: ${response.toBuffer().toString('hex')}`);
+      }
+
+      count = response.data.readUInt16LE(3);
+      cpuMHz = response.data[5];
+      records.push({
+        timestamp: response.data.readUInt32LE(6),
+        event: response.data[10],
+        arg0: response.data[11],
+        arg1: response.data.readUInt16LE(12),
+      });
+    }
+
+    // leave the bootloader as it was, nothing having been erased
+    this.writePacket(Packet.createSingleBytePacket(BL_PACKET_END_TRANSFER_DATA0).toBuffer());
+    await this.waitForSingleBytePacket(BL_PACKET_UPDATE_SUCCESS_DATA0);
+
+    return { cpuMHz, records };
+  }
+
+  // Take the device's stats packet, which tells whether a slow session was
+  // down to the line, the packet layer or flash. Returns false if instead came
+  // the single byte packet insteadOf, which the stats were sent ahead of.
+  private async receiveStats(insteadOf?: number) {
+    const packet = await this.waitForAnswer().catch((err: Error): never => {
+      throw new Error(`No device statistics: ${err.message}`);
+    });
+    if (insteadOf !== undefined && packet.isSingleBytePacket(insteadOf)) {
+      this.info('Device statistics lost on the way');
+      return false;
+    }
+    if (packet.length !== BL_STATS_LENGTH || packet.data[0] !== BL_PACKET_STATS_DATA0) {
+      throw new Error(`Expected device statistics, got packet: ${packet.toBuffer().toString('hex')}`);
+    }
+
+    const stats = decodeStats(packet.data);
+    this.deviceStats = stats;
+    this.info(`Device received ${stats.rxKiB} KiB, sent ${stats.txKiB} KiB; ${stats.overruns} UART overruns, `
+      + `${stats.rxDropped} bytes dropped, ${stats.crcErrors} CRC errors, RETX ${stats.retxSent} sent `
+      + `${stats.retxReceived} received, packet ring high-water ${stats.ringHighWater} full ${stats.ringFull}; `
+      + `erase ${stats.eraseMs} ms, program ${stats.programMs} ms`);
+    return true;
+  }
+
+  // Send a query and take the packet answering it. Corrupted, the answer is
+  // lost once the READY following it is the device's latest packet, but in a
+  // sequenced transfer that READY counts the query and so is told from any
+  // other, and the query, changing nothing, is asked again.
+  private async query(query: Buffer, isAnswer: (packet: Packet) => boolean) {
+    for (let attempt = 1; ; attempt++) {
+      this.writeCommand(query);
+      const response = await this.waitForAnswer();
+
+      const answerLost = this.sequenced && response.length === BL_READY_SEQUENCED_LENGTH
+        && response.data[0] === BL_PACKET_READY_FOR_DATA_DATA0
+        && response.data.readUInt32LE(1) === this.commandsSent;
+      if (isAnswer(response) || !answerLost || attempt === QUERY_ATTEMPTS) {
+        return response;
+      }
+      this.info('Answer to a query lost on the way, asking again');
+    }
+  }
+
+  private async queryCrc(range: Extent) {
+    const query = Buffer.alloc(BL_QUERY_CRC_LENGTH);
+    query[0] = BL_PACKET_QUERY_CRC_DATA0;
+    query.writeUInt32LE(range.offset, 1);
+    query.writeUInt32LE(range.length, 5);
+
+    const isAnswer = (response: Packet) => response.length === BL_CRC_LENGTH && response.data[0] === BL_PACKET_CRC_DATA0
+      && response.data.readUInt32LE(1) === range.offset && response.data.readUInt32LE(5) === range.length;
+    const response = await this.query(new Packet(BL_QUERY_CRC_LENGTH, query).toBuffer(), isAnswer).catch((err: Error): never => {
+      throw new Error(`No CRC for ${range.length} bytes at ${range.offset}: ${err.message}`);
+    });
+    if (!isAnswer(response)) {
+      throw new Error(`Expected CRC for ${range.length} bytes at ${range.offset}, got packet: ${response.toBuffer().toString('hex')}`);
+    }
+
+    return response.data.readUInt32LE(9);
+  }
+
+  // Sync with the bootloader, or have the running application hand over to it
+  private async enterBootloader(fwLength: number, options: UpdateOptions) {
+    this.sequenced = false; // until a session says otherwise
+    if (options.fromAppBaudRate !== undefined) {
+      // Skip sync entirely, the application resets straight into the handshake
+      this.info(`Requesting update from application at ${options.fromAppBaudRate} baud...`);
+      await this.requestUpdateFromApp(fwLength, options.fromAppBaudRate, options.baudRate);
+      this.success('Bootloader entered from application!');
+    } else {
+      // Begin by attempting serial sync with bootloader
+      this.info('Attempting to sync with bootloader...');
+      await this.syncWithBootloader();
+      this.success('Bootloader sync successful!');
+    }
+  }
+
+  // Send frames [start, end), each once the device is ready for it
+  private async sendFrames(frames: FrameStream, start: number, end: number, onProgress?: ProgressHandler) {
+    for (let i = start; i < end; i++) {
+      await this.waitForReady();
+
+      this.writeFrame(frames.frame(i, this.nextSequence()));
+      this.lastCommand = this.lastFrame;
+
+      onProgress?.(frames.progressAfter(i), frames.imageLength);
+    }
+  }
+
+  // Ask which blocks the device has written, and send again those it is
+  // missing until it has them all, then check and end the transfer
+  private async completeBlocks(fwImage: Buffer, frames: FrameStream, capabilities: number) {
+    for (let round = 0; ; round++) {
+      const missing = await this.queryMissingBlocks(frames);
+      if (missing.length === 0) {
+        break;
+      }
+      if (round === BLOCK_RESEND_ROUNDS) {
+        throw new Error(`Device still missing ${missing.length} blocks after ${round} rounds`);
+      }
+
+      this.info(`Sending ${missing.length} missing blocks again...`);
+      for (const block of missing) {
+        const { start, end } = frames.framesOfBlock(block)!;
+        await this.sendFrames(frames, start, end);
+      }
+    }
+
+    if (capabilities & BL_CAPABILITY_QUERY_CRC) {
+      await this.checkTransfer(fwImage);
+    }
+
+    await this.waitForReady();
+    this.writeCommand(Packet.createSingleBytePacket(BL_PACKET_END_TRANSFER_DATA0).toBuffer());
+  }
+
+  // Blocks which should hold data but which the device has not written
+  private async queryMissingBlocks(frames: FrameStream) {
+    const missing: number[] = [];
+
+    for (let first = 0; first < frames.blockCount; first += BL_BLOCKS_PER_QUERY) {
+      await this.waitForReady();
+
+      const query = Buffer.alloc(BL_QUERY_BLOCKS_LENGTH);
+      query[0] = BL_PACKET_QUERY_BLOCKS_DATA0;
+      query.writeUInt16LE(first, 1);
+
+      const isAnswer = (response: Packet) => response.length === BL_BLOCKS_LENGTH
+        && response.data[0] === BL_PACKET_BLOCKS_DATA0 && response.data.readUInt16LE(1) === first;
+      const response = await this.query(new Packet(BL_QUERY_BLOCKS_LENGTH, query).toBuffer(), isAnswer);
+      if (!isAnswer(response)) {
+        throw new Error(`Expected blocks from ${first}, got packet: ${response.toBuffer().toString('hex')}`);
+      }
+
+      const last = Math.min(first + BL_BLOCKS_PER_QUERY, frames.blockCount);
+      for (let block = first; block < last; block++) {
+        const bit = block - first;
+        const written = (response.data[3 + (bit >> 3)] & (1 << (bit & 7))) !== 0;
+        if (!written && frames.framesOfBlock(block) !== null) {
+          missing.push(block);
+        }
+      }
+    }
+
+    return missing;
+  }
+
+  // Settle device ID, length and options in one round trip, learning what the
+  // device currently runs on the way
+  private async beginSession(fwImage: Buffer, options: UpdateOptions) {
+    this.info('Beginning update session...');
+    const command = Buffer.alloc(BL_BEGIN_SESSION_LENGTH);
+    command[0] = BL_PACKET_BEGIN_SESSION_DATA0;
+    command[1] = fwImage[FWINFO_DEVICE_ID_OFFSET];
+    command.writeUInt32LE(fwImage.length, 2);
+    command.writeUInt32LE(fwImage.readUInt32LE(FWINFO_VERSION_OFFSET), 6);
+    command[10] = (options.cobs ? BL_FW_UPDATE_OPTION_COBS : 0) | (options.sparse ? BL_FW_UPDATE_OPTION_SPARSE : 0)
+      | (options.blocks ? BL_FW_UPDATE_OPTION_BLOCKS : 0) | BL_FW_UPDATE_OPTION_STATS
+      | BL_FW_UPDATE_OPTION_SEQUENCE; // taken up only by bootloaders which can
+
+    this.pendingFraming = options.cobs ? 'cobs' : null;
+    this.writePacket(new Packet(BL_BEGIN_SESSION_LENGTH, command).toBuffer());
+
+    const response = await this.waitForPacket().catch((err: Error): never => {
+      throw new Error(`No session response: ${err.message}`);
+    });
+    if (!isSessionResponse(response)) {
+      throw new Error(`Expected session response, got packet: ${response.toBuffer().toString('hex')}`);
+    }
+
+    const capabilities = response.data[1];
+    const bootloaderVersion = response.data.readUInt16LE(2);
+    this.success(`Session begun with bootloader ${bootloaderVersion >> 8}.${bootloaderVersion & 0xff}`
+      + ` (capabilities 0x${capabilities.toString(16)}), replacing firmware`
+      + ` ${hex32(response.data.readUInt32LE(5))} of ${response.data.readUInt32LE(9)} bytes`
+      + ` with ${hex32(command.readUInt32LE(6))}`);
+    if (options.cobs && !(capabilities & BL_CAPABILITY_COBS)) {
+      throw new Error('Bootloader does not support COBS framing');
+    }
+    if (options.sparse && !(capabilities & BL_CAPABILITY_SPARSE)) {
+      throw new Error('Bootloader does not support sparse transfers');
+    }
+    if (options.blocks && !(capabilities & BL_CAPABILITY_BLOCKS)) {
+      throw new Error('Bootloader does not support block transfers');
+    }
+
+    // the bootloader sequences the transfer if it can, counting from its first READY
+    this.sequenced = (capabilities & BL_CAPABILITY_SEQUENCE) !== 0;
+    this.commandsSent = 0;
+    this.lastCommand = null;
+
+    return capabilities;
+  }
+
+  // Update request, device ID and firmware length as separate exchanges, as
+  // understood by every bootloader version
+  private async legacyHandshake(fwImage: Buffer, options: UpdateOptions) {
+    const fwLength = fwImage.length;
+
+    // Sync successful, now request for firmware update
+    this.info('Requesting firmware update...');
+    const fwUpdatePacket = options.cobs
+      ? new Packet(2, Buffer.from([BL_PACKET_FW_UPDATE_REQUEST_DATA0, BL_FW_UPDATE_OPTION_COBS]))
+      : Packet.createSingleBytePacket(BL_PACKET_FW_UPDATE_REQUEST_DATA0);
+    this.pendingFraming = options.cobs ? 'cobs' : null;
+    this.writePacket(fwUpdatePacket.toBuffer());
+    await this.waitForSingleBytePacket(BL_PACKET_FW_UPDATE_RESPONSE_DATA0);
+    this.success('Firmware update request successful...');
+
+    // If request found, validate firmware device ID
+    this.info('Awaiting device ID request...');
+    await this.waitForSingleBytePacket(BL_PACKET_DEVICE_ID_REQUEST_DATA0);
+    this.success('Device ID request received, sending device ID...');
+    const deviceID = fwImage[FWINFO_DEVICE_ID_OFFSET];
+    const deviceIdPacket = new Packet(2, Buffer.from([BL_PACKET_DEVICE_ID_RESPONSE_DATA0, deviceID]));
+    this.writePacket(deviceIdPacket.toBuffer());
+    this.info(`Device ID ${deviceID.toString(16)} sent...`); // formats in hex
+
+    // Receive firmware length request, then send calculated firmware length
+    this.info('Awaiting firmware length request...');
+    await this.waitForSingleBytePacket(BL_PACKET_FW_LENGTH_REQUEST_DATA0);
+    this.success('Firmware length request received...');
+    // 1 byte for packet tag, 4 bytes for little-endian uint32 firmware length
+    const fwLengthPacketBuffer = Buffer.alloc(5);
+    fwLengthPacketBuffer[0] = BL_PACKET_FW_LENGTH_RESPONSE_DATA0; // packet tag
+    fwLengthPacketBuffer.writeUInt32LE(fwLength, 1); // firmware length
+    const fwLengthPacket = new Packet(5, fwLengthPacketBuffer);
+    this.writePacket(fwLengthPacket.toBuffer());
+    this.info('Sending firmware length...');
+  }
+}
@@ -0,0 +1,945 @@
+// In-process model of the bootloader's update state machine, for exercising the
+// updater against any number of devices without hardware attached
+import { performance } from 'perf_hooks';
+import { Link } from './session';
+import {
+  PACKET_DATA_BYTES, PACKET_CRC_INDEX, PACKET_LENGTH, PACKET_COBS_DELIMITER,
+  BL_FW_UPDATE_OPTION_COBS, BL_PACKET_SYNC_OBSERVED_DATA0,
+  BL_PACKET_FW_UPDATE_REQUEST_DATA0, BL_PACKET_FW_UPDATE_RESPONSE_DATA0,
+  BL_PACKET_DEVICE_ID_REQUEST_DATA0, BL_PACKET_DEVICE_ID_RESPONSE_DATA0,
+  BL_PACKET_FW_LENGTH_REQUEST_DATA0, BL_PACKET_FW_LENGTH_RESPONSE_DATA0,
+  BL_PACKET_READY_FOR_DATA_DATA0, BL_PACKET_UPDATE_SUCCESS_DATA0,
+  BL_PACKET_NACK_DATA0, BL_PACKET_BEGIN_SESSION_DATA0, BL_PACKET_SESSION_RESPONSE_DATA0,
+  BL_BEGIN_SESSION_LENGTH, BL_SESSION_RESPONSE_LENGTH, BL_CAPABILITY_COBS, BL_CAPABILITY_SPARSE,
+  BL_FW_UPDATE_OPTION_SPARSE, BL_PACKET_EXTENT_DATA0, BL_EXTENT_LENGTH,
+  BL_FW_UPDATE_OPTION_BLOCKS, BL_CAPABILITY_BLOCKS, BL_PACKET_WRITE_BLOCK_DATA0, BL_PACKET_QUERY_BLOCKS_DATA0,
+  BL_PACKET_BLOCKS_DATA0, BL_PACKET_END_TRANSFER_DATA0, BL_BLOCK_SIZE, BL_WRITE_BLOCK_LENGTH,
+  BL_QUERY_BLOCKS_LENGTH, BL_BLOCKS_LENGTH, BL_BLOCKS_PER_QUERY,
+  BL_CAPABILITY_QUERY_CRC, BL_PACKET_QUERY_CRC_DATA0, BL_PACKET_CRC_DATA0, BL_QUERY_CRC_LENGTH, BL_CRC_LENGTH, crc32,
+  BL_FW_UPDATE_OPTION_STATS, BL_CAPABILITY_STATS, BL_PACKET_QUERY_STATS_DATA0, BL_STATS_LENGTH, encodeStats,
+  BL_CAPABILITY_TRACE, BL_PACKET_QUERY_TRACE_DATA0, BL_PACKET_TRACE_DATA0, BL_QUERY_TRACE_LENGTH, BL_TRACE_LENGTH,
+  BL_FW_UPDATE_OPTION_SEQUENCE, BL_CAPABILITY_SEQUENCE, BL_PACKET_SEQUENCE_BIT, BL_READY_SEQUENCED_LENGTH,
+  FWINFO_DEVICE_ID_OFFSET, FWINFO_VERSION_OFFSET, FWINFO_LENGTH_OFFSET, DEVICE_ID, MIN_FW_LENGTH, MAX_FW_LENGTH, SYNC_SEQ, HANDOFF_COMMAND_SEQ, HANDOFF_BAUD_RATES,
+  Packet, Framing, crc8, cobsEncode, cobsDecode,
+} from './protocol';
+import {
+  TraceRecord, TRACE_EVENT_BOOT, TRACE_EVENT_STATE, TRACE_EVENT_PACKET_RX, TRACE_EVENT_PACKET_TX,
+  TRACE_EVENT_PACKET_BAD, TRACE_EVENT_FLASH_ERASE_START, TRACE_EVENT_FLASH_ERASE_END,
+  TRACE_EVENT_FLASH_PROGRAM_START, TRACE_EVENT_FLASH_PROGRAM_END,
+} from './trace';
+
+const BITS_PER_BYTE = 10; // start bit, 8 data bits, stop bit
+const SIMULATED_ERASE_TIME = 50; // ms, real erases take seconds but prove nothing more
+const SIMULATED_SECTORS = 6; // of the main application, 2 to 7
+const FLASH_QUEUE_LENGTH = 8; // BL_FLASH_QUEUE_LENGTH
+const SIMULATED_BOOTLOADER_VERSION = 0x0201;
+const SIMULATED_CPU_MHZ = 84;
+const TRACE_LENGTH = 128; // records held, as core/trace.h
+const TRACE_BAD_CRC = 1;
+const TRACE_BAD_FRAMING = 2;
+
+// bl_state_t values of the states modelled
+const BL_STATES: Record<string, number> = {
+  sync: 0, update_req: 1, device_id_resp: 3, fw_length_resp: 5, erase: 6, receive_fw: 7, done: 8,
+};
+
+// What a noisy line does to the bytes crossing it. Rates are probabilities per
+// bit or per byte, times are in ms.
+export type Impairments = {
+  bitErrorRate: number;
+  dropRate: number;
+  duplicateRate: number;
+  insertRate: number; // of a random byte arriving ahead of the real one
+  latency: number;
+  jitter: number; // extra latency, uniformly up to this much
+};
+
+export const NO_IMPAIRMENTS: Impairments = { bitErrorRate: 0, dropRate: 0, duplicateRate: 0, insertRate: 0, latency: 0, jitter: 0 };
+
+// Parse "ber=1e-5,drop=1e-4,dup=0,ins=0,latency=2,jitter=1", any keys omitted being 0
+export const parseImpairments = (spec: string): Impairments => {
+  const keys: Record<string, keyof Impairments> = {
+    ber: 'bitErrorRate', drop: 'dropRate', dup: 'duplicateRate', ins: 'insertRate', latency: 'latency', jitter: 'jitter',
+  };
+  const impairments = { ...NO_IMPAIRMENTS };
+
+  for (const setting of spec.split(',').filter(setting => setting.length > 0)) {
+    const [key, value] = setting.split('=');
+    if (!(key in keys) || value === undefined || !Number.isFinite(Number(value))) {
+      throw new Error(`Unknown impairment '${setting}', expected ${Object.keys(keys).join('/')}=<number>`);
+    }
+    impairments[keys[key]] = Number(value);
+  }
+
+  return impairments;
+};
+
+// Small seeded PRNG (mulberry32), so an impaired run is reproducible from its seed
+const mulberry32 = (seed: number) => {
+  let state = seed >>> 0;
+
+  return () => {
+    state = (state + 0x6d2b79f5) >>> 0;
+    let t = state;
+    t = Math.imul(t ^ (t >>> 15), t | 1);
+    t ^= t + Math.imul(t ^ (t >>> 7), t | 61);
+    return ((t ^ (t >>> 14)) >>> 0) / 4294967296;
+  };
+};
+
+// One direction of a simulated serial line. Bytes arrive, in order, after the
+// time they would take on the wire at the current baud rate, impaired along
+// the way by decisions drawn from the line's own seeded PRNG.
+class SimulatedLine {
+  baudRate: number;
+  readonly injected = { corruptedBytes: 0, droppedBytes: 0, duplicatedBytes: 0, insertedBytes: 0 };
+  private deliver: (data: Buffer) => void;
+  private impairments: Impairments;
+  private random: () => number;
+  private pending: Array<{ at: number, data: Buffer }> = [];
+  private busyUntil = 0;
+  private lastArrival = 0;
+  private timer: NodeJS.Timeout | null = null;
+
+  constructor(baudRate: number, deliver: (data: Buffer) => void, impairments: Impairments, seed: number) {
+    this.baudRate = baudRate;
+    this.deliver = deliver;
+    this.impairments = impairments;
+    this.random = mulberry32(seed);
+  }
+
+  send(data: Buffer) {
+    const start = Math.max(performance.now(), this.busyUntil);
+    this.busyUntil = start + (data.length * BITS_PER_BYTE * 1000) / this.baudRate;
+
+    const { latency, jitter } = this.impairments;
+    const at = Math.max(this.lastArrival, this.busyUntil + latency + jitter * this.random());
+    this.lastArrival = at;
+    this.pending.push({ at, data: this.impair(data) });
+    this.schedule();
+  }
+
+  private impair(data: Buffer) {
+    const { bitErrorRate, dropRate, duplicateRate, insertRate } = this.impairments;
+    if (bitErrorRate === 0 && dropRate === 0 && duplicateRate === 0 && insertRate === 0) {
+      return Buffer.from(data);
+    }
+
+    const out: number[] = [];
+    for (let byte of data) {
+      // only drawn for when asked for, so that seeds replay older scenarios
+      if (insertRate > 0 && this.random() < insertRate) {
+        this.injected.insertedBytes++;
+        out.push(Math.floor(this.random() * 256));
+      }
+      if (this.random() < dropRate) {
+        this.injected.droppedBytes++;
+        continue;
+      }
+
+      let corrupted = false;
+      for (let bit = 0; bit < 8; bit++) {
+        if (this.random() < bitErrorRate) {
+          byte ^= 1 << bit;
+          corrupted = true;
+        }
+      }
+      if (corrupted) {
+        this.injected.corruptedBytes++;
+      }
+
+      out.push(byte);
+      if (this.random() < duplicateRate) {
+        this.injected.duplicatedBytes++;
+        out.push(byte);
+      }
+    }
+
+    return Buffer.from(out);
+  }
+
+  drained() {
+    return new Promise<void>(resolve =>
+      setTimeout(resolve, Math.max(0, this.busyUntil - performance.now())));
+  }
+
+  close() {
+    if (this.timer !== null) {
+      clearTimeout(this.timer);
+    }
+    this.pending = [];
+  }
+
+  private schedule() {
+    if (this.timer !== null || this.pending.length === 0) {
+      return;
+    }
+
+    const wait = Math.max(0, this.pending[0].at - performance.now());
+    this.timer = setTimeout(() => {
+      this.timer = null;
+      const now = performance.now();
+      while (this.pending.length > 0 && this.pending[0].at <= now) {
+        this.deliver(this.pending.shift()!.data);
+      }
+      this.schedule();
+    }, wait);
+  }
+}
+
+type FlashOperation = {
+  kind: 'erase' | 'program';
+  sector: number; // erase only
+  offset: number; // program only
+  data: Buffer; // program only
+  done: (failed: boolean) => void;
+};
+
+// Model of bl-flash.c's operation queue, which the flash interrupt works
+// through between passes of the state machine, and of the stall on flash
+// while a sector erases, which overruns the UART. It checks the ordering the
+// hardware relies on: one operation at a time, in the order submitted, and
+// nothing programmed but bytes erased since the session began, which the
+// real flash would silently AND with what it held.
+class SimulatedFlash {
+  private queue: FlashOperation[] = [];
+  private erased = new Uint8Array(MAX_FW_LENGTH);
+  private idleHandlers: (() => void)[] = [];
+  private memory: Buffer;
+  private traceEvent: (event: number, arg0?: number, arg1?: number) => void;
+  eraseMs = 0;
+
+  constructor(memory: Buffer, traceEvent: (event: number, arg0?: number, arg1?: number) => void) {
+    this.memory = memory;
+    this.traceEvent = traceEvent;
+  }
+
+  get space() {
+    return FLASH_QUEUE_LENGTH - this.queue.length;
+  }
+
+  get idle() {
+    return this.queue.length === 0;
+  }
+
+  // The sector being erased, 0 if none. Everything running from flash stalls
+  // meanwhile, the UART interrupt included
+  get erasingSector() {
+    return this.queue.length > 0 && this.queue[0].kind === 'erase' ? this.queue[0].sector : 0;
+  }
+
+  // Mirrors bl_flash_submit_erase_main_app(), done called after the last sector
+  submitErase(done: (failed: boolean) => void) {
+    if (this.space < SIMULATED_SECTORS) {
+      return false;
+    }
+    for (let sector = 2; sector < 2 + SIMULATED_SECTORS; sector++) {
+      const last = sector === 1 + SIMULATED_SECTORS;
+      this.submit({ kind: 'erase', sector, offset: 0, data: Buffer.alloc(0), done: last ? done : () => {} });
+    }
+    return true;
+  }
+
+  // Mirrors bl_flash_submit_write_main_app(), copying the data
+  submitWrite(offset: number, data: Buffer, done: (failed: boolean) => void) {
+    if (this.space === 0 || offset + data.length > MAX_FW_LENGTH) {
+      return false;
+    }
+    this.submit({ kind: 'program', sector: 0, offset, data: Buffer.from(data), done });
+    return true;
+  }
+
+  // Calls handler once every queued operation has ended
+  whenIdle(handler: () => void) {
+    if (this.idle) {
+      handler();
+    } else {
+      this.idleHandlers.push(handler);
+    }
+  }
+
+  private submit(operation: FlashOperation) {
+    this.queue.push(operation);
+    if (this.queue.length === 1) {
+      this.start();
+    }
+  }
+
+  // Ends the operation at the head after its modelled time, then starts the
+  // next, as flash_isr() does
+  private start() {
+    const operation = this.queue[0];
+    if (operation.kind === 'erase') {
+      this.traceEvent(TRACE_EVENT_FLASH_ERASE_START, operation.sector);
+      setTimeout(() => this.complete(), SIMULATED_ERASE_TIME / SIMULATED_SECTORS);
+    } else {
+      this.traceEvent(TRACE_EVENT_FLASH_PROGRAM_START, 0, operation.data.length);
+      setImmediate(() => this.complete());
+    }
+  }
+
+  private complete() {
+    const operation = this.queue.shift()!;
+    let failed = false;
+
+    if (operation.kind === 'erase') {
+      // sectors are not modelled one by one, the image erased with the last
+      if (operation.sector === 1 + SIMULATED_SECTORS) {
+        this.memory.fill(0xff);
+        this.erased.fill(1);
+      }
+      this.eraseMs += SIMULATED_ERASE_TIME / SIMULATED_SECTORS;
+      this.traceEvent(TRACE_EVENT_FLASH_ERASE_END, operation.sector);
+    } else {
+      const { offset, data } = operation;
+      for (let i = 0; i < data.length; i++) {
+        failed ||= !this.erased[offset + i];
+        this.memory[offset + i] &= data[i];
+        this.erased[offset + i] = 0;
+      }
+      this.traceEvent(TRACE_EVENT_FLASH_PROGRAM_END, 0, data.length);
+    }
+
+    operation.done(failed);
+    // a failure cancels everything queued after it
+    while (failed && this.queue.length > 0) {
+      this.queue.shift()!.done(true);
+    }
+
+    if (this.queue.length > 0) {
+      this.start();
+    } else {
+      this.idleHandlers.splice(0).forEach(handler => handler());
+    }
+  }
+}
+
+type DeviceState = 'sync' | 'update_req' | 'device_id_resp' | 'fw_length_resp' | 'erase' | 'receive_fw' | 'done';
+
+export class SimulatedDevice {
+  readonly link: Link; // host end of the line
+  readonly flash = Buffer.alloc(MAX_FW_LENGTH, 0xff);
+  private flashQueue = new SimulatedFlash(this.flash, (event, arg0, arg1) => this.traceEvent(event, arg0, arg1));
+  private flashFailed = false; // any write failed, as flash_errors
+  private deferred: Packet[] = []; // left in the packet ring until the flash catches up
+  fwLength = 0;
+  private currentState: DeviceState = 'sync';
+
+  private toDevice: SimulatedLine;
+  private toHost: SimulatedLine;
+  private hostDataHandler: (data: Buffer) => void = () => {};
+
+  // RETX packets sent, as comms_update() would for corrupted packets
+  retxSent = 0;
+
+  // The rest of what the bootloader counts, for its stats packet
+  private rxBytes = 0;
+  private overruns = 0;
+  private keptSector = 0; // erase stall whose first byte the UART kept
+  private overranSector = 0; // and whose overrun it counted
+  private txBytes = 0;
+  private crcErrors = 0;
+  private retxReceived = 0;
+  private statsRequested = false;
+
+  // What core/trace.c would record, oldest first
+  private trace: TraceRecord[] = [];
+  private traceFrozen = false;
+
+  private framing: Framing = 'raw';
+  private rx: number[] = []; // bytes of the frame being received
+  private lastPacket: Buffer = Packet.ack;
+
+  private syncWindow = Buffer.alloc(SYNC_SEQ.length);
+  private handoffIndex = 0;
+  private handoffParams: number[] = [];
+  private expectedLength = 0; // from an application handoff, 0 if any
+  private bytesWritten = 0; // write position, which extents move forwards
+  private sparse = false;
+  private extentRemaining = 0;
+  private blocks = false;
+  private blocksWritten = new Uint8Array(Math.ceil(MAX_FW_LENGTH / BL_BLOCK_SIZE));
+  private block = 0;
+  private blockData: number[] = []; // of the block being received
+  private blockLength = 0; // 0 between blocks
+  private sequenced = false; // see BL_PACKET_SEQUENCE_BIT
+  private lastSequence = 0; // sequence bit of the last packet taken
+  private packetsTaken = 0; // of a sequenced transfer, duplicates aside
+
+  constructor(baudRate: number, impairments = NO_IMPAIRMENTS, seed = 1) {
+    this.toDevice = new SimulatedLine(baudRate, data => this.receive(data), impairments, seed);
+    this.toHost = new SimulatedLine(baudRate, data => this.hostDataHandler(data), impairments, seed ^ 0x9e3779b9);
+    this.traceEvent(TRACE_EVENT_BOOT);
+    this.traceEvent(TRACE_EVENT_STATE, BL_STATES.sync);
+
+    const device = this;
+    this.link = {
+      write: data => device.toDevice.send(data),
+      onData: handler => { device.hostDataHandler = handler; },
+      onError: () => {},
+      setBaudRate: async baudRate => {
+        await device.toDevice.drained();
+        device.toDevice.baudRate = baudRate;
+        device.toHost.baudRate = baudRate;
+      },
+      close: async () => {
+        device.toDevice.close();
+        device.toHost.close();
+      },
+    };
+  }
+
+  get state() {
+    return this.currentState;
+  }
+
+  // Every state transition is traced, as the bootloader's main loop does
+  set state(state: DeviceState) {
+    if (state !== this.currentState) {
+      this.traceEvent(TRACE_EVENT_STATE, BL_STATES[state]);
+    }
+    this.currentState = state;
+  }
+
+  private traceEvent(event: number, arg0 = 0, arg1 = 0) {
+    if (this.traceFrozen) {
+      return;
+    }
+    const timestamp = Math.floor(performance.now() * SIMULATED_CPU_MHZ * 1000) >>> 0;
+    this.trace.push({ timestamp, event, arg0, arg1 });
+    if (this.trace.length > TRACE_LENGTH) {
+      this.trace.shift();
+    }
+  }
+
+  // Bytes impaired in both directions so far
+  get injected() {
+    const toDevice = this.toDevice.injected;
+    const toHost = this.toHost.injected;
+    return {
+      corruptedBytes: toDevice.corruptedBytes + toHost.corruptedBytes,
+      droppedBytes: toDevice.droppedBytes + toHost.droppedBytes,
+      duplicatedBytes: toDevice.duplicatedBytes + toHost.duplicatedBytes,
+      insertedBytes: toDevice.insertedBytes + toHost.insertedBytes,
+    };
+  }
+
+  // Program an image as if by an earlier update, for verifying against
+  load(fwImage: Buffer) {
+    this.flash.fill(0xff);
+    fwImage.copy(this.flash);
+  }
+
+  // True once the device holds the whole image it was sent
+  holds(fwImage: Buffer) {
+    return this.state === 'done' && this.fwLength === fwImage.length
+      && this.flash.subarray(0, fwImage.length).equals(fwImage);
+  }
+
+  private sendPacket(packet: Buffer) {
+    this.traceEvent(TRACE_EVENT_PACKET_TX, packet[1], packet[0]);
+    const frame = this.framing === 'cobs' ? cobsEncode(packet) : packet;
+    this.lastPacket = packet;
+    this.txBytes += frame.length;
+    this.toHost.send(frame);
+  }
+
+  private sendRetx(reason = TRACE_BAD_CRC) {
+    this.traceEvent(TRACE_EVENT_PACKET_BAD, reason);
+    this.crcErrors++;
+    this.retxSent++;
+    this.sendPacket(Packet.retx);
+  }
+
+  private sendSingleByte(byte: number) {
+    this.sendPacket(Packet.createSingleBytePacket(byte).toBuffer());
+  }
+
+  private abort() {
+    this.sendSingleByte(BL_PACKET_NACK_DATA0);
+    this.state = 'done';
+  }
+
+  private receive(data: Buffer) {
+    for (const byte of data) {
+      // while a sector erases the first byte waits in the data register, and
+      // the rest overrun it, raising one overrun when the stall ends
+      const stalledSector = this.flashQueue.erasingSector;
+      if (stalledSector !== 0) {
+        if (this.keptSector === stalledSector) {
+          this.overruns += this.overranSector === stalledSector ? 0 : 1;
+          this.overranSector = stalledSector;
+          continue;
+        }
+        this.keptSector = stalledSector;
+      }
+
+      this.rxBytes++;
+      if (this.state === 'sync') {
+        this.receiveSyncByte(byte);
+      } else if (this.framing === 'cobs') {
+        this.receiveCobsByte(byte);
+      } else {
+        this.rx.push(byte);
+        if (this.rx.length === PACKET_LENGTH) {
+          this.receiveFrame(Buffer.from(this.rx.splice(0)));
+        }
+      }
+    }
+  }
+
+  // Sync sequence for the bootloader, or the "enter bootloader" command the
+  // application would otherwise have handed over
+  private receiveSyncByte(byte: number) {
+    this.syncWindow.copy(this.syncWindow, 0, 1);
+    this.syncWindow[SYNC_SEQ.length - 1] = byte;
+    if (this.syncWindow.equals(SYNC_SEQ)) {
+      this.sendSingleByte(BL_PACKET_SYNC_OBSERVED_DATA0);
+      this.state = 'update_req';
+      return;
+    }
+
+    if (this.handoffIndex < HANDOFF_COMMAND_SEQ.length) {
+      this.handoffIndex = (byte === HANDOFF_COMMAND_SEQ[this.handoffIndex]) ? this.handoffIndex + 1
+        : (byte === HANDOFF_COMMAND_SEQ[0]) ? 1 : 0;
+      return;
+    }
+
+    this.handoffParams.push(byte);
+    if (this.handoffParams.length < 13) {
+      return;
+    }
+
+    const params = Buffer.from(this.handoffParams.splice(0));
+    this.handoffIndex = 0;
+    if (crc8(params.subarray(0, 12)) !== params[12] || !HANDOFF_BAUD_RATES.includes(params.readUInt32LE(0))) {
+      return;
+    }
+
+    this.expectedLength = params.readUInt32LE(4);
+    const announcement = Buffer.alloc(5);
+    announcement[0] = BL_PACKET_SYNC_OBSERVED_DATA0;
+    params.copy(announcement, 1, 8, 12); // session token
+    this.sendPacket(new Packet(5, announcement).toBuffer());
+    this.state = 'update_req';
+  }
+
+  private receiveCobsByte(byte: number) {
+    if (byte !== PACKET_COBS_DELIMITER) {
+      this.rx.push(byte);
+      return;
+    }
+    if (this.rx.length === 0) {
+      return;
+    }
+
+    const raw = cobsDecode(Buffer.from(this.rx.splice(0)));
+    if (raw === null || raw.length !== PACKET_LENGTH) {
+      this.sendRetx(TRACE_BAD_FRAMING);
+      return;
+    }
+    this.receiveFrame(raw);
+  }
+
+  // Mirrors comms_update(): control packets are handled here, anything else is
+  // acknowledged and passed on to the state machine
+  private receiveFrame(raw: Buffer) {
+    const packet = new Packet(raw[0], raw.slice(1, 1+PACKET_DATA_BYTES), raw[PACKET_CRC_INDEX]);
+
+    if (packet.crc !== packet.computeCrc()) {
+      this.sendRetx();
+      return;
+    }
+    this.traceEvent(TRACE_EVENT_PACKET_RX, packet.data[0], packet.length);
+    if (packet.isRetx()) {
+      this.retxReceived++;
+      this.sendPacket(this.lastPacket);
+      return;
+    }
+    if (packet.isAck()) {
+      return;
+    }
+
+    this.sendPacket(Packet.ack);
+    this.handlePacket(packet);
+  }
+
+  private lengthAcceptable(fwLength: number) {
+    const lengthExpected = this.expectedLength === 0 || this.expectedLength === fwLength;
+    return fwLength >= MIN_FW_LENGTH && fwLength <= MAX_FW_LENGTH && lengthExpected;
+  }
+
+  private switchFraming(options: number) {
+    if (options & BL_FW_UPDATE_OPTION_COBS) {
+      this.framing = 'cobs';
+      this.rx = [];
+    }
+  }
+
+  private startErase(fwLength: number) {
+    this.fwLength = fwLength;
+    this.state = 'erase';
+    this.blocksWritten.fill(0);
+    const queued = this.flashQueue.submitErase(failed => {
+      if (failed) {
+        this.abort();
+        return;
+      }
+      this.rx = []; // comms_discard_input()
+      this.sendReady();
+      this.state = 'receive_fw';
+    });
+    if (!queued) {
+      this.abort();
+    }
+  }
+
+  // Mirrors flash_write_done(), then lets through any packets held back
+  private writeDone(failed: boolean) {
+    this.flashFailed ||= failed;
+    while (this.deferred.length > 0 && !this.mustWait(this.deferred[0])) {
+      this.handlePacket(this.deferred.shift()!);
+    }
+  }
+
+  // Whether the bootloader would leave this packet in the ring for now: with
+  // the flash queue full, or a CRC asked for before queued writes have ended
+  private mustWait(packet: Packet) {
+    const length = this.sequenced ? packet.length & ~BL_PACKET_SEQUENCE_BIT : packet.length;
+    const crcQuery = length === BL_QUERY_CRC_LENGTH && packet.data[0] === BL_PACKET_QUERY_CRC_DATA0;
+    return this.flashQueue.space === 0 || (crcQuery && !this.flashQueue.idle);
+  }
+
+  // Mirrors send_session_response(), describing whatever flash holds
+  private sendSessionResponse() {
+    const response = Buffer.alloc(BL_SESSION_RESPONSE_LENGTH);
+    response[0] = BL_PACKET_SESSION_RESPONSE_DATA0;
+    response[1] = BL_CAPABILITY_COBS | BL_CAPABILITY_SPARSE | BL_CAPABILITY_BLOCKS | BL_CAPABILITY_QUERY_CRC
+      | BL_CAPABILITY_STATS | BL_CAPABILITY_TRACE | BL_CAPABILITY_SEQUENCE;
+    response.writeUInt16LE(SIMULATED_BOOTLOADER_VERSION, 2);
+    response[4] = this.flash[FWINFO_DEVICE_ID_OFFSET];
+    this.flash.copy(response, 5, FWINFO_VERSION_OFFSET, FWINFO_VERSION_OFFSET + 4);
+    this.flash.copy(response, 9, FWINFO_LENGTH_OFFSET, FWINFO_LENGTH_OFFSET + 4);
+    this.sendPacket(new Packet(BL_SESSION_RESPONSE_LENGTH, response).toBuffer());
+  }
+
+  // Mirrors send_ready()
+  private sendReady() {
+    if (!this.sequenced) {
+      this.sendSingleByte(BL_PACKET_READY_FOR_DATA_DATA0);
+      return;
+    }
+
+    const ready = Buffer.alloc(BL_READY_SEQUENCED_LENGTH);
+    ready[0] = BL_PACKET_READY_FOR_DATA_DATA0;
+    ready.writeUInt32LE(this.packetsTaken, 1);
+    this.sendPacket(new Packet(BL_READY_SEQUENCED_LENGTH, ready).toBuffer());
+  }
+
+  // Mirrors take_sequenced_packet(), returning the packet without its sequence
+  // bit, or null if it repeats the last one taken
+  private takeSequencedPacket(packet: Packet) {
+    const sequence = packet.length & BL_PACKET_SEQUENCE_BIT;
+    if (sequence === this.lastSequence) {
+      return null;
+    }
+
+    this.lastSequence = sequence;
+    this.packetsTaken++;
+    return new Packet(packet.length & ~BL_PACKET_SEQUENCE_BIT, packet.data, packet.crc);
+  }
+
+  // Mirrors answer_query(), returning false if the packet is no query or there
+  // is no answer to it
+  private answerQuery(packet: Packet) {
+    if (packet.length === BL_QUERY_CRC_LENGTH && packet.data[0] === BL_PACKET_QUERY_CRC_DATA0) {
+      return this.sendCrc(packet);
+    }
+    if (packet.isSingleBytePacket(BL_PACKET_QUERY_STATS_DATA0)) {
+      this.sendStats();
+      return true;
+    }
+    if (packet.length === BL_QUERY_TRACE_LENGTH && packet.data[0] === BL_PACKET_QUERY_TRACE_DATA0) {
+      return this.sendTraceRecord(packet);
+    }
+    return false;
+  }
+
+  // Mirrors send_blocks()
+  private sendBlocks(first: number) {
+    const response = Buffer.alloc(BL_BLOCKS_LENGTH);
+    const blockCount = Math.ceil(this.fwLength / BL_BLOCK_SIZE);
+    response[0] = BL_PACKET_BLOCKS_DATA0;
+    response.writeUInt16LE(first, 1);
+    for (let bit = 0; bit < BL_BLOCKS_PER_QUERY; bit++) {
+      if (first + bit < blockCount && this.blocksWritten[first + bit]) {
+        response[3 + (bit >> 3)] |= 1 << (bit & 7);
+      }
+    }
+    this.sendPacket(new Packet(BL_BLOCKS_LENGTH, response).toBuffer());
+  }
+
+  // Mirrors send_stats(). Packets are handled as they arrive, so the packet
+  // ring never holds more than one, and programming takes next to no time.
+  private sendStats() {
+    const stats = encodeStats({
+      rxKiB: this.rxBytes / 1024, txKiB: this.txBytes / 1024, overruns: this.overruns, rxDropped: 0,
+      crcErrors: this.crcErrors, retxSent: this.retxSent, retxReceived: this.retxReceived,
+      ringHighWater: 1, ringFull: 0, eraseMs: this.flashQueue.eraseMs, programMs: 0,
+    });
+    this.sendPacket(new Packet(BL_STATS_LENGTH, stats).toBuffer());
+  }
+
+  // Mirrors send_trace_record(), returning false to abort
+  private sendTraceRecord(packet: Packet) {
+    const index = packet.data.readUInt16LE(1);
+    this.traceFrozen = true;
+    if (index >= this.trace.length) {
+      return false;
+    }
+
+    const record = this.trace[index];
+    const response = Buffer.alloc(BL_TRACE_LENGTH);
+    response[0] = BL_PACKET_TRACE_DATA0;
+    response.writeUInt16LE(index, 1);
+    response.writeUInt16LE(this.trace.length, 3);
+    response[5] = SIMULATED_CPU_MHZ;
+    response.writeUInt32LE(record.timestamp, 6);
+    response[10] = record.event;
+    response[11] = record.arg0;
+    response.writeUInt16LE(record.arg1, 12);
+    this.sendPacket(new Packet(BL_TRACE_LENGTH, response).toBuffer());
+    return true;
+  }
+
+  // The update is over, once the last writes have ended, successfully or not.
+  // The bootloader then checks the image's signature before answering, which
+  // this model cannot, not holding the key.
+  private finish() {
+    this.state = 'done';
+    this.flashQueue.whenIdle(() => {
+      if (this.flashFailed) {
+        this.abort();
+        return;
+      }
+      if (this.statsRequested) {
+        this.sendStats();
+      }
+      this.sendSingleByte(BL_PACKET_UPDATE_SUCCESS_DATA0);
+    });
+  }
+
+  // Mirrors send_crc(), returning false to abort
+  private sendCrc(packet: Packet) {
+    const offset = packet.data.readUInt32LE(1);
+    const length = packet.data.readUInt32LE(5);
+    if (offset > MAX_FW_LENGTH || length > MAX_FW_LENGTH - offset) {
+      return false;
+    }
+
+    const response = Buffer.alloc(BL_CRC_LENGTH);
+    response[0] = BL_PACKET_CRC_DATA0;
+    response.writeUInt32LE(offset, 1);
+    response.writeUInt32LE(length, 5);
+    response.writeUInt32LE(crc32(this.flash.subarray(offset, offset + length), length), 9);
+    this.sendPacket(new Packet(BL_CRC_LENGTH, response).toBuffer());
+    return true;
+  }
+
+  // Mirrors receive_block_packet(), returning false to abort
+  private receiveBlockPacket(packet: Packet) {
+    if (this.blockLength === 0) {
+      if (packet.length === BL_WRITE_BLOCK_LENGTH && packet.data[0] === BL_PACKET_WRITE_BLOCK_DATA0) {
+        const offset = packet.data.readUInt16LE(1) * BL_BLOCK_SIZE;
+        if (offset >= this.fwLength) {
+          return false;
+        }
+        this.block = offset / BL_BLOCK_SIZE;
+        this.blockLength = Math.min(BL_BLOCK_SIZE, this.fwLength - offset);
+        this.blockData = [];
+      } else if (packet.length === BL_QUERY_BLOCKS_LENGTH && packet.data[0] === BL_PACKET_QUERY_BLOCKS_DATA0) {
+        this.sendBlocks(packet.data.readUInt16LE(1));
+      } else if (packet.isSingleBytePacket(BL_PACKET_END_TRANSFER_DATA0)) {
+        this.finish();
+        return true;
+      } else if (!this.answerQuery(packet)) {
+        return false;
+      }
+
+      this.sendReady();
+      return true;
+    }
+
+    if (packet.length === 0 || packet.length > PACKET_DATA_BYTES
+      || packet.length > this.blockLength - this.blockData.length) {
+      return false;
+    }
+    this.blockData.push(...packet.data.subarray(0, packet.length));
+
+    if (this.blockData.length === this.blockLength) {
+      if (!this.blocksWritten[this.block]) {
+        if (!this.flashQueue.submitWrite(this.block * BL_BLOCK_SIZE, Buffer.from(this.blockData),
+          failed => this.writeDone(failed))) {
+          return false;
+        }
+        this.blocksWritten[this.block] = 1;
+      }
+      this.blockLength = 0;
+    }
+
+    this.sendReady();
+    return true;
+  }
+
+  // Mirrors the bootloader's bl_state_t state machine
+  private handlePacket(packet: Packet) {
+    switch (this.state) {
+      case 'update_req': {
+        if (packet.length === BL_BEGIN_SESSION_LENGTH && packet.data[0] === BL_PACKET_BEGIN_SESSION_DATA0) {
+          const fwLength = packet.data.readUInt32LE(2);
+          const options = packet.data[10];
+          const layoutConflict = (options & BL_FW_UPDATE_OPTION_SPARSE) && (options & BL_FW_UPDATE_OPTION_BLOCKS);
+          if (packet.data[1] !== DEVICE_ID || !this.lengthAcceptable(fwLength) || layoutConflict) {
+            this.abort();
+            return;
+          }
+          this.sendSessionResponse();
+          this.switchFraming(options);
+          this.sparse = (options & BL_FW_UPDATE_OPTION_SPARSE) !== 0;
+          this.blocks = (options & BL_FW_UPDATE_OPTION_BLOCKS) !== 0;
+          this.statsRequested = (options & BL_FW_UPDATE_OPTION_STATS) !== 0;
+          this.sequenced = (options & BL_FW_UPDATE_OPTION_SEQUENCE) !== 0;
+          this.lastSequence = BL_PACKET_SEQUENCE_BIT; // the first is clear
+          this.packetsTaken = 0;
+          this.startErase(fwLength);
+          return;
+        }
+
+        if (packet.length === BL_QUERY_CRC_LENGTH && packet.data[0] === BL_PACKET_QUERY_CRC_DATA0) {
+          if (!this.sendCrc(packet)) {
+            this.abort();
+          }
+          return;
+        }
+        if (packet.isSingleBytePacket(BL_PACKET_QUERY_STATS_DATA0)) {
+          this.sendStats();
+          return;
+        }
+        if (packet.length === BL_QUERY_TRACE_LENGTH && packet.data[0] === BL_PACKET_QUERY_TRACE_DATA0) {
+          if (!this.sendTraceRecord(packet)) {
+            this.abort();
+          }
+          return;
+        }
+        if (packet.isSingleBytePacket(BL_PACKET_END_TRANSFER_DATA0)) {
+          this.finish();
+          return;
+        }
+
+        const options = packet.length === 2 ? packet.data[1] : 0;
+        if (packet.data[0] !== BL_PACKET_FW_UPDATE_REQUEST_DATA0 || packet.length > 2) {
+          this.abort();
+          return;
+        }
+        this.sendSingleByte(BL_PACKET_FW_UPDATE_RESPONSE_DATA0);
+        this.switchFraming(options);
+        this.sendSingleByte(BL_PACKET_DEVICE_ID_REQUEST_DATA0);
+        this.state = 'device_id_resp';
+      } break;
+
+      case 'device_id_resp': {
+        if (packet.length !== 2 || packet.data[0] !== BL_PACKET_DEVICE_ID_RESPONSE_DATA0) {
+          return; // ignored, as by the bootloader
+        }
+        if (packet.data[1] !== DEVICE_ID) {
+          this.abort();
+          return;
+        }
+        this.sendSingleByte(BL_PACKET_FW_LENGTH_REQUEST_DATA0);
+        this.state = 'fw_length_resp';
+      } break;
+
+      case 'fw_length_resp': {
+        const fwLength = packet.data.readUInt32LE(1);
+        if (packet.length !== 5 || packet.data[0] !== BL_PACKET_FW_LENGTH_RESPONSE_DATA0
+          || !this.lengthAcceptable(fwLength)) {
+          this.abort();
+          return;
+        }
+        this.startErase(fwLength);
+      } break;
+
+      case 'receive_fw': {
+        if (this.flashFailed) {
+          this.abort();
+          return;
+        }
+        if (this.deferred.length > 0 || this.mustWait(packet)) {
+          this.deferred.push(packet);
+          return;
+        }
+
+        if (this.sequenced) {
+          const taken = this.takeSequencedPacket(packet);
+          if (taken === null) {
+            this.sendReady(); // resent after a lost ACK, READY may be lost too
+            return;
+          }
+          packet = taken;
+        }
+
+        if (this.blocks) {
+          if (!this.receiveBlockPacket(packet)) {
+            this.abort();
+          }
+          return;
+        }
+
+        // between extents of a sparse transfer, mirroring begin_extent()
+        if (this.sparse && this.extentRemaining === 0) {
+          const offset = packet.data.readUInt32LE(1);
+          const length = packet.data.readUInt32LE(5);
+          if (packet.length !== BL_EXTENT_LENGTH || packet.data[0] !== BL_PACKET_EXTENT_DATA0) {
+            if (this.answerQuery(packet)) {
+              this.sendReady();
+            } else {
+              this.abort();
+            }
+          } else if (length === 0) {
+            this.finish();
+          } else if (offset < this.bytesWritten || offset > this.fwLength || length > this.fwLength - offset) {
+            this.abort();
+          } else {
+            this.bytesWritten = offset;
+            this.extentRemaining = length;
+            this.sendReady();
+          }
+          return;
+        }
+
+        const writable = this.sparse ? this.extentRemaining : this.fwLength - this.bytesWritten;
+        if (packet.length === 0 || packet.length > PACKET_DATA_BYTES || packet.length > writable) {
+          this.abort();
+          return;
+        }
+        if (!this.flashQueue.submitWrite(this.bytesWritten, packet.data.subarray(0, packet.length),
+          failed => this.writeDone(failed))) {
+          this.abort();
+          return;
+        }
+        this.bytesWritten += packet.length;
+        if (this.sparse) {
+          this.extentRemaining -= packet.length;
+        }
+        if (!this.sparse && this.bytesWritten >= this.fwLength) {
+          this.finish();
+        } else {
+          this.sendReady();
+        }
+      } break;
+
+      default:
+        break; // packets while erasing or after finishing are dropped
+    }
+  }
+}
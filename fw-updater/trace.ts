@@ -0,0 +1,160 @@
+// Decoder for the bootloader's event trace (core/trace.h), rendering a timeline
+// and how long the device took over each kind of operation
+import { Logger } from './session';
+import {
+  PACKET_ACK_DATA0, PACKET_RETX_DATA0, BL_PACKET_SYNC_OBSERVED_DATA0,
+  BL_PACKET_FW_UPDATE_REQUEST_DATA0, BL_PACKET_FW_UPDATE_RESPONSE_DATA0,
+  BL_PACKET_DEVICE_ID_REQUEST_DATA0, BL_PACKET_FW_LENGTH_REQUEST_DATA0,
+  BL_PACKET_READY_FOR_DATA_DATA0, BL_PACKET_UPDATE_SUCCESS_DATA0, BL_PACKET_NACK_DATA0,
+  BL_PACKET_END_TRANSFER_DATA0, BL_PACKET_QUERY_STATS_DATA0,
+} from './protocol';
+
+// trace_event_t
+export const TRACE_EVENT_BOOT                = 1;
+export const TRACE_EVENT_STATE               = 2;
+export const TRACE_EVENT_PACKET_RX           = 3;
+export const TRACE_EVENT_PACKET_TX           = 4;
+export const TRACE_EVENT_PACKET_BAD          = 5;
+export const TRACE_EVENT_UART_OVERRUN        = 6;
+export const TRACE_EVENT_FLASH_ERASE_START   = 7;
+export const TRACE_EVENT_FLASH_ERASE_END     = 8;
+export const TRACE_EVENT_FLASH_PROGRAM_START = 9;
+export const TRACE_EVENT_FLASH_PROGRAM_END   = 10;
+export const TRACE_EVENT_VALIDATE_START      = 11;
+export const TRACE_EVENT_VALIDATE_END        = 12;
+
+export type TraceRecord = { timestamp: number; event: number; arg0: number; arg1: number };
+
+const EVENT_NAMES: Record<number, string> = {
+  [TRACE_EVENT_BOOT]: 'boot', [TRACE_EVENT_STATE]: 'state', [TRACE_EVENT_PACKET_RX]: 'rx',
+  [TRACE_EVENT_PACKET_TX]: 'tx', [TRACE_EVENT_PACKET_BAD]: 'bad packet', [TRACE_EVENT_UART_OVERRUN]: 'overrun',
+  [TRACE_EVENT_FLASH_ERASE_START]: 'erase start', [TRACE_EVENT_FLASH_ERASE_END]: 'erase end',
+  [TRACE_EVENT_FLASH_PROGRAM_START]: 'program start', [TRACE_EVENT_FLASH_PROGRAM_END]: 'program end',
+  [TRACE_EVENT_VALIDATE_START]: 'validate start', [TRACE_EVENT_VALIDATE_END]: 'validate end',
+};
+
+// bl_state_t, in order
+const STATE_NAMES = [
+  'SYNC', 'UPDATE_REQ', 'DEVICE_ID_REQ', 'DEVICE_ID_RESP', 'FW_LENGTH_REQ',
+  'FW_LENGTH_RESP', 'APPLICATION_ERASE', 'RECEIVE_FW', 'DONE',
+];
+
+const BAD_REASONS = ['', 'crc', 'framing', 'ring full'];
+
+// Single byte packets, the only ones recognisable from their first byte
+const PACKET_NAMES: Record<number, string> = {
+  [PACKET_ACK_DATA0]: 'ACK', [PACKET_RETX_DATA0]: 'RETX', [BL_PACKET_SYNC_OBSERVED_DATA0]: 'SYNC_OBSERVED',
+  [BL_PACKET_FW_UPDATE_REQUEST_DATA0]: 'FW_UPDATE_REQUEST', [BL_PACKET_FW_UPDATE_RESPONSE_DATA0]: 'FW_UPDATE_RESPONSE',
+  [BL_PACKET_DEVICE_ID_REQUEST_DATA0]: 'DEVICE_ID_REQUEST', [BL_PACKET_FW_LENGTH_REQUEST_DATA0]: 'FW_LENGTH_REQUEST',
+  [BL_PACKET_READY_FOR_DATA_DATA0]: 'READY_FOR_DATA', [BL_PACKET_UPDATE_SUCCESS_DATA0]: 'UPDATE_SUCCESS',
+  [BL_PACKET_NACK_DATA0]: 'NACK', [BL_PACKET_END_TRANSFER_DATA0]: 'END_TRANSFER',
+  [BL_PACKET_QUERY_STATS_DATA0]: 'QUERY_STATS',
+};
+
+const describe = (record: TraceRecord) => {
+  const name = EVENT_NAMES[record.event] ?? `event ${record.event}`;
+
+  switch (record.event) {
+    case TRACE_EVENT_BOOT:
+      return `${name}${record.arg0 ? ', trace kept across reset' : ''}`;
+    case TRACE_EVENT_STATE:
+      return `${name} ${STATE_NAMES[record.arg0] ?? record.arg0}`;
+    case TRACE_EVENT_PACKET_RX:
+    case TRACE_EVENT_PACKET_TX: {
+      // only the first byte is recorded, which for data packets is image data
+      const tag = `0x${record.arg0.toString(16).padStart(2, '0')}`;
+      const packet = record.arg1 === 1 && record.arg0 in PACKET_NAMES ? PACKET_NAMES[record.arg0] : tag;
+      return `${name} ${packet} (${record.arg1} bytes)`;
+    }
+    case TRACE_EVENT_PACKET_BAD:
+      return `${name}: ${BAD_REASONS[record.arg0] ?? record.arg0}`;
+    case TRACE_EVENT_FLASH_ERASE_START:
+    case TRACE_EVENT_FLASH_ERASE_END:
+      return `${name} sector ${record.arg0}`;
+    case TRACE_EVENT_FLASH_PROGRAM_START:
+    case TRACE_EVENT_FLASH_PROGRAM_END:
+      return `${name} ${record.arg1} bytes`;
+    case TRACE_EVENT_VALIDATE_END:
+      return `${name}, image ${record.arg0 ? 'valid' : 'invalid'}`;
+    default:
+      return name;
+  }
+};
+
+// The event ending each timed operation, by the event starting it
+const OPERATION_ENDS: Record<number, number> = {
+  [TRACE_EVENT_FLASH_ERASE_START]: TRACE_EVENT_FLASH_ERASE_END,
+  [TRACE_EVENT_FLASH_PROGRAM_START]: TRACE_EVENT_FLASH_PROGRAM_END,
+  [TRACE_EVENT_VALIDATE_START]: TRACE_EVENT_VALIDATE_END,
+};
+
+type Latency = { count: number; total: number; min: number; max: number };
+
+const addLatency = (latencies: Map<string, Latency>, name: string, us: number) => {
+  const latency = latencies.get(name) ?? { count: 0, total: 0, min: Infinity, max: 0 };
+  latency.count++;
+  latency.total += us;
+  latency.min = Math.min(latency.min, us);
+  latency.max = Math.max(latency.max, us);
+  latencies.set(name, latency);
+};
+
+// Log the records, oldest first, as a timeline from each boot, followed by
+// how long the device took from each packet received to its reply, over each
+// flash operation and image validation, and in each state
+export const renderTrace = (name: string, records: TraceRecord[], cpuMHz: number) => {
+  const latencies = new Map<string, Latency>();
+  const toUs = (from: number, to: number) => ((to - from) >>> 0) / cpuMHz; // the counter wraps
+
+  let start = records.length > 0 ? records[0].timestamp : 0;
+  let previous: TraceRecord | null = null;
+  let lastRx: TraceRecord | null = null;
+  let lastStart: TraceRecord | null = null;
+  let lastState: TraceRecord | null = null;
+
+  Logger.info(`${name}: ${records.length} trace records, ${cpuMHz} MHz core clock`);
+  for (const record of records) {
+    // the cycle counter restarts with every boot, so nothing spans one
+    if (record.event === TRACE_EVENT_BOOT) {
+      start = record.timestamp;
+      previous = lastRx = lastStart = lastState = null;
+    }
+
+    const at = toUs(start, record.timestamp);
+    const delta = previous === null ? 0 : toUs(previous.timestamp, record.timestamp);
+    console.log(`  ${at.toFixed(1).padStart(12)} us ${('+' + delta.toFixed(1)).padStart(11)}  ${describe(record)}`);
+
+    if (record.event === TRACE_EVENT_PACKET_RX) {
+      lastRx = record;
+    } else if (record.event === TRACE_EVENT_PACKET_TX && lastRx !== null) {
+      addLatency(latencies, 'packet received to reply', toUs(lastRx.timestamp, record.timestamp));
+      lastRx = null;
+    } else if (record.event in OPERATION_ENDS) {
+      lastStart = record;
+    } else if (lastStart !== null && OPERATION_ENDS[lastStart.event] === record.event) {
+      const operation = record.event === TRACE_EVENT_FLASH_ERASE_END ? `erase sector ${record.arg0}`
+        : record.event === TRACE_EVENT_FLASH_PROGRAM_END ? 'program' : 'validate image';
+      addLatency(latencies, operation, toUs(lastStart.timestamp, record.timestamp));
+      lastStart = null;
+    } else if (record.event === TRACE_EVENT_STATE) {
+      if (lastState !== null) {
+        addLatency(latencies, `in ${STATE_NAMES[lastState.arg0] ?? lastState.arg0}`,
+          toUs(lastState.timestamp, record.timestamp));
+      }
+      lastState = record;
+    }
+
+    previous = record;
+  }
+
+  if (latencies.size === 0) {
+    return;
+  }
+  Logger.info(`${name}: ${'latency'.padEnd(26)} ${'count'.padStart(6)} ${'min us'.padStart(10)} `
+    + `${'mean us'.padStart(10)} ${'max us'.padStart(10)}`);
+  for (const [operation, latency] of latencies) {
+    Logger.info(`${name}: ${operation.padEnd(26)} ${String(latency.count).padStart(6)} `
+      + `${latency.min.toFixed(1).padStart(10)} ${(latency.total / latency.count).toFixed(1).padStart(10)} `
+      + `${latency.max.toFixed(1).padStart(10)}`);
+  }
+};
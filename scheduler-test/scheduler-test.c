@@ -0,0 +1,250 @@
+/*******************************************************************************
+ * @file   scheduler-test.c
+ * @author Camille Alexandra
+ *
+ * @brief  Host test of the task and timer schedulers. The firmware's clock is
+ *         replaced by a simulated one, which sleeping advances straight to the
+ *         next deadline or simulated interrupt, so a run is exactly repeatable.
+ *         Checks the order tasks run in and times the cost of dispatching them.
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <time.h>
+
+#include "common.h"
+#include "core/system.h"
+#include "core/task-scheduler.h"
+#include "core/timer-scheduler.h"
+
+#define RUN_US       (1000000U) // simulated time the ordering test runs for
+#define LOG_LENGTH   (1024U)
+#define BENCH_PASSES (1000000U)
+
+typedef struct test_task_t {
+    task_t task;
+    uint8_t id;          // position in the order tasks are added
+    uint64_t period_ms;  // 0 for a task only woken by task_signal()
+} test_task_t;
+
+typedef struct run_record_t {
+    uint64_t time;
+    uint8_t id;
+    uint32_t events;
+} run_record_t;
+
+#define EVENT_RX (0x1U) // raised by the simulated interrupt
+
+// several share deadlines, so that ties have to be broken by the scheduler
+static test_task_t test_tasks[] = {
+    { .id = 0, .period_ms = 10 },
+    { .id = 1, .period_ms = 10 },
+    { .id = 2, .period_ms = 10 },
+    { .id = 3, .period_ms = 20 },
+    { .id = 4, .period_ms = 5 },
+    { .id = 5, .period_ms = 0 },
+};
+#define TEST_TASKS     (sizeof(test_tasks) / sizeof(test_tasks[0]))
+#define SIGNALLED_TASK (5U)
+
+// when the simulated interrupt signals SIGNALLED_TASK, the last on a deadline
+static const uint64_t interrupt_times[] = { 7000U, 15000U, 20000U, 500000U };
+#define INTERRUPTS (sizeof(interrupt_times) / sizeof(interrupt_times[0]))
+
+static uint64_t now = 0;
+static uint32_t next_interrupt = 0;
+
+static run_record_t run_log[LOG_LENGTH];
+static uint32_t run_log_length = 0;
+static bool logging = true;
+
+/*******************************************************************************
+ * @brief The simulated clock, standing in for the firmware's TIM5 time base
+ ******************************************************************************/
+uint64_t system_get_micros(void) {
+    return now;
+}
+
+/*******************************************************************************
+ * @brief Sleeps by moving the simulated clock to the deadline, or to the next
+ *        simulated interrupt if that comes first, which then signals its task
+ ******************************************************************************/
+void system_sleep_until(uint64_t deadline, bool (*work_pending)(void)) {
+    if (work_pending && work_pending()) {
+        return;
+    }
+
+    if (next_interrupt < INTERRUPTS && interrupt_times[next_interrupt] <= deadline) {
+        now = interrupt_times[next_interrupt++];
+        task_signal(&test_tasks[SIGNALLED_TASK].task, EVENT_RX);
+        return;
+    }
+
+    if (deadline > now) {
+        now = deadline;
+    }
+}
+
+/*******************************************************************************
+ * @brief Task function recording when each task ran, and with what events
+ ******************************************************************************/
+static void record_run(uint32_t events, void* context) {
+    const test_task_t* test_task = context;
+
+    if (logging && run_log_length < LOG_LENGTH) {
+        run_log[run_log_length++] = (run_record_t){ now, test_task->id, events };
+    }
+}
+
+/*******************************************************************************
+ * @brief Returns the events a task should run with at a given time, 0 if it
+ *        should not run then
+ ******************************************************************************/
+static uint32_t expected_events(const test_task_t* test_task, uint64_t time) {
+    uint32_t events = 0;
+
+    if (test_task->period_ms > 0 && time % (test_task->period_ms * 1000U) == 0) {
+        events |= TASK_EVENT_WAKE;
+    }
+    for (uint32_t i = 0; i < INTERRUPTS; ++i) {
+        if (test_task->id == SIGNALLED_TASK && interrupt_times[i] == time) {
+            events |= EVENT_RX;
+        }
+    }
+
+    return events;
+}
+
+/*******************************************************************************
+ * @brief Runs the scheduler on the simulated clock and checks every task ran
+ *        when due, and that tasks due together ran in the order they were added
+ ******************************************************************************/
+static bool test_ordering(void) {
+    for (uint32_t i = 0; i < TEST_TASKS; ++i) {
+        task_scheduler_add(&test_tasks[i].task, record_run, &test_tasks[i],
+            test_tasks[i].period_ms);
+    }
+
+    while (now < RUN_US) {
+        task_scheduler_run_once();
+        timer_scheduler_sleep(task_scheduler_work_pending);
+    }
+
+    // every instant anything is due is a multiple of 1ms
+    uint32_t index = 0;
+    bool matches = true;
+    for (uint64_t time = 1000U; time < RUN_US && matches; time += 1000U) {
+        for (uint32_t i = 0; i < TEST_TASKS && matches; ++i) {
+            uint32_t events = expected_events(&test_tasks[i], time);
+            if (events == 0) {
+                continue;
+            }
+
+            const run_record_t* record = &run_log[index++];
+            matches = index <= run_log_length && record->time == time
+                && record->id == test_tasks[i].id && record->events == events;
+            if (!matches) {
+                printf("At %llu us expected task %u with events %08x, got task %u at %llu us with %08x\n",
+                    (unsigned long long)time, test_tasks[i].id, events, record->id,
+                    (unsigned long long)record->time, record->events);
+            }
+        }
+    }
+
+    matches = matches && index == run_log_length; // and nothing ran besides
+
+    printf("%u task runs over %u simulated ms in deadline, then added, order: %s\n",
+        run_log_length, RUN_US / 1000U, matches ? "ok" : "FAILED");
+    return matches;
+}
+
+/*******************************************************************************
+ * @brief Counts the runs of a timer's callback
+ ******************************************************************************/
+static void count_fired(void* context) {
+    (*(uint32_t*)context)++;
+}
+
+/*******************************************************************************
+ * @brief Checks that a periodic timer which fell several periods behind fires
+ *        once and stays in phase, and that one with no period is refused
+ ******************************************************************************/
+static bool test_catch_up(void) {
+    simple_timer_t timer;
+    uint32_t fired = 0;
+
+    simple_timer_setup_us(&timer, 0U, true);
+    bool zero_refused = !timer_scheduler_add(&timer, count_fired, &fired);
+
+    simple_timer_setup(&timer, 10U, true);
+    uint64_t start = timer.target_time - timer.wait_time;
+    timer_scheduler_add(&timer, count_fired, &fired);
+
+    now = start + 35000U; // 3 periods late, as across a flash erase
+    timer_scheduler_dispatch();
+    bool once = fired == 1U && timer.target_time == start + 40000U;
+
+    timer_scheduler_remove(&timer);
+
+    bool passed = zero_refused && once;
+    printf("Zero period timer refused: %s, 3.5 periods late fired %u times, next in %llu us: %s\n",
+        zero_refused ? "yes" : "no", fired,
+        (unsigned long long)(timer.target_time - now), passed ? "ok" : "FAILED");
+    return passed;
+}
+
+/*******************************************************************************
+ * @brief Returns a monotonic wall clock time in nanoseconds
+ ******************************************************************************/
+static uint64_t wall_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000U + (uint64_t)time.tv_nsec;
+}
+
+/*******************************************************************************
+ * @brief Times scheduler passes which run every task, woken either by events
+ *        raised as an interrupt would, or by their timers all falling due
+ ******************************************************************************/
+static void bench_dispatch(void) {
+    logging = false;
+
+    uint64_t start = wall_ns();
+    for (uint32_t pass = 0; pass < BENCH_PASSES; ++pass) {
+        for (uint32_t i = 0; i < TEST_TASKS; ++i) {
+            task_signal(&test_tasks[i].task, EVENT_RX);
+        }
+        task_scheduler_run_once();
+    }
+    double signalled_ns = (double)(wall_ns() - start) / BENCH_PASSES;
+
+    // a step of the longest period makes every timer fire on every pass
+    uint32_t timers = 0;
+    for (uint32_t i = 0; i < TEST_TASKS; ++i) {
+        timers += test_tasks[i].period_ms > 0;
+    }
+    start = wall_ns();
+    for (uint32_t pass = 0; pass < BENCH_PASSES; ++pass) {
+        now += 20000U;
+        task_scheduler_run_once();
+    }
+    double timed_ns = (double)(wall_ns() - start) / BENCH_PASSES;
+
+    start = wall_ns();
+    for (uint32_t pass = 0; pass < BENCH_PASSES; ++pass) {
+        task_scheduler_run_once();
+    }
+    double idle_ns = (double)(wall_ns() - start) / BENCH_PASSES;
+
+    printf("Signalled dispatch %.1f ns per task (%u tasks a pass)\n",
+        signalled_ns / TEST_TASKS, (unsigned)TEST_TASKS);
+    printf("Timer dispatch %.1f ns per timer fired and task run (%u timers a pass)\n",
+        timed_ns / timers, timers);
+    printf("Idle pass %.1f ns\n", idle_ns);
+}
+
+int main(void) {
+    bool passed = test_ordering();
+    passed = test_catch_up() && passed;
+    bench_dispatch();
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdint.h>
+
+// host stand-in: nothing interrupts the scheduler, so masking is a no-op
+static inline uint32_t cm_mask_interrupts(uint32_t mask) {
+    (void)mask;
+    return 0;
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+// host stand-in, included by core/system.h for declarations not used here
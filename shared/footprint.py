@@ -0,0 +1,50 @@
+# Prints the flash and RAM footprint of each symbol in an image, largest first,
+# with totals, for `make report`. Flash holds code, constants and the initial
+# values of initialized data; RAM holds initialized and zeroed data.
+#
+# usage: footprint.py <nm> <image.elf> [profile description]
+
+import subprocess
+import sys
+
+TOP_SYMBOLS = 40 # symbols listed, the totals cover all of them
+
+# nm symbol types, lower case for local symbols
+FLASH_TYPES = "tTrRwWvV"
+DATA_TYPES = "dD" # in flash and, once copied, in RAM
+RAM_TYPES = "bBcC"
+
+
+def footprint(nm, elf):
+    output = subprocess.run([nm, "--print-size", "--size-sort", "--radix=d", elf],
+                            check=True, capture_output=True, text=True).stdout
+    symbols = []
+    for line in output.splitlines():
+        fields = line.split()
+        if len(fields) < 4:
+            continue # no size, such as linker script symbols
+        size, kind, name = int(fields[1]), fields[2], fields[3]
+        flash = size if kind in FLASH_TYPES or kind in DATA_TYPES else 0
+        ram = size if kind in DATA_TYPES or kind in RAM_TYPES else 0
+        symbols.append((name, flash, ram))
+    return sorted(symbols, key=lambda symbol: symbol[1] + symbol[2], reverse=True)
+
+
+def main():
+    if len(sys.argv) < 3:
+        sys.exit(f"usage: {sys.argv[0]} <nm> <image.elf> [profile description]")
+    nm, elf = sys.argv[1], sys.argv[2]
+    symbols = footprint(nm, elf)
+
+    if len(sys.argv) > 3:
+        print(f"{elf}, profile {sys.argv[3]}")
+    print(f"{'flash':>8} {'ram':>8}  symbol")
+    for name, flash, ram in symbols[:TOP_SYMBOLS]:
+        print(f"{flash:8d} {ram:8d}  {name}")
+    if len(symbols) > TOP_SYMBOLS:
+        print(f"{'':>8} {'':>8}  ... {len(symbols) - TOP_SYMBOLS} smaller symbols")
+
+    print(f"{sum(s[1] for s in symbols):8d} {sum(s[2] for s in symbols):8d}  total in {len(symbols)} symbols")
+
+
+main()
@@ -0,0 +1,114 @@
+# Generates the constant lookup tables shared by the bootloader, application
+# and signer, written to stdout as C source: the CRC-8 and CRC-32 byte tables,
+# the AES encryption T-table and the round keys of the signing key, so that
+# they sit in flash rather than being computed at startup. Declared in
+# inc/core/tables.h, checked against aes.c and crc.c by `fw-signer/signer
+# selftest`.
+
+CRC8_POLY = 0x07 # must match crc8() in src/core/crc.c
+CRC32_POLY = 0xEDB88320 # reflected, must match crc32() in src/core/crc.c
+
+# TODO: implement a proper secret key for AES encryption
+SECRET_KEY = bytes(range(16))
+
+NUM_ROUND_KEYS_128 = 11 # must match inc/core/aes.h
+
+
+def crc8_table():
+    table = []
+    for byte in range(256):
+        crc = byte
+        for _ in range(8):
+            crc = ((crc << 1) ^ CRC8_POLY) if crc & 0x80 else (crc << 1)
+        table.append(crc & 0xFF)
+    return table
+
+
+def crc32_table():
+    table = []
+    for byte in range(256):
+        crc = byte
+        for _ in range(8):
+            crc = (crc >> 1) ^ (CRC32_POLY if crc & 1 else 0)
+        table.append(crc)
+    return table
+
+
+def gf_mult(a, b):
+    product = 0
+    while b:
+        if b & 1:
+            product ^= a
+        a = ((a << 1) ^ 0x11B) if a & 0x80 else (a << 1)
+        b >>= 1
+    return product
+
+
+def sbox():
+    # multiplicative inverse in GF(2^8) followed by the affine transform, built
+    # from first principles so that the check against aes.c means something
+    table = []
+    for byte in range(256):
+        inverse = next((x for x in range(1, 256) if gf_mult(byte, x) == 1), 0)
+        value = 0x63
+        for shift in range(5):
+            value ^= ((inverse << shift) | (inverse >> (8 - shift))) & 0xFF
+        table.append(value)
+    return table
+
+
+def aes_te0(sbox_table):
+    # one column of SubBytes then MixColumns for the byte in row 0, rows packed
+    # from the least significant byte up; rows 1 to 3 are rotations of it
+    table = []
+    for s in sbox_table:
+        table.append(gf_mult(s, 2) | (s << 8) | (s << 16) | (gf_mult(s, 3) << 24))
+    return table
+
+
+def key_schedule(key, sbox_table):
+    words = [list(key[i:i + 4]) for i in range(0, 16, 4)]
+    rcon = 1
+    while len(words) < 4 * NUM_ROUND_KEYS_128:
+        word = list(words[-1])
+        if len(words) % 4 == 0:
+            word = [sbox_table[b] for b in word[1:] + word[:1]]
+            word[0] ^= rcon
+            rcon = gf_mult(rcon, 2)
+        words.append([a ^ b for a, b in zip(word, words[-4])])
+    return [words[i:i + 4] for i in range(0, len(words), 4)]
+
+
+def emit_table(type_name, name, values, per_row, digits):
+    print(f"const {type_name} {name}[{len(values)}] = {{")
+    for i in range(0, len(values), per_row):
+        row = ", ".join(f"0x{value:0{digits}X}" for value in values[i:i + per_row])
+        print(f"    {row},")
+    print("};")
+    print()
+
+
+def emit_key_schedule(name, round_keys):
+    print(f"const AES_Block_t {name}[NUM_ROUND_KEYS_128] = {{")
+    for round_key in round_keys:
+        columns = ", ".join("{ " + ", ".join(f"0x{b:02X}" for b in column) + " }"
+                            for column in round_key)
+        print(f"    {{ {columns} }},")
+    print("};")
+    print()
+
+
+SBOX = sbox()
+
+print("// generated by gen-tables.py, do not edit")
+print()
+print('#include "core/tables.h"')
+print()
+print(f"#if NUM_ROUND_KEYS_128 != {NUM_ROUND_KEYS_128}")
+print("#error \"gen-tables.py is out of step with NUM_ROUND_KEYS_128\"")
+print("#endif")
+print()
+emit_table("uint8_t", "crc8_table", crc8_table(), 16, 2)
+emit_table("uint32_t", "crc32_table", crc32_table(), 6, 8)
+emit_table("uint32_t", "aes_te0", aes_te0(SBOX), 6, 8)
+emit_key_schedule("firmware_key_schedule", key_schedule(SECRET_KEY, SBOX))
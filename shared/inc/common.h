@@ -1,4 +1,5 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
\ No newline at end of file
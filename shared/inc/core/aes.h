@@ -9,6 +9,9 @@ typedef uint8_t AES_Column_t[4];
 typedef AES_Column_t AES_Block_t[4];
 typedef uint8_t AES_Key128_t[16];
 
+extern const uint8_t sbox_encrypt[];
+extern const uint8_t sbox_decrypt[];
+
 uint8_t GF_Mult(uint8_t a, uint8_t b);
 void GF_WordAdd(AES_Column_t a, AES_Column_t b, AES_Column_t dest);
 void GF_ModularProduct(AES_Column_t a, AES_Column_t b, AES_Column_t dest);
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "common.h"
+#include "core/aes.h"
+
+// AES-128-CMAC (RFC 4493), fed a message in pieces of any length
+typedef struct aes_cmac_t {
+    AES_Block_t round_keys[NUM_ROUND_KEYS_128];
+    AES_Block_t state;
+    uint8_t block[AES_BLOCK_SIZE]; // the last bytes seen, held back for final
+    uint8_t block_length;
+} aes_cmac_t;
+
+void aes_cmac_setup(aes_cmac_t* cmac, const AES_Key128_t key);
+void aes_cmac_setup_scheduled(aes_cmac_t* cmac, const AES_Block_t round_keys[NUM_ROUND_KEYS_128]);
+void aes_cmac_update(aes_cmac_t* cmac, const uint8_t* data, uint32_t length);
+void aes_cmac_final(aes_cmac_t* cmac, uint8_t mac[AES_BLOCK_SIZE]);
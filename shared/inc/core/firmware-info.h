@@ -1,8 +1,15 @@
 #pragma once
 
+#include "common.h"
+#include "core/aes.h"
+
+// the signer builds this on the host, where there is no libopencm3
+#ifndef FIRMWARE_INFO_HOST
 #include <libopencm3/stm32/flash.h>
 #include <libopencm3/cm3/vector.h>
-#include "common.h"
+#else
+#define FLASH_BASE             (0x08000000U)
+#endif
 
 #define ALIGNED(address, alignment) (((address) - 1U + (alignment)) & ~((alignment) - 1U))
 
@@ -14,11 +21,16 @@
 #define MAX_FW_LENGTH          ((1024U * 512U) - BOOTLOADER_SIZE) // 512KB
 #define DEVICE_ID (0xA3) // arbitrary device id to identify for fw updates
 
-
 #define FWINFO_SENTINEL        (0xDEADC0DE)
-#define FWINFO_ADDRESS         (ALIGNED(MAIN_APP_START_ADDRESS + sizeof(vector_table_t), 16))
+// offsets from the start of the application image, the info block follows the
+// vector table at the next 16 byte boundary (checked in firmware-info.c)
+#define FWINFO_OFFSET          (0x1B0U)
+#define SIGNATURE_OFFSET       (FWINFO_OFFSET + sizeof(firmware_info_t))
+#define SIGNATURE_SIZE         (AES_BLOCK_SIZE)
+#define FWINFO_ADDRESS         (MAIN_APP_START_ADDRESS + FWINFO_OFFSET)
 #define FWINFO_BLOCK_SIZE      (sizeof(firmware_info_t))
-#define SIGNATURE_ADDRESS      (FWINFO_ADDRESS + sizeof(firmware_info_t))
+#define SIGNATURE_ADDRESS      (MAIN_APP_START_ADDRESS + SIGNATURE_OFFSET)
+#define MIN_FW_LENGTH          (SIGNATURE_OFFSET + SIGNATURE_SIZE)
 // #define FWINFO_VALIDATE_FROM   (ALIGNED(FWINFO_ADDRESS + sizeof(firmware_info_t), 16))
 // #define FWINFO_VALIDATE_LENGTH(fw_length) (fw_length - (BOOTLOADER_SIZE - FWINFO_VALIDATE_FROM))
 // #define FWINFO_BLOCK_SIZE (16 * 2) // size of the firmware info block
@@ -34,4 +46,6 @@ typedef struct firmware_info_t {
     // uint32_t reserved[4]; 
 } firmware_info_t;
 
-bool validate_firmware_image(void);
\ No newline at end of file
+void firmware_image_signature(const uint8_t* image, uint32_t length, uint8_t signature[SIGNATURE_SIZE]);
+bool firmware_image_is_valid(const uint8_t* image, uint32_t max_length);
+bool validate_firmware_image(void);
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "common.h"
+
+// "enter bootloader" command sent to the application over UART, followed by
+// baud rate, firmware length and session token (uint32_t LE) and a crc8
+#define HANDOFF_COMMAND_SEQUENCE_0 (0xB0)
+#define HANDOFF_COMMAND_SEQUENCE_1 (0x07)
+#define HANDOFF_COMMAND_SEQUENCE_2 (0x1D)
+#define HANDOFF_COMMAND_SEQUENCE_3 (0xE5)
+#define HANDOFF_COMMAND_SEQUENCE_LENGTH (4)
+#define HANDOFF_COMMAND_PARAMS_LENGTH   (12)
+
+#define HANDOFF_UPDATE_REQUEST_MAGIC (0x55504454U) // "UPDT"
+
+// baud rates an update may be requested at, as HANDOFF_BAUD_RATES in
+// fw-updater/protocol.ts. Anything else keeps the default rate
+#define HANDOFF_BAUD_RATES { 9600U, 19200U, 38400U, 57600U, 115200U, 230400U, 460800U, 921600U }
+
+// written by the application into .noinit before a reset, consumed by the
+// bootloader on the following boot
+typedef struct handoff_update_request_t {
+    uint32_t magic;         // HANDOFF_UPDATE_REQUEST_MAGIC when valid
+    uint32_t baud_rate;     // baud rate the bootloader should talk at
+    uint32_t fw_length;     // expected length of the incoming image, 0 if any
+    uint32_t session_token; // echoed back to the host to identify the session
+    uint32_t check;         // inverted xor of the above, guards stale RAM
+} handoff_update_request_t;
+
+#define HANDOFF_BOOT_INFO_MAGIC (0x424F4F54U) // "BOOT"
+
+// peripherals the bootloader leaves configured when jumping to the application
+#define HANDOFF_FLAG_CLOCKS_CONFIGURED    (0x1U << 0) // PLL, flash wait states
+#define HANDOFF_FLAG_UART_GPIO_CONFIGURED (0x1U << 1) // UART pins in AF mode
+
+// written by the bootloader into .noinit right before jumping to the
+// application, describing the state the application starts in
+typedef struct handoff_boot_info_t {
+    uint32_t magic;       // HANDOFF_BOOT_INFO_MAGIC when valid
+    uint32_t flags;       // HANDOFF_FLAG_* bits
+    uint32_t cpu_freq;    // core clock frequency left configured, in Hz
+    uint32_t jump_cycles; // DWT cycle count when the bootloader jumped
+    uint32_t check;       // inverted xor of the above, guards stale RAM
+} handoff_boot_info_t;
+
+bool handoff_baud_rate_supported(uint32_t baud_rate);
+bool handoff_parse_update_command(uint8_t byte);
+void handoff_enter_bootloader(void);
+void handoff_request_update(uint32_t baud_rate, uint32_t fw_length,
+    uint32_t session_token);
+bool handoff_take_update_request(handoff_update_request_t* request);
+
+void handoff_set_boot_info(uint32_t flags, uint32_t cpu_freq,
+    uint32_t jump_cycles);
+bool handoff_take_boot_info(handoff_boot_info_t* info);
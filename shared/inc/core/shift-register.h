@@ -15,8 +15,11 @@
 #define SR1_CLOCK_PIN (GPIO3) // SCK pin for SPI -> SRCLK pin on shift register
 #define SR1_LATCH_PIN (GPIO0) // RCLK pin on shift register
 
+// shift registers daisy chained on SPI1, QH' of one feeding SER of the next
+#define SHIFT_REGISTER_MAX_CHAIN_LENGTH (4)
+
 typedef struct {
-    uint8_t  led_state; // current state of the SR LEDs
+    uint8_t  led_state; // state of the SR LEDs, latched once sent out
     uint16_t num_outputs; // number of utilized outputs in the SR
     uint32_t gpio_port; // GPIO port used for the SR
     uint16_t rclk_pin; // GPIO pin used for latching data into the SR
@@ -24,9 +27,11 @@ typedef struct {
     uint16_t ser_pin; // GPIO pin used for serial data input to the SR
 } ShiftRegister8_t;
 
-void shift_register_setup(const ShiftRegister8_t *sr);
+bool shift_register_setup(const ShiftRegister8_t *sr);
 void shift_register_set_pattern(ShiftRegister8_t *sr, uint8_t pattern);
 void shift_register_set_led(ShiftRegister8_t *sr, uint8_t led, bool state);
 void shift_register_advance(ShiftRegister8_t *sr);
+bool shift_register_busy(void);
+void shift_register_flush(void);
 
 void shift_register_teardown(void);
\ No newline at end of file
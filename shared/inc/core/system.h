@@ -5,11 +5,23 @@
 
 #include "common.h"
 
-#define CPU_FREQ         (84000000) // 84MHz
-#define SYSTICK_FREQ     (1000)
+// chosen at build time, `make CLOCK=turbo` for 180MHz (see shared/profiles.mk)
+#ifdef SYSTEM_CLOCK_TURBO
+#define CLOCK_PROFILE_MHZ (180U)
+#else
+#define CLOCK_PROFILE_MHZ (84U)
+#endif
+
+#define CPU_FREQ         (CLOCK_PROFILE_MHZ * 1000000U)
 
 void system_setup(void);
+void system_setup_preconfigured(void);
 uint64_t system_get_ticks(void);
+uint64_t system_get_micros(void);
+uint32_t system_get_cycles(void);
+uint32_t system_get_apb1_timer_frequency(void);
 
 void system_delay(uint64_t milliseconds);
+void system_delay_us(uint64_t microseconds);
+void system_sleep_until(uint64_t deadline, bool (*work_pending)(void));
 void system_teardown(void);
\ No newline at end of file
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "common.h"
+#include "core/aes.h"
+
+// constant tables generated at build time by shared/gen-tables.py, so they
+// live in flash and cost nothing at startup
+extern const uint8_t crc8_table[256];    // CRC-8, polynomial 0x07
+extern const uint32_t crc32_table[256];  // CRC-32, reflected 0xEDB88320
+extern const uint32_t aes_te0[256];      // SubBytes then MixColumns of row 0, rows 0-3 from the low byte
+extern const AES_Block_t firmware_key_schedule[NUM_ROUND_KEYS_128]; // round keys of the signing key
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "common.h"
+#include "core/simple-timer.h"
+
+#define TASK_SCHEDULER_MAX_TASKS (8)
+
+// event bits are up to each task, except for the top one which is reserved 
+// for the task's periodic wake-up
+#define TASK_EVENT_WAKE (0x1U << 31)
+
+typedef void (*task_function_t)(uint32_t events, void* context);
+
+typedef struct task_t {
+    task_function_t function; // run with the events pending since last run
+    void* context;            // passed to function
+
+    volatile uint32_t events; // pending event bits, set by task_signal()
+    simple_timer_t wake_timer; // raises TASK_EVENT_WAKE, if periodic
+} task_t;
+
+bool task_scheduler_add(task_t* task, task_function_t function, 
+    void* context, uint64_t period_ms);
+void task_signal(task_t* task, uint32_t events);
+bool task_scheduler_work_pending(void);
+void task_scheduler_run_once(void);
+void task_scheduler_run(void);
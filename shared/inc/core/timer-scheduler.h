@@ -0,0 +1,14 @@
+#pragma once
+
+#include "common.h"
+#include "core/simple-timer.h"
+
+#define TIMER_SCHEDULER_MAX_TIMERS (16)
+#define TIMER_SCHEDULER_NO_DEADLINE (UINT64_MAX)
+
+bool timer_scheduler_add(simple_timer_t* timer, 
+    simple_timer_callback_t callback, void* context);
+void timer_scheduler_remove(simple_timer_t* timer);
+void timer_scheduler_dispatch(void);
+uint64_t timer_scheduler_next_deadline(void);
+void timer_scheduler_sleep(bool (*work_pending)(void));
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "common.h"
+
+#define TRACE_LENGTH (128U) // records held, must be a power of 2
+
+// what happened, recorded with two arguments whose meaning depends on it
+typedef enum trace_event_t {
+    TRACE_EVENT_BOOT = 1,            // arg0: 1 if the ring survived a reset
+    TRACE_EVENT_STATE,               // arg0: bootloader state entered
+    TRACE_EVENT_PACKET_RX,           // arg0: data[0], arg1: length, good only
+    TRACE_EVENT_PACKET_TX,           // arg0: data[0], arg1: length
+    TRACE_EVENT_PACKET_BAD,          // arg0: TRACE_BAD_* reason
+    TRACE_EVENT_UART_OVERRUN,
+    TRACE_EVENT_FLASH_ERASE_START,   // arg0: sector
+    TRACE_EVENT_FLASH_ERASE_END,     // arg0: sector
+    TRACE_EVENT_FLASH_PROGRAM_START, // arg1: length
+    TRACE_EVENT_FLASH_PROGRAM_END,   // arg1: length
+    TRACE_EVENT_VALIDATE_START,
+    TRACE_EVENT_VALIDATE_END,        // arg0: 1 if the image is valid
+} trace_event_t;
+
+#define TRACE_BAD_CRC       (1) // checksum mismatch
+#define TRACE_BAD_FRAMING   (2) // COBS frame of the wrong length
+#define TRACE_BAD_RING_FULL (3) // good, but no room in the packet ring
+
+typedef struct trace_record_t {
+    uint32_t timestamp; // core cycle counter
+    uint8_t event;      // trace_event_t
+    uint8_t arg0;
+    uint16_t arg1;
+} trace_record_t;
+
+void trace_setup(void);
+void trace_event(uint8_t event, uint8_t arg0, uint16_t arg1);
+void trace_freeze(void);
+uint32_t trace_count(void);
+bool trace_get(uint32_t index, trace_record_t* record);
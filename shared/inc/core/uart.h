@@ -2,10 +2,22 @@
 
 #include "common.h"
 
+typedef void (*uart_rx_callback_t)(void);
+
+typedef struct uart_stats_t {
+    uint32_t rx_bytes;
+    uint32_t tx_bytes;
+    uint32_t overruns;   // receiver overrun, bytes lost before reaching the ISR
+    uint32_t rx_dropped; // bytes lost to a full ring buffer
+} uart_stats_t;
+
 void uart_setup(void);
 void uart_teardown(void);
+void uart_set_baud_rate(uint32_t baud_rate);
+void uart_set_rx_callback(uart_rx_callback_t callback);
 void uart_send(uint8_t* data, const uint32_t length);
 void uart_send_byte(uint8_t data);
 uint32_t uart_receive(uint8_t* data, const uint32_t length);
 uint8_t uart_receive_byte(void);
-bool uart_data_available(void);
\ No newline at end of file
+bool uart_data_available(void);
+const uart_stats_t* uart_get_stats(void);
\ No newline at end of file
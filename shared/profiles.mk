@@ -0,0 +1,51 @@
+# Build profiles shared by the bootloader and application Makefiles, chosen with
+# `make PROFILE=size|balanced|speed`. Each Makefile lists its hot translation
+# units in HOT_OBJS before including this, and they get HOT_OPT in place of OPT.
+#
+#   size      everything -Os, the default
+#   balanced  -Os, with HOT_OBJS at -O2
+#   speed     -O2, with HOT_OBJS at -O3
+#
+# All three link with LTO (`make LTO=` turns it off). GCC keeps each unit's
+# optimization level on its functions through LTO, and the link itself runs
+# at OPT.
+#
+# `make CLOCK=turbo` runs the core at 180MHz with over-drive and the ART
+# accelerator's prefetch, rather than the standard 84MHz. The application
+# keeps the clock the bootloader set up only when both agree on it, so build
+# both with the same CLOCK to skip bringing the PLL up twice.
+
+PROFILE ?= size
+LTO     ?= -flto
+
+ifeq ($(PROFILE),size)
+OPT      := -Os
+HOT_OPT  := -Os
+else ifeq ($(PROFILE),balanced)
+OPT      := -Os
+HOT_OPT  := -O2
+else ifeq ($(PROFILE),speed)
+OPT      := -O2
+HOT_OPT  := -O3
+else
+$(error PROFILE must be one of size, balanced or speed, not '$(PROFILE)')
+endif
+
+$(HOT_OBJS): OPT := $(HOT_OPT)
+
+CLOCK ?= standard
+
+ifeq ($(CLOCK),turbo)
+DEFS += -DSYSTEM_CLOCK_TURBO
+else ifneq ($(CLOCK),standard)
+$(error CLOCK must be standard or turbo, not '$(CLOCK)')
+endif
+
+# objects and the image depend on the profile, so switching it rebuilds them.
+# Objects under shared/ are built in place for both images, so build the
+# bootloader and application with the same PROFILE and CLOCK
+PROFILE_STAMP := .profile.$(PROFILE).$(CLOCK)$(if $(LTO),.lto)
+
+$(PROFILE_STAMP):
+	$(Q)$(RM) .profile.*
+	$(Q)touch $@
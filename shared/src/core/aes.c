@@ -6,6 +6,7 @@
  ******************************************************************************/
 
 #include "core/aes.h"
+#include "core/tables.h"
 
 // For memcpy
 #include "string.h"
@@ -263,6 +264,31 @@ void AES_AddRoundKey(AES_Block_t state, const AES_Block_t roundKey) {
   }
 }
 
+static uint32_t RotateLeft(uint32_t word, uint32_t bits) {
+  return (word << bits) | (word >> (32 - bits));
+}
+
+// SubBytes, ShiftRows and MixColumns in one pass, looking up each byte's whole
+// contribution to its output column in the generated T-table. Row r of column
+// c comes from column c + r after ShiftRows, and its contribution is the row 0
+// entry rotated by r bytes
+static void AES_TableRound(AES_Block_t state) {
+  AES_Block_t mixed;
+
+  for (size_t col = 0; col < 4; col++) {
+    uint32_t word = aes_te0[state[col][0]]
+      ^ RotateLeft(aes_te0[state[(col + 1) & 3][1]], 8)
+      ^ RotateLeft(aes_te0[state[(col + 2) & 3][2]], 16)
+      ^ RotateLeft(aes_te0[state[(col + 3) & 3][3]], 24);
+
+    for (size_t row = 0; row < 4; row++) {
+      mixed[col][row] = (uint8_t)(word >> (8 * row));
+    }
+  }
+
+  memcpy(state, mixed, sizeof(AES_Block_t));
+}
+
 void AES_EncryptBlock(AES_Block_t state, const AES_Block_t* keySchedule) {
   AES_Block_t* roundKey = (AES_Block_t*)keySchedule;
 
@@ -271,13 +297,13 @@ void AES_EncryptBlock(AES_Block_t state, const AES_Block_t* keySchedule) {
 
   // Note that i starts at 1 since the initial round key is applied already
   for (size_t i = 1; i < NUM_ROUND_KEYS_128; i++) {
-    AES_SubBytes(state, sbox_encrypt);
-    AES_ShiftRows(state);
-
     // No column mix in the last round. Not that this implementation should be considered for
     // production, but this would constitute a timing based side-channel risk
     if (i < NUM_ROUND_KEYS_128 - 1) {
-      AES_MixColumns(state);
+      AES_TableRound(state);
+    } else {
+      AES_SubBytes(state, sbox_encrypt);
+      AES_ShiftRows(state);
     }
 
     AES_AddRoundKey(state, *roundKey++);
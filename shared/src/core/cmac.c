@@ -0,0 +1,121 @@
+/*******************************************************************************
+ * @file   cmac.c
+ * @author Camille Alexandra
+ *
+ * @brief  AES-128-CMAC message authentication (RFC 4493) over the block cipher
+ *         in aes.c, with a streaming interface so flash can be read in place
+ ******************************************************************************/
+
+#include <string.h>
+
+#include "common.h"
+#include "core/cmac.h"
+
+#define CMAC_RB (0x87) // constant for deriving subkeys from a 128 bit block
+
+/*******************************************************************************
+ * @brief Chains one whole block into the MAC state
+ ******************************************************************************/
+static void aes_cmac_absorb(aes_cmac_t* cmac, const uint8_t* block) {
+    uint8_t* state = (uint8_t*)cmac->state;
+
+    for (uint8_t i = 0; i < AES_BLOCK_SIZE; ++i) {
+        state[i] ^= block[i];
+    }
+    AES_EncryptBlock(cmac->state, cmac->round_keys);
+}
+
+/*******************************************************************************
+ * @brief Doubles a block in GF(2^128), which derives K1 from L and K2 from K1
+ ******************************************************************************/
+static void aes_cmac_double(uint8_t block[AES_BLOCK_SIZE]) {
+    uint8_t carry = (block[0] & 0x80) ? CMAC_RB : 0;
+
+    for (uint8_t i = 0; i < AES_BLOCK_SIZE - 1; ++i) {
+        block[i] = (uint8_t)((block[i] << 1) | (block[i + 1] >> 7));
+    }
+    block[AES_BLOCK_SIZE - 1] = (uint8_t)(block[AES_BLOCK_SIZE - 1] << 1) ^ carry;
+}
+
+/*******************************************************************************
+ * @brief Starts a new MAC under the given key
+ ******************************************************************************/
+void aes_cmac_setup(aes_cmac_t* cmac, const AES_Key128_t key) {
+    AES_KeySchedule128(key, cmac->round_keys);
+    memset(cmac->state, 0, AES_BLOCK_SIZE);
+    cmac->block_length = 0;
+}
+
+/*******************************************************************************
+ * @brief Starts a new MAC under a key whose round keys are already expanded,
+ *        such as the generated firmware_key_schedule
+ ******************************************************************************/
+void aes_cmac_setup_scheduled(aes_cmac_t* cmac, const AES_Block_t round_keys[NUM_ROUND_KEYS_128]) {
+    memcpy(cmac->round_keys, round_keys, sizeof(cmac->round_keys));
+    memset(cmac->state, 0, AES_BLOCK_SIZE);
+    cmac->block_length = 0;
+}
+
+/*******************************************************************************
+ * @brief Adds data to the message
+ *
+ * @param cmac MAC in progress
+ * @param data Next bytes of the message
+ * @param length Number of bytes, any amount including zero
+ *
+ * @note  Whole blocks are chained straight from data, only the final block of
+ *        what has been seen so far is copied, as it needs a subkey once the
+ *        message turns out to end there
+ ******************************************************************************/
+void aes_cmac_update(aes_cmac_t* cmac, const uint8_t* data, uint32_t length) {
+    while (length > 0) {
+        if (cmac->block_length == AES_BLOCK_SIZE) { // more follows, so not the last
+            aes_cmac_absorb(cmac, cmac->block);
+            cmac->block_length = 0;
+        }
+
+        if (cmac->block_length == 0) {
+            while (length > AES_BLOCK_SIZE) {
+                aes_cmac_absorb(cmac, data);
+                data += AES_BLOCK_SIZE;
+                length -= AES_BLOCK_SIZE;
+            }
+        }
+
+        uint32_t count = AES_BLOCK_SIZE - cmac->block_length;
+        if (count > length) {
+            count = length;
+        }
+        memcpy(cmac->block + cmac->block_length, data, count);
+        cmac->block_length += count;
+        data += count;
+        length -= count;
+    }
+}
+
+/*******************************************************************************
+ * @brief Finishes the message and produces its MAC
+ *
+ * @param cmac MAC in progress, to be set up again before reuse
+ * @param mac Receives the 16 byte MAC
+ ******************************************************************************/
+void aes_cmac_final(aes_cmac_t* cmac, uint8_t mac[AES_BLOCK_SIZE]) {
+    uint8_t subkey[AES_BLOCK_SIZE] = {0};
+
+    // L is the cipher of the zero block, K1 its double and K2 double that
+    AES_EncryptBlock(*(AES_Block_t*)subkey, cmac->round_keys);
+    aes_cmac_double(subkey);
+
+    if (cmac->block_length < AES_BLOCK_SIZE) { // incomplete or empty, pad it
+        aes_cmac_double(subkey);
+        cmac->block[cmac->block_length] = 0x80;
+        memset(cmac->block + cmac->block_length + 1, 0, AES_BLOCK_SIZE - cmac->block_length - 1);
+    }
+
+    for (uint8_t i = 0; i < AES_BLOCK_SIZE; ++i) {
+        cmac->block[i] ^= subkey[i];
+    }
+    aes_cmac_absorb(cmac, cmac->block);
+
+    memcpy(mac, cmac->state, AES_BLOCK_SIZE);
+}
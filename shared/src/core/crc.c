@@ -7,8 +7,7 @@
  ******************************************************************************/
 
 #include "core/crc.h"
-
-volatile int x = 0;
+#include "core/tables.h"
 
 /*******************************************************************************
  * @brief Calculate the CRC-8 of a data buffer
@@ -21,15 +20,7 @@ uint8_t crc8(uint8_t* data, const uint32_t length) {
     uint8_t crc = 0;
 
     for (uint32_t i = 0; i < length; ++i) {
-        crc ^= data[i];
-        for (uint32_t j = 0; j < 8; ++j) {
-            if (crc & 0x80) {
-                crc = (crc << 1) ^ 0x07;
-            } else {
-                crc <<= 1;
-            }
-        }
-        ++x;
+        crc = crc8_table[crc ^ data[i]];
     }
 
     return crc;
@@ -43,18 +34,10 @@ uint8_t crc8(uint8_t* data, const uint32_t length) {
  * @return The CRC-32 of the data buffer
  ******************************************************************************/
 uint32_t crc32(const uint8_t* data, const uint32_t length) {
-    uint8_t byte;
     uint32_t crc = 0xFFFFFFFF;
-    uint32_t mask;
 
     for (uint32_t i = 0; i < length; ++i) {
-        byte = data[i];
-        crc ^= byte;
-
-        for (uint8_t j = 0; j < 8; ++j) {
-            mask = -(crc & 1);
-            crc = (crc >> 1) ^ (0xEDB88320 & mask);
-        }
+        crc = (crc >> 8) ^ crc32_table[(crc ^ data[i]) & 0xFF];
     }
 
     return ~crc;
@@ -3,97 +3,74 @@
 #include "common.h"
 #include "core/firmware-info.h"
 #include "core/aes.h"
+#include "core/cmac.h"
+#include "core/tables.h"
 
-// TODO: implement a proper secret key for AES encryption
-static const uint8_t secret_key[AES_BLOCK_SIZE] = {
-    0x00, 0x01, 0x02, 0x03,
-    0x04, 0x05, 0x06, 0x07,
-    0x08, 0x09, 0x0A, 0x0B,
-    0x0C, 0x0D, 0x0E, 0x0F,
-};
+#ifndef FIRMWARE_INFO_HOST
+// the signer has no vector_table_t, so it relies on this agreeing
+_Static_assert(ALIGNED(sizeof(vector_table_t), 16U) == FWINFO_OFFSET, "FWINFO_OFFSET is stale");
+#endif
 
-static void aes_cbc_mac_step(AES_Block_t aes_state, AES_Block_t prev_aes_state, const AES_Block_t* key) {
-    // cbc chaining operation
-    for (uint8_t i = 0; i < AES_BLOCK_SIZE; ++i) {
-        ((uint8_t*)aes_state)[i] ^= ((uint8_t*)prev_aes_state)[i];
-    }
+/*******************************************************************************
+ * @brief Computes the signature of an application image, as the signer stores
+ *        it and the bootloader expects it
+ *
+ * @param image Start of the application image, its vector table
+ * @param length Length of the image, at least MIN_FW_LENGTH
+ * @param signature Receives the signature
+ *
+ * @note  The AES-CMAC covers the firmware info block first, then the rest of
+ *        the image in order, skipping the info block and the signature itself
+ ******************************************************************************/
+void firmware_image_signature(const uint8_t* image, uint32_t length, uint8_t signature[SIGNATURE_SIZE]) {
+    aes_cmac_t cmac;
+    aes_cmac_setup_scheduled(&cmac, firmware_key_schedule); // key in gen-tables.py
 
-    AES_EncryptBlock(aes_state, key);
-    memcpy(prev_aes_state, aes_state, AES_BLOCK_SIZE);
+    aes_cmac_update(&cmac, image + FWINFO_OFFSET, FWINFO_BLOCK_SIZE);
+    aes_cmac_update(&cmac, image, FWINFO_OFFSET);
+    aes_cmac_update(&cmac, image + MIN_FW_LENGTH, length - MIN_FW_LENGTH);
+
+    aes_cmac_final(&cmac, signature);
 }
 
 /*******************************************************************************
- * @brief Validate the firmware image by checking the sentinel value and CRC
- * 
- * @return True if the firmware image is valid, False otherwise
+ * @brief Checks an application image: its sentinel, device ID, length and
+ *        signature
+ *
+ * @param image Start of the application image, in flash or in memory
+ * @param max_length Most bytes the image may claim to span
+ *
+ * @return True if the image is valid, False otherwise
  ******************************************************************************/
-bool validate_firmware_image(void) {
-    // point to firmware metadata in provided firmware image
-    firmware_info_t* info = (firmware_info_t*)FWINFO_ADDRESS;
-    const uint8_t* signature = (const uint8_t*)SIGNATURE_ADDRESS;
+bool firmware_image_is_valid(const uint8_t* image, uint32_t max_length) {
+    firmware_info_t info;
+    uint8_t signature[SIGNATURE_SIZE];
+
+    memcpy(&info, image + FWINFO_OFFSET, sizeof(info));
 
     // Check sentinel value
-    if (info->sentinel != FWINFO_SENTINEL) {
+    if (info.sentinel != FWINFO_SENTINEL) {
         return false;
     }
     // Check device ID
-    if (info->device_id != DEVICE_ID) {
+    if (info.device_id != DEVICE_ID) {
         return false;
     }
-
-    /** aes signature validation
-     * - block by block, use aes-cbc (cbc_mac) encr process
-     * - start encrypt the firmware info section
-     * - ignore signature section
-     * - after final block, memcmp the signature with what is stored
-     */
-    AES_Block_t round_keys[NUM_ROUND_KEYS_128];
-    AES_KeySchedule128(secret_key, round_keys);
-
-    AES_Block_t aes_state = {0};
-    AES_Block_t prev_aes_state = {0};
-
-    // generic padding handler to ensure proper AES block size
-    uint8_t bytes_to_pad = 16 - (info->length % AES_BLOCK_SIZE);
-    if (bytes_to_pad == 0) {
-        bytes_to_pad = AES_BLOCK_SIZE;
-    }
-
-    // copy firmware info section manually first
-    uint32_t fwinfo_offset = 0;
-    while (fwinfo_offset < FWINFO_BLOCK_SIZE) {
-        memcpy(aes_state, (void*)(info + fwinfo_offset), AES_BLOCK_SIZE);
-        aes_cbc_mac_step(aes_state, prev_aes_state, round_keys);
-        fwinfo_offset += AES_BLOCK_SIZE;
+    // Check the length before reading that far
+    if (info.length < MIN_FW_LENGTH || info.length > max_length) {
+        return false;
     }
 
-    uint32_t offset = 0;
-    while (offset < info->length) {
-        // skip firmware info and signature block
-        if (offset == (FWINFO_ADDRESS - MAIN_APP_START_ADDRESS)) {
-            offset += AES_BLOCK_SIZE + FWINFO_BLOCK_SIZE;
-            continue;
-        }
-
-        if (info->length - offset > AES_BLOCK_SIZE) { // normal case
-            memcpy(aes_state, (void*)(MAIN_APP_START_ADDRESS + offset), AES_BLOCK_SIZE);
-            aes_cbc_mac_step(aes_state, prev_aes_state, round_keys);
-        } else { // padding case
-            // add whole extra block of passing
-            if (bytes_to_pad == 16) {
-                memcpy(aes_state, (void*)(MAIN_APP_START_ADDRESS + offset), AES_BLOCK_SIZE);
-                aes_cbc_mac_step(aes_state, prev_aes_state, round_keys);
-
-                memset(aes_state, AES_BLOCK_SIZE, AES_BLOCK_SIZE);
-                aes_cbc_mac_step(aes_state, prev_aes_state, round_keys);
-            } else { // add padding in-block
-                memcpy(aes_state, (void*)(MAIN_APP_START_ADDRESS + offset), AES_BLOCK_SIZE - bytes_to_pad);
-                memset((void*)(aes_state) + (AES_BLOCK_SIZE - bytes_to_pad), bytes_to_pad, bytes_to_pad);
-                aes_cbc_mac_step(aes_state, prev_aes_state, round_keys);
-            }
-        }
-        offset += AES_BLOCK_SIZE;
-    }
+    firmware_image_signature(image, info.length, signature);
+    return (memcmp(image + SIGNATURE_OFFSET, signature, SIGNATURE_SIZE) == 0);
+}
 
-    return (memcmp((void*)(signature), (void*)(aes_state), AES_BLOCK_SIZE) == 0);
-}
\ No newline at end of file
+/*******************************************************************************
+ * @brief Validate the firmware image in flash by checking the sentinel value
+ *        and signature
+ * 
+ * @return True if the firmware image is valid, False otherwise
+ ******************************************************************************/
+bool validate_firmware_image(void) {
+    return firmware_image_is_valid((const uint8_t*)MAIN_APP_START_ADDRESS, MAX_FW_LENGTH);
+}
@@ -0,0 +1,239 @@
+/*******************************************************************************
+ * @file   handoff.c
+ * @author Camille Alexandra
+ *
+ * @brief  Records passed between the application and bootloader across a
+ *         reset, through RAM which the startup code leaves untouched (.noinit)
+ ******************************************************************************/
+
+#include <libopencm3/cm3/scb.h> // scb_reset_system
+
+#include "common.h"
+#include "core/handoff.h"
+#include "core/crc.h"
+
+static const uint8_t command_sequence[HANDOFF_COMMAND_SEQUENCE_LENGTH] = {
+    HANDOFF_COMMAND_SEQUENCE_0,
+    HANDOFF_COMMAND_SEQUENCE_1,
+    HANDOFF_COMMAND_SEQUENCE_2,
+    HANDOFF_COMMAND_SEQUENCE_3,
+};
+
+typedef struct handoff_records_t {
+    handoff_update_request_t update_request; // application -> bootloader
+    handoff_boot_info_t boot_info;           // bootloader -> application
+} handoff_records_t;
+
+// placed at a fixed location at the start of ram by both linker scripts, so
+// the application and bootloader agree on where it lives
+__attribute__((section(".noinit.handoff")))
+static handoff_records_t records;
+
+// command parser state, only used on the application side
+static uint8_t command_index = 0;
+static uint8_t command_params[HANDOFF_COMMAND_PARAMS_LENGTH + 1] = {0U};
+static handoff_update_request_t pending_request = {0U};
+
+/*******************************************************************************
+ * @brief Compute the check word guarding a handoff record
+ *
+ * @param words Pointer to the record, viewed as words
+ * @param count Number of words preceding the check word in the record
+ * @return The check word
+ ******************************************************************************/
+static uint32_t handoff_compute_check(const uint32_t* words, uint32_t count) {
+    uint32_t check = 0;
+
+    for (uint32_t i = 0; i < count; ++i) {
+        check ^= words[i];
+    }
+
+    return ~check;
+}
+
+#define UPDATE_REQUEST_CHECK_WORDS \
+    ((sizeof(handoff_update_request_t) / sizeof(uint32_t)) - 1)
+#define BOOT_INFO_CHECK_WORDS \
+    ((sizeof(handoff_boot_info_t) / sizeof(uint32_t)) - 1)
+
+/*******************************************************************************
+ * @brief Read a little-endian uint32_t from a byte buffer
+ ******************************************************************************/
+static uint32_t handoff_read_u32(const uint8_t* data) {
+    return ((uint32_t)data[0])       |
+           ((uint32_t)data[1] << 8)  |
+           ((uint32_t)data[2] << 16) |
+           ((uint32_t)data[3] << 24);
+}
+
+/*******************************************************************************
+ * @brief Check a requested baud rate against HANDOFF_BAUD_RATES
+ *
+ * @param baud_rate The baud rate asked for
+ * @return True if the host can talk at that rate, False for any other value,
+ *         such as one read from a stale or corrupted record
+ ******************************************************************************/
+bool handoff_baud_rate_supported(uint32_t baud_rate) {
+    static const uint32_t supported[] = HANDOFF_BAUD_RATES;
+
+    for (uint32_t i = 0; i < sizeof(supported) / sizeof(supported[0]); ++i) {
+        if (baud_rate == supported[i]) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*******************************************************************************
+ * @brief Feed one received byte to the "enter bootloader" command parser
+ *
+ * @param byte The byte received over UART
+ * @return True once a complete command with a valid CRC and a supported baud
+ *         rate has been received, after which handoff_enter_bootloader() may
+ *         be called
+ *
+ * @note The command is the four byte HANDOFF_COMMAND_SEQUENCE, followed by
+ *       the baud rate, firmware length and session token as little-endian
+ *       uint32_t, then a crc8 of those twelve parameter bytes
+ ******************************************************************************/
+bool handoff_parse_update_command(uint8_t byte) {
+    if (command_index < HANDOFF_COMMAND_SEQUENCE_LENGTH) {
+        if (byte == command_sequence[command_index]) {
+            command_index++;
+        } else {
+            // allow the first sequence byte to restart a broken match
+            command_index = (byte == command_sequence[0]) ? 1 : 0;
+        }
+        return false;
+    }
+
+    command_params[command_index - HANDOFF_COMMAND_SEQUENCE_LENGTH] = byte;
+    command_index++;
+
+    if (command_index < HANDOFF_COMMAND_SEQUENCE_LENGTH
+        + HANDOFF_COMMAND_PARAMS_LENGTH + 1) {
+        return false;
+    }
+
+    command_index = 0;
+    if (crc8(command_params, HANDOFF_COMMAND_PARAMS_LENGTH)
+        != command_params[HANDOFF_COMMAND_PARAMS_LENGTH]) {
+        return false;
+    }
+
+    // refused here rather than handed over, as the host would be left unable
+    // to talk to the bootloader
+    uint32_t baud_rate = handoff_read_u32(&command_params[0]);
+    if (!handoff_baud_rate_supported(baud_rate)) {
+        return false;
+    }
+
+    pending_request.baud_rate     = baud_rate;
+    pending_request.fw_length     = handoff_read_u32(&command_params[4]);
+    pending_request.session_token = handoff_read_u32(&command_params[8]);
+
+    return true;
+}
+
+/*******************************************************************************
+ * @brief Hand over to the bootloader with the last parsed update command
+ ******************************************************************************/
+void handoff_enter_bootloader(void) {
+    handoff_request_update(pending_request.baud_rate,
+        pending_request.fw_length, pending_request.session_token);
+}
+
+/*******************************************************************************
+ * @brief Write an update request for the bootloader and reset the system
+ *
+ * @param baud_rate The baud rate the bootloader should communicate at
+ * @param fw_length The expected firmware image length, or 0 if not known
+ * @param session_token Token the bootloader echoes back to the host
+ *
+ * @note Does not return. The bootloader skips the sync sequence on the next
+ *       boot and starts directly in its handshake state.
+ ******************************************************************************/
+void handoff_request_update(uint32_t baud_rate, uint32_t fw_length,
+    uint32_t session_token) {
+    handoff_update_request_t* request = &records.update_request;
+
+    request->magic         = HANDOFF_UPDATE_REQUEST_MAGIC;
+    request->baud_rate     = baud_rate;
+    request->fw_length     = fw_length;
+    request->session_token = session_token;
+    request->check         = handoff_compute_check((const uint32_t*)request,
+        UPDATE_REQUEST_CHECK_WORDS);
+
+    scb_reset_system();
+}
+
+/*******************************************************************************
+ * @brief Consume a pending update request left by the application, if any
+ *
+ * @param request Pointer to copy the pending request into
+ * @return True if a valid request was pending, False otherwise
+ *
+ * @note The stored request is invalidated, so it is acted upon only once
+ ******************************************************************************/
+bool handoff_take_update_request(handoff_update_request_t* request) {
+    handoff_update_request_t* stored = &records.update_request;
+
+    bool valid = stored->magic == HANDOFF_UPDATE_REQUEST_MAGIC;
+    valid &= stored->check == handoff_compute_check((const uint32_t*)stored,
+        UPDATE_REQUEST_CHECK_WORDS);
+
+    if (valid) {
+        *request = *stored;
+    }
+
+    stored->magic = 0;
+    stored->check = 0;
+
+    return valid;
+}
+
+/*******************************************************************************
+ * @brief Describe the system state the application will start in
+ *
+ * @param flags HANDOFF_FLAG_* bits for peripherals left configured
+ * @param cpu_freq The core clock frequency left configured, in Hz
+ * @param jump_cycles The DWT cycle count at the time of the jump
+ *
+ * @note Called by the bootloader immediately before jumping to the application
+ ******************************************************************************/
+void handoff_set_boot_info(uint32_t flags, uint32_t cpu_freq,
+    uint32_t jump_cycles) {
+    handoff_boot_info_t* info = &records.boot_info;
+
+    info->magic       = HANDOFF_BOOT_INFO_MAGIC;
+    info->flags       = flags;
+    info->cpu_freq    = cpu_freq;
+    info->jump_cycles = jump_cycles;
+    info->check       = handoff_compute_check((const uint32_t*)info,
+        BOOT_INFO_CHECK_WORDS);
+}
+
+/*******************************************************************************
+ * @brief Consume the boot info left by the bootloader, if any
+ *
+ * @param info Pointer to copy the boot info into
+ * @return True if valid boot info was present, False if the application was
+ *         started some other way and must bring up the system itself
+ ******************************************************************************/
+bool handoff_take_boot_info(handoff_boot_info_t* info) {
+    handoff_boot_info_t* stored = &records.boot_info;
+
+    bool valid = stored->magic == HANDOFF_BOOT_INFO_MAGIC;
+    valid &= stored->check == handoff_compute_check((const uint32_t*)stored,
+        BOOT_INFO_CHECK_WORDS);
+
+    if (valid) {
+        *info = *stored;
+    }
+
+    stored->magic = 0;
+    stored->check = 0;
+
+    return valid;
+}
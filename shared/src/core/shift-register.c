@@ -4,15 +4,37 @@
  *
  * @brief  Shift register implementation for controlling debug LEDs
  *         using SPI1 peripheral & SN74HC595 shift register on STM32F446RE 
+ * 
+ * @note   Patterns are sent out by DMA and latched from the DMA interrupt, so
+ *         setting a pattern never waits on the SPI bus
  ******************************************************************************/
 
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/spi.h>
+#include <libopencm3/stm32/dma.h>
+#include <libopencm3/cm3/nvic.h> // dma2_stream2_isr
+#include <libopencm3/cm3/cortex.h> // interrupt masking
 
 #include "common.h"
 #include "core/shift-register.h"
-#include "core/system.h"
+
+// SPI1 requests on DMA2, channel 3 for both streams (RM0390 table 29)
+#define SR_DMA            (DMA2)
+#define SR_DMA_CHANNEL    (DMA_SxCR_CHSEL_3)
+#define SR_DMA_TX_STREAM  (DMA_STREAM3)
+#define SR_DMA_RX_STREAM  (DMA_STREAM2)
+#define SR_DMA_RX_IRQ     (NVIC_DMA2_STREAM2_IRQ)
+
+// devices in chain order, the first one being wired to MOSI
+static const ShiftRegister8_t* chain[SHIFT_REGISTER_MAX_CHAIN_LENGTH] = {0U};
+static uint8_t chain_length = 0;
+
+static uint8_t tx_buffer[SHIFT_REGISTER_MAX_CHAIN_LENGTH] = {0U};
+static uint8_t rx_discard = 0; // received bytes only mark the transfer's end
+
+static volatile bool transfer_busy = false;
+static volatile bool transfer_pending = false; // patterns changed meanwhile
 
 /*******************************************************************************
  * @brief Initializes the SPI peripheral
@@ -57,56 +79,153 @@ static void spi1_setup(const ShiftRegister8_t *sr) {
     spi_enable_software_slave_management(SPI1);
     spi_set_nss_high(SPI1); // set NSS pin high
 
+    // transmit requests feed the data register, receive requests only tell
+    // when the last bit has been clocked out
+    spi_enable_rx_dma(SPI1);
+    spi_enable_tx_dma(SPI1);
+
     spi_enable(SPI1); // enable SPI1 peripheral
 }
 
 /*******************************************************************************
- * @brief public interface for SP1 setup
+ * @brief Initializes the DMA streams moving shift register data to SPI1
+ ******************************************************************************/
+static void dma_setup(void) {
+    rcc_periph_clock_enable(RCC_DMA2);
+
+    dma_stream_reset(SR_DMA, SR_DMA_TX_STREAM);
+    dma_channel_select(SR_DMA, SR_DMA_TX_STREAM, SR_DMA_CHANNEL);
+    dma_set_transfer_mode(SR_DMA, SR_DMA_TX_STREAM, 
+        DMA_SxCR_DIR_MEM_TO_PERIPHERAL);
+    dma_set_peripheral_address(SR_DMA, SR_DMA_TX_STREAM, 
+        (uint32_t)&SPI_DR(SPI1));
+    dma_set_memory_address(SR_DMA, SR_DMA_TX_STREAM, (uint32_t)tx_buffer);
+    dma_set_peripheral_size(SR_DMA, SR_DMA_TX_STREAM, DMA_SxCR_PSIZE_8BIT);
+    dma_set_memory_size(SR_DMA, SR_DMA_TX_STREAM, DMA_SxCR_MSIZE_8BIT);
+    dma_enable_memory_increment_mode(SR_DMA, SR_DMA_TX_STREAM);
+    dma_set_priority(SR_DMA, SR_DMA_TX_STREAM, DMA_SxCR_PL_LOW);
+
+    dma_stream_reset(SR_DMA, SR_DMA_RX_STREAM);
+    dma_channel_select(SR_DMA, SR_DMA_RX_STREAM, SR_DMA_CHANNEL);
+    dma_set_transfer_mode(SR_DMA, SR_DMA_RX_STREAM, 
+        DMA_SxCR_DIR_PERIPHERAL_TO_MEM);
+    dma_set_peripheral_address(SR_DMA, SR_DMA_RX_STREAM, 
+        (uint32_t)&SPI_DR(SPI1));
+    dma_set_memory_address(SR_DMA, SR_DMA_RX_STREAM, (uint32_t)&rx_discard);
+    dma_set_peripheral_size(SR_DMA, SR_DMA_RX_STREAM, DMA_SxCR_PSIZE_8BIT);
+    dma_set_memory_size(SR_DMA, SR_DMA_RX_STREAM, DMA_SxCR_MSIZE_8BIT);
+    dma_set_priority(SR_DMA, SR_DMA_RX_STREAM, DMA_SxCR_PL_LOW);
+    dma_enable_transfer_complete_interrupt(SR_DMA, SR_DMA_RX_STREAM);
+
+    nvic_enable_irq(SR_DMA_RX_IRQ);
+}
+
+/*******************************************************************************
+ * @brief Send the state of every chained shift register in one DMA transfer
  * 
- * @param sr Pointer to the structure containing shift register configuration
- *****************************************************************************/
-void shift_register_setup(const ShiftRegister8_t *sr) {
-    spi1_setup(sr); // setup SPI peripheral for shift register communication
+ * @note Must be called with the DMA idle and interrupts masked
+ ******************************************************************************/
+static void start_transfer(void) {
+    // the first byte out ends up in the device furthest down the chain
+    for (uint8_t i = 0; i < chain_length; ++i) {
+        tx_buffer[i] = chain[chain_length - 1 - i]->led_state;
+    }
+
+    transfer_busy = true;
+    transfer_pending = false;
+
+    dma_set_number_of_data(SR_DMA, SR_DMA_RX_STREAM, chain_length);
+    dma_set_number_of_data(SR_DMA, SR_DMA_TX_STREAM, chain_length);
+    dma_enable_stream(SR_DMA, SR_DMA_RX_STREAM);
+    dma_enable_stream(SR_DMA, SR_DMA_TX_STREAM);
 }
 
 /*******************************************************************************
- * @brief reset SPI peripheral and relevant GPIO to default known state
+ * @brief DMA interrupt, fired once the last byte of a transfer has been 
+ *        clocked out, latching it into the shift registers
  ******************************************************************************/
-void shift_register_teardown(void) {
-    spi_disable(SPI1); // disable SPI1 peripheral
-    rcc_periph_reset_pulse(RST_SPI1); // reset SPI1 peripheral
-    rcc_periph_clock_disable(RCC_SPI1); // disable rcc for SPI1
-    gpio_mode_setup(SR1_PORT, GPIO_MODE_INPUT, GPIO_PUPD_NONE, 
-        SR1_DATA_PIN | SR1_CLOCK_PIN | SR1_LATCH_PIN); // set pins to input mode
+void dma2_stream2_isr(void) {
+    if (!dma_get_interrupt_flag(SR_DMA, SR_DMA_RX_STREAM, DMA_TCIF)) {
+        return;
+    }
+    dma_clear_interrupt_flags(SR_DMA, SR_DMA_RX_STREAM, DMA_TCIF);
+    dma_clear_interrupt_flags(SR_DMA, SR_DMA_TX_STREAM, DMA_TCIF);
 
-    // rcc_periph_clock_disable(RCC_GPIOB);
+    // pulse the shared latch, well above the SN74HC595's minimum pulse width
+    const ShiftRegister8_t* first = chain[0];
+    gpio_set(first->gpio_port, first->rclk_pin);
+    gpio_clear(first->gpio_port, first->rclk_pin);
+
+    // patterns set during the transfer go out straight away
+    if (transfer_pending) {
+        start_transfer();
+    } else {
+        transfer_busy = false;
+    }
 }
 
 /*******************************************************************************
- * @brief Shift out a byte of data to the debug LEDs using SPI
+ * @brief public interface for SP1 setup
  * 
  * @param sr Pointer to the structure containing shift register configuration
- * @param data The byte of data to send to the shift register
+ * @return True if the shift register was added, False if the chain is full
+ * 
+ * @note The first shift register set up is the one wired to SPI1, and owns the
+ *       latch pin. Each one after is chained from the QH' output of the last,
+ *       and is sent out in the same transfer.
+ *****************************************************************************/
+bool shift_register_setup(const ShiftRegister8_t *sr) {
+    if (chain_length >= SHIFT_REGISTER_MAX_CHAIN_LENGTH) {
+        return false;
+    }
+
+    if (chain_length == 0) {
+        spi1_setup(sr); // setup SPI peripheral for shift register communication
+        dma_setup();
+    }
+
+    chain[chain_length++] = sr;
+
+    return true;
+}
+
+/*******************************************************************************
+ * @brief Check if a shift register transfer is still in progress
+ * 
+ * @return True if patterns are still being sent out, False otherwise
  ******************************************************************************/
-static void debug_led_shift_out_spi(ShiftRegister8_t *sr, uint8_t data) {
-    // set latch pin low to prepare for data transfer
-    gpio_clear(sr->gpio_port, sr->rclk_pin);
+bool shift_register_busy(void) {
+    return transfer_busy;
+}
 
-    while (!(SPI_SR(SPI1) & SPI_SR_TXE)); // wait until transmit buffer is empty
-    spi_send(SPI1, data); // send data byte over SPI
-    while (!(SPI_SR(SPI1) & SPI_SR_TXE)); // wait until transmit buffer is empty
-    while (SPI_SR(SPI1) & SPI_SR_BSY); // wait until SPI is not busy
+/*******************************************************************************
+ * @brief Wait until every pattern set so far has been latched
+ ******************************************************************************/
+void shift_register_flush(void) {
+    while (transfer_busy) {
+        // wait for the DMA interrupt to latch the last transfer
+    }
+}
 
-    // set latch pin high to latch data into shift register
-    gpio_set(sr->gpio_port, sr->rclk_pin); 
+/*******************************************************************************
+ * @brief reset SPI peripheral and relevant GPIO to default known state
+ ******************************************************************************/
+void shift_register_teardown(void) {
+    shift_register_flush(); // let the last pattern reach the LEDs
 
-    system_delay(1); // small delay to ensure data is latched
+    nvic_disable_irq(SR_DMA_RX_IRQ);
+    dma_stream_reset(SR_DMA, SR_DMA_TX_STREAM);
+    dma_stream_reset(SR_DMA, SR_DMA_RX_STREAM);
+    rcc_periph_clock_disable(RCC_DMA2);
+    chain_length = 0;
 
-    // set latch pin low again to prepare for next data transfer
-    gpio_clear(sr->gpio_port, sr->rclk_pin); 
+    spi_disable(SPI1); // disable SPI1 peripheral
+    rcc_periph_reset_pulse(RST_SPI1); // reset SPI1 peripheral
+    rcc_periph_clock_disable(RCC_SPI1); // disable rcc for SPI1
+    gpio_mode_setup(SR1_PORT, GPIO_MODE_INPUT, GPIO_PUPD_NONE, 
+        SR1_DATA_PIN | SR1_CLOCK_PIN | SR1_LATCH_PIN); // set pins to input mode
 
-    // update the led_state in the ShiftRegister8_t structure
-    sr->led_state = data; 
+    // rcc_periph_clock_disable(RCC_GPIOB);
 }
 
 /*******************************************************************************
@@ -115,17 +234,29 @@ static void debug_led_shift_out_spi(ShiftRegister8_t *sr, uint8_t data) {
  * @param sr Pointer to the structure containing shift register configuration
  * @param pattern The byte pattern to set in the shift register 
  *        (e.g., 0xFF for all LEDs on)
+ * 
+ * @note Returns without waiting for the pattern to be sent. Patterns set while
+ *       a transfer is in progress are sent together in the next one, so the 
+ *       LEDs always end up showing the latest pattern of every device.
  ******************************************************************************/
 void shift_register_set_pattern(ShiftRegister8_t *sr, uint8_t pattern) {
 
     if (sr->led_state == pattern) {
         return; // no change in pattern, do nothing
     }
-    // Shift out the pattern to the shift register
-    debug_led_shift_out_spi(sr, pattern);
-    
-    // Update the led_state in the SR8_t structure
-    // sr->led_state = pattern;
+    sr->led_state = pattern;
+
+    if (chain_length == 0) {
+        return; // not set up, nothing to send to
+    }
+
+    uint32_t was_masked = cm_mask_interrupts(1);
+    if (transfer_busy) {
+        transfer_pending = true;
+    } else {
+        start_transfer();
+    }
+    cm_mask_interrupts(was_masked);
 }
 
 /*******************************************************************************
@@ -10,16 +10,27 @@
 
 /*******************************************************************************
  * @brief Initialize the values of a simple_timer_t object
- * @param timer Description of the first parameter.
- * @param wait_time Description of the second parameter.
- * @param auto_reset Description of the third parameter.
+ * @param timer Pointer to the simple_timer_t object to initialize
+ * @param wait_time Time until the timer expires, in milliseconds
+ * @param auto_reset Whether the timer restarts itself after expiring
  ******************************************************************************/
 void simple_timer_setup(simple_timer_t* timer, uint64_t wait_time, bool auto_reset) {
+    simple_timer_setup_us(timer, wait_time * 1000U, auto_reset);
+}
+
+/*******************************************************************************
+ * @brief Initialize the values of a simple_timer_t object with microsecond 
+ *        resolution
+ * @param timer Pointer to the simple_timer_t object to initialize
+ * @param wait_time Time until the timer expires, in microseconds
+ * @param auto_reset Whether the timer restarts itself after expiring
+ ******************************************************************************/
+void simple_timer_setup_us(simple_timer_t* timer, uint64_t wait_time, bool auto_reset) {
     timer->wait_time = wait_time;
     timer->auto_reset = auto_reset;
     timer->expired = false;
     
-    timer->target_time = system_get_ticks() + wait_time;
+    timer->target_time = system_get_micros() + wait_time;
 }
 
 /*******************************************************************************
@@ -29,7 +40,7 @@ void simple_timer_setup(simple_timer_t* timer, uint64_t wait_time, bool auto_res
  * @return True if the timer has expired, False otherwise
  ******************************************************************************/
 bool simple_timer_check_has_expired(simple_timer_t* timer) {
-    uint64_t now = system_get_ticks();
+    uint64_t now = system_get_micros();
     bool has_expired = now >= timer->target_time; // check if past target time
 
     if (timer->expired) {
@@ -52,6 +63,6 @@ bool simple_timer_check_has_expired(simple_timer_t* timer) {
  * @brief Reset the timer to its initial state
  ******************************************************************************/
 void simple_timer_reset(simple_timer_t* timer) {
-    simple_timer_setup(timer, timer->wait_time, timer->auto_reset);
+    simple_timer_setup_us(timer, timer->wait_time, timer->auto_reset);
 }
 
@@ -2,49 +2,188 @@
  * @file   system.c
  * @author Camille Alexandra
  *
- * @brief  Contains implementation for implementing various system-level 
- *         peripherals, such as RCC, GPIO, SYSTICK
+ * @brief  Contains implementation for implementing various system-level
+ *         peripherals, such as RCC, GPIO and the system time base
  ******************************************************************************/
 
 #include <libopencm3/stm32/rcc.h> // rcc_clock, rcc_periph
 #include <libopencm3/stm32/gpio.h>
-#include <libopencm3/cm3/systick.h>
-#include <libopencm3/cm3/nvic.h> // sys_tick_handler
+#include <libopencm3/stm32/timer.h>
+#include <libopencm3/stm32/flash.h> // ART accelerator
+#include <libopencm3/stm32/pwr.h> // over-drive
+#include <libopencm3/cm3/nvic.h> // tim5_isr
+#include <libopencm3/cm3/dwt.h> // cycle counter
+#include <libopencm3/cm3/cortex.h> // interrupt masking
 
 #include "common.h"
 #include "core/system.h"
 
-static volatile uint64_t ticks = 0;
+#define TIMEBASE_TIMER   (TIM5) // one of the two 32-bit timers on the F446
+#define TIMEBASE_FREQ    (1000000U) // 1MHz, one count per microsecond
+
+// upper 32 bits of the microsecond time base, the timer holds the lower 32
+static volatile uint32_t timebase_overflows = 0;
+
+#ifdef SYSTEM_CLOCK_TURBO
+// 3.3v supply, 180MHz from the internal oscillator, APB1 at 45MHz and APB2 at
+// 90MHz, five flash wait states
+static const struct rcc_clock_scale* clock_config =
+    &rcc_hsi_configs[RCC_CLOCK_3V3_180MHZ];
+#else
+// 3.3v supply, 84MHz from the internal oscillator
+static const struct rcc_clock_scale* clock_config =
+    &rcc_hsi_configs[RCC_CLOCK_3V3_84MHZ];
+#endif
+
+/*******************************************************************************
+ * @brief this function is called whenever the time base timer wraps around,
+ *        which at 1MHz happens roughly every 71 minutes, or when a wake-up 
+ *        deadline set by system_sleep_until() is reached
+ ******************************************************************************/
+void tim5_isr(void) {
+    if (timer_get_flag(TIMEBASE_TIMER, TIM_SR_UIF)) {
+        timer_clear_flag(TIMEBASE_TIMER, TIM_SR_UIF);
+        ++timebase_overflows;
+    }
+
+    if (timer_get_flag(TIMEBASE_TIMER, TIM_SR_CC1IF)) {
+        // waking the core was the whole point, nothing else to do
+        timer_clear_flag(TIMEBASE_TIMER, TIM_SR_CC1IF);
+        timer_disable_irq(TIMEBASE_TIMER, TIM_DIER_CC1IE);
+    }
+}
 
 /*******************************************************************************
- * @brief this function is called whenever the systick interrupt occurs
+ * @brief Returns the time since system_setup() in microseconds
+ *
+ * @note  Safe against the counter wrapping between reading its two halves,
+ *        including while interrupts are masked and the wrap is not yet counted
  ******************************************************************************/
-void sys_tick_handler(void) {
-    ++ticks;
+uint64_t system_get_micros(void) {
+    uint32_t high;
+    uint32_t low;
+    bool wrap_pending;
+
+    do {
+        high = timebase_overflows;
+        low = TIM_CNT(TIMEBASE_TIMER);
+        wrap_pending = (TIM_SR(TIMEBASE_TIMER) & TIM_SR_UIF) != 0;
+
+        // the wrap may have happened after low was sampled, so sample again
+        if (wrap_pending) {
+            low = TIM_CNT(TIMEBASE_TIMER);
+        }
+    } while (high != timebase_overflows); // interrupted by the wrap, retry
+
+    if (wrap_pending) {
+        ++high;
+    }
+
+    return ((uint64_t)high << 32) | low;
 }
 
 /*******************************************************************************
- * @brief Returns the current system ticks
+ * @brief Returns the current system ticks, in milliseconds
  ******************************************************************************/
 uint64_t system_get_ticks(void) {
-    return ticks;
+    return system_get_micros() / 1000U;
 }
 
+#ifdef SYSTEM_CLOCK_TURBO
+/*******************************************************************************
+ * @brief Brings the PLL up to 180MHz, as rcc_clock_setup_pll() does but with
+ *        the regulator's over-drive mode, which the F446 needs above 168MHz
+ *
+ * @note  Over-drive can only be switched on once the PLL is running, and must
+ *        be ready before the system clock moves onto it (RM0390 5.1.4)
+ ******************************************************************************/
+static void rcc_setup(void) {
+    rcc_osc_on(RCC_HSI);
+    rcc_wait_for_osc_ready(RCC_HSI);
+    rcc_set_sysclk_source(RCC_CFGR_SW_HSI);
+
+    rcc_periph_clock_enable(RCC_PWR);
+    pwr_set_vos_scale(clock_config->voltage_scale);
+
+    rcc_set_hpre(clock_config->hpre);
+    rcc_set_ppre1(clock_config->ppre1);
+    rcc_set_ppre2(clock_config->ppre2);
+
+    rcc_osc_off(RCC_PLL);
+    rcc_set_main_pll_hsi(clock_config->pllm, clock_config->plln,
+        clock_config->pllp, clock_config->pllq, clock_config->pllr);
+    rcc_osc_on(RCC_PLL);
+    rcc_wait_for_osc_ready(RCC_PLL);
+
+    PWR_CR |= PWR_CR_ODEN;
+    while ((PWR_CSR & PWR_CSR_ODRDY) == 0) {
+        // wait for the regulator
+    }
+    PWR_CR |= PWR_CR_ODSWEN;
+    while ((PWR_CSR & PWR_CSR_ODSWRDY) == 0) {
+        // wait for the switch over
+    }
+
+    // ART accelerator: instruction and data caches plus prefetch, so that the
+    // five wait states are mostly hidden
+    flash_icache_enable();
+    flash_dcache_enable();
+    flash_prefetch_enable();
+    flash_set_ws(clock_config->flash_config);
+
+    rcc_set_sysclk_source(RCC_CFGR_SW_PLL);
+    rcc_wait_for_sysclk_status(RCC_PLL);
+
+    rcc_ahb_frequency = clock_config->ahb_frequency;
+    rcc_apb1_frequency = clock_config->apb1_frequency;
+    rcc_apb2_frequency = clock_config->apb2_frequency;
+}
+#else
 /*******************************************************************************
  * @brief sets up reset and clock control for the system
  ******************************************************************************/
 static void rcc_setup(void) {
-    // Set 3.3v clock to 84MHz
-    rcc_clock_setup_pll(&rcc_hsi_configs[RCC_CLOCK_3V3_84MHZ]);
+    rcc_clock_setup_pll(clock_config);
 }
+#endif
 
 /*******************************************************************************
- * @brief Sets up the SYSTICK timer to generate interrupts at a given frequency
+ * @brief Returns the clock feeding timers on the APB1 bus, from which their
+ *        prescalers should be worked out rather than assuming a clock profile
+ *
+ * @note  Timers run at twice the bus clock whenever the bus is divided down
+ *        from the AHB clock
  ******************************************************************************/
-static void systick_setup(void) {
-    systick_set_frequency(SYSTICK_FREQ, CPU_FREQ); // 1000 / sec
-    systick_counter_enable();
-    systick_interrupt_enable();
+uint32_t system_get_apb1_timer_frequency(void) {
+    if (rcc_apb1_frequency == rcc_ahb_frequency) {
+        return rcc_apb1_frequency;
+    }
+
+    return rcc_apb1_frequency * 2U;
+}
+
+/*******************************************************************************
+ * @brief Sets up a free-running 32-bit timer counting microseconds
+ *
+ * @note  Unlike a periodic tick, this only interrupts the CPU when the counter
+ *        wraps, leaving time-critical loops undisturbed
+ ******************************************************************************/
+static void timebase_setup(void) {
+    rcc_periph_clock_enable(RCC_TIM5);
+    rcc_periph_reset_pulse(RST_TIM5);
+
+    timer_set_prescaler(TIMEBASE_TIMER,
+        (system_get_apb1_timer_frequency() / TIMEBASE_FREQ) - 1);
+    timer_set_period(TIMEBASE_TIMER, 0xFFFFFFFFU);
+
+    // load the prescaler now rather than at the first wrap
+    timer_generate_event(TIMEBASE_TIMER, TIM_EGR_UG);
+    timer_clear_flag(TIMEBASE_TIMER, TIM_SR_UIF);
+    timebase_overflows = 0;
+
+    timer_enable_irq(TIMEBASE_TIMER, TIM_DIER_UIE);
+    nvic_enable_irq(NVIC_TIM5_IRQ);
+    timer_enable_counter(TIMEBASE_TIMER);
 }
 
 /*******************************************************************************
@@ -52,28 +191,100 @@ static void systick_setup(void) {
  ******************************************************************************/
 void system_setup(void) {
     rcc_setup();
-    systick_setup();
+    timebase_setup();
+    dwt_enable_cycle_counter();
 }
 
-/******************************************************************************* 
+/*******************************************************************************
+ * @brief Initializes the system peripherals, adopting the clock configuration
+ *        left running by the bootloader rather than bringing up the PLL again
+ ******************************************************************************/
+void system_setup_preconfigured(void) {
+    // the PLL already runs, only libopencm3's record of bus clocks is missing
+    rcc_ahb_frequency = clock_config->ahb_frequency;
+    rcc_apb1_frequency = clock_config->apb1_frequency;
+    rcc_apb2_frequency = clock_config->apb2_frequency;
+
+    timebase_setup();
+    dwt_enable_cycle_counter();
+}
+
+/*******************************************************************************
+ * @brief Returns the free-running core cycle counter, which keeps counting
+ *        across the jump from bootloader to application
+ ******************************************************************************/
+uint32_t system_get_cycles(void) {
+    return dwt_read_cycle_counter();
+}
+
+/*******************************************************************************
  * @brief Delays the whole system for a given number of milliseconds
- * 
+ *
  * @param milliseconds The number of milliseconds to delay the system
  ******************************************************************************/
 void system_delay(uint64_t milliseconds) {
-    uint64_t start_time = system_get_ticks();
-    while ((system_get_ticks() - start_time) < milliseconds) {
+    system_delay_us(milliseconds * 1000U);
+}
+
+/*******************************************************************************
+ * @brief Delays the whole system for a given number of microseconds
+ *
+ * @param microseconds The number of microseconds to delay the system
+ ******************************************************************************/
+void system_delay_us(uint64_t microseconds) {
+    uint64_t start_time = system_get_micros();
+    while ((system_get_micros() - start_time) < microseconds) {
         // do nothing
-        // can't be optimized out because the ticks are volatile
+        // can't be optimized out because the timer registers are volatile
     }
 }
 
+/*******************************************************************************
+ * @brief Puts the core to sleep until a deadline passes or an interrupt fires
+ *
+ * @param deadline Time to wake up at, in microseconds, as system_get_micros()
+ * @param work_pending Optional check for work signalled by interrupts. It is
+ *        made with interrupts masked, so an interrupt arriving after it still
+ *        ends the sleep rather than being missed until the deadline.
+ ******************************************************************************/
+void system_sleep_until(uint64_t deadline, bool (*work_pending)(void)) {
+    cm_disable_interrupts(); // a pending interrupt still wakes from WFI
+
+    if (work_pending && work_pending()) {
+        cm_enable_interrupts();
+        return;
+    }
+
+    // the compare sees only the low word, so it is armed for deadlines less
+    // than one counter period away: in this period, or in the next one below
+    // where the counter is now. Anything later wakes at a wrap interrupt
+    // first, at most one period (~71.6 minutes) early, and sleeps again
+    uint64_t now = system_get_micros();
+    uint32_t now_high = (uint32_t)(now >> 32);
+    uint32_t deadline_high = (uint32_t)(deadline >> 32);
+    if (deadline_high == now_high || (deadline_high == now_high + 1U
+        && (uint32_t)deadline < (uint32_t)now)) {
+        TIM_CCR1(TIMEBASE_TIMER) = (uint32_t)deadline;
+        timer_clear_flag(TIMEBASE_TIMER, TIM_SR_CC1IF);
+        timer_enable_irq(TIMEBASE_TIMER, TIM_DIER_CC1IE);
+    }
+
+    // the compare only matches if the counter has yet to reach it
+    if (system_get_micros() < deadline) {
+        __asm__ volatile ("wfi");
+    }
+
+    timer_disable_irq(TIMEBASE_TIMER, TIM_DIER_CC1IE);
+    cm_enable_interrupts();
+}
+
 /*******************************************************************************
  * @brief resets system peripherals to a known state
  ******************************************************************************/
 void system_teardown(void) {
-    systick_interrupt_disable();
-    systick_counter_disable();
-    systick_clear();
+    nvic_disable_irq(NVIC_TIM5_IRQ);
+    timer_disable_counter(TIMEBASE_TIMER);
+    rcc_periph_reset_pulse(RST_TIM5);
+    rcc_periph_clock_disable(RCC_TIM5);
     // rcc_periph_clock_disable(&rcc_hsi_configs[RCC_CLOCK_3V3_84MHZ]);
-}
\ No newline at end of file
+}
@@ -0,0 +1,121 @@
+/*******************************************************************************
+ * @file   task-scheduler.c
+ * @author Camille Alexandra
+ *
+ * @brief  Cooperative task scheduler. Tasks run to completion, in the order 
+ *         they were added, whenever they have pending events. Events are raised
+ *         by interrupts through task_signal(), or periodically by a timer. 
+ *         When no task has work the core sleeps until the next timer is due.
+ ******************************************************************************/
+
+#include <libopencm3/cm3/cortex.h> // interrupt masking
+
+#include "core/task-scheduler.h"
+#include "core/timer-scheduler.h"
+
+static task_t* tasks[TASK_SCHEDULER_MAX_TASKS] = {0U};
+static uint32_t task_count = 0;
+
+/*******************************************************************************
+ * @brief Timer callback raising the periodic wake-up event of a task
+ * 
+ * @param context Pointer to the task_t to wake
+ ******************************************************************************/
+static void task_wake(void* context) {
+    task_signal((task_t*)context, TASK_EVENT_WAKE);
+}
+
+/*******************************************************************************
+ * @brief Register a task with the scheduler
+ * 
+ * @param task Pointer to the task, which must remain valid while scheduled
+ * @param function Function run whenever the task has pending events
+ * @param context Passed to function
+ * @param period_ms Period of the TASK_EVENT_WAKE event in milliseconds, or 0 
+ *        for a task woken only through task_signal()
+ * @return True if the task was added, False if the scheduler is full
+ ******************************************************************************/
+bool task_scheduler_add(task_t* task, task_function_t function, 
+    void* context, uint64_t period_ms) {
+    if (task_count >= TASK_SCHEDULER_MAX_TASKS) {
+        return false;
+    }
+
+    task->function = function;
+    task->context = context;
+    task->events = 0;
+
+    if (period_ms > 0) {
+        simple_timer_setup(&task->wake_timer, period_ms, true);
+        if (!timer_scheduler_add(&task->wake_timer, task_wake, task)) {
+            return false;
+        }
+    }
+
+    tasks[task_count++] = task;
+
+    return true;
+}
+
+/*******************************************************************************
+ * @brief Raise events for a task, to be handled the next time it runs
+ * 
+ * @param task Pointer to the task to signal
+ * @param events Event bits to raise
+ * 
+ * @note Safe to call from interrupt handlers
+ ******************************************************************************/
+void task_signal(task_t* task, uint32_t events) {
+    uint32_t was_masked = cm_mask_interrupts(1);
+    task->events |= events;
+    cm_mask_interrupts(was_masked);
+}
+
+/*******************************************************************************
+ * @brief Check whether any task has pending events
+ * 
+ * @return True if a task is ready to run, False otherwise
+ ******************************************************************************/
+bool task_scheduler_work_pending(void) {
+    for (uint32_t i = 0; i < task_count; ++i) {
+        if (tasks[i]->events) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*******************************************************************************
+ * @brief Run one pass of the scheduler: raise due timer events, then run every 
+ *        task with pending events once, in the order the tasks were added
+ ******************************************************************************/
+void task_scheduler_run_once(void) {
+    timer_scheduler_dispatch();
+
+    for (uint32_t i = 0; i < task_count; ++i) {
+        task_t* task = tasks[i];
+
+        // take the events atomically, so none raised meanwhile are lost
+        uint32_t was_masked = cm_mask_interrupts(1);
+        uint32_t events = task->events;
+        task->events = 0;
+        cm_mask_interrupts(was_masked);
+
+        if (events) {
+            task->function(events, task->context);
+        }
+    }
+}
+
+/*******************************************************************************
+ * @brief Run the scheduler forever, sleeping whenever no task has work
+ * 
+ * @note Does not return
+ ******************************************************************************/
+void task_scheduler_run(void) {
+    while (1) {
+        task_scheduler_run_once();
+        timer_scheduler_sleep(task_scheduler_work_pending);
+    }
+}
@@ -0,0 +1,175 @@
+/*******************************************************************************
+ * @file   timer-scheduler.c
+ * @author Camille Alexandra
+ *
+ * @brief  Deadline scheduler for simple_timer_t objects. Timers are kept in a
+ *         min-heap ordered by expiry, so the earliest deadline is always known
+ *         without polling every timer, and callbacks fire from one place.
+ ******************************************************************************/
+
+#include "core/timer-scheduler.h"
+#include "core/system.h"
+
+static simple_timer_t* heap[TIMER_SCHEDULER_MAX_TIMERS] = {0U};
+static uint32_t heap_size = 0;
+
+/*******************************************************************************
+ * @brief Swap two entries of the heap
+ ******************************************************************************/
+static void heap_swap(uint32_t a, uint32_t b) {
+    simple_timer_t* temp = heap[a];
+    heap[a] = heap[b];
+    heap[b] = temp;
+}
+
+/*******************************************************************************
+ * @brief Move an entry towards the root until its parent expires earlier
+ ******************************************************************************/
+static void heap_sift_up(uint32_t index) {
+    while (index > 0) {
+        uint32_t parent = (index - 1) / 2;
+        if (heap[parent]->target_time <= heap[index]->target_time) {
+            break;
+        }
+        heap_swap(parent, index);
+        index = parent;
+    }
+}
+
+/*******************************************************************************
+ * @brief Move an entry towards the leaves until both children expire later
+ ******************************************************************************/
+static void heap_sift_down(uint32_t index) {
+    while (1) {
+        uint32_t left = (2 * index) + 1;
+        uint32_t right = left + 1;
+        uint32_t earliest = index;
+
+        if (left < heap_size
+            && heap[left]->target_time < heap[earliest]->target_time) {
+            earliest = left;
+        }
+        if (right < heap_size
+            && heap[right]->target_time < heap[earliest]->target_time) {
+            earliest = right;
+        }
+        if (earliest == index) {
+            break;
+        }
+        heap_swap(index, earliest);
+        index = earliest;
+    }
+}
+
+/*******************************************************************************
+ * @brief Remove the entry at a given heap index, keeping the heap ordered
+ ******************************************************************************/
+static void heap_remove_at(uint32_t index) {
+    heap_size--;
+    if (index == heap_size) {
+        return;
+    }
+
+    heap[index] = heap[heap_size];
+    heap_sift_up(index);
+    heap_sift_down(index);
+}
+
+/*******************************************************************************
+ * @brief Register a timer to have its callback fired when it expires
+ *
+ * @param timer Pointer to a timer already set up with simple_timer_setup()
+ * @param callback Function to call from timer_scheduler_dispatch() on expiry
+ * @param context Passed to callback
+ * @return True if the timer was added, False if the scheduler is full or the
+ *         timer auto resets with no wait time, which would always be due
+ *
+ * @note Auto reset timers stay scheduled, others are removed once they fire
+ ******************************************************************************/
+bool timer_scheduler_add(simple_timer_t* timer,
+    simple_timer_callback_t callback, void* context) {
+    if (heap_size >= TIMER_SCHEDULER_MAX_TIMERS) {
+        return false;
+    }
+    if (timer->auto_reset && timer->wait_time == 0) {
+        return false;
+    }
+
+    timer->callback = callback;
+    timer->context = context;
+
+    heap[heap_size] = timer;
+    heap_sift_up(heap_size);
+    heap_size++;
+
+    return true;
+}
+
+/*******************************************************************************
+ * @brief Stop a timer from being scheduled, if it is
+ *
+ * @param timer Pointer to the timer to remove
+ ******************************************************************************/
+void timer_scheduler_remove(simple_timer_t* timer) {
+    for (uint32_t i = 0; i < heap_size; ++i) {
+        if (heap[i] == timer) {
+            heap_remove_at(i);
+            return;
+        }
+    }
+}
+
+/*******************************************************************************
+ * @brief Fire the callbacks of all timers which have expired
+ *
+ * @note  Callbacks run here, in the caller's context, and may add or remove
+ *        timers. A timer is re-armed or removed before its callback runs.
+ *        An auto reset timer which fell several periods behind, as across a
+ *        flash erase or a slow callback, fires once and skips the periods it
+ *        missed rather than firing back to back to catch up, staying in phase.
+ ******************************************************************************/
+void timer_scheduler_dispatch(void) {
+    uint64_t now = system_get_micros();
+
+    while (heap_size > 0 && heap[0]->target_time <= now) {
+        simple_timer_t* timer = heap[0];
+
+        if (timer->auto_reset) {
+            // the next period boundary after now, so it is not due again
+            uint64_t drift = now - timer->target_time;
+            timer->target_time += timer->wait_time 
+                * ((drift / timer->wait_time) + 1U);
+            heap_sift_down(0);
+        } else {
+            timer->expired = true;
+            heap_remove_at(0);
+        }
+
+        if (timer->callback) {
+            timer->callback(timer->context);
+        }
+    }
+}
+
+/*******************************************************************************
+ * @brief Returns the time at which the next timer expires, in microseconds
+ *
+ * @return The earliest deadline, or TIMER_SCHEDULER_NO_DEADLINE if none
+ ******************************************************************************/
+uint64_t timer_scheduler_next_deadline(void) {
+    if (heap_size == 0) {
+        return TIMER_SCHEDULER_NO_DEADLINE;
+    }
+
+    return heap[0]->target_time;
+}
+
+/*******************************************************************************
+ * @brief Sleep until the next timer expires or an interrupt brings new work
+ *
+ * @param work_pending Optional check for work signalled by interrupts, such as
+ *        uart_data_available(). Sleep is skipped if it returns true.
+ ******************************************************************************/
+void timer_scheduler_sleep(bool (*work_pending)(void)) {
+    system_sleep_until(timer_scheduler_next_deadline(), work_pending);
+}
@@ -0,0 +1,106 @@
+/*******************************************************************************
+ * @file   trace.c
+ * @author Camille Alexandra
+ *
+ * @brief  Ring of fixed-size binary event records, cheap enough to write from
+ *         anywhere including interrupts, kept in RAM across resets (.noinit)
+ ******************************************************************************/
+
+#include <libopencm3/cm3/cortex.h> // interrupt masking
+
+#include "common.h"
+#include "core/trace.h"
+#include "core/system.h"
+
+#define TRACE_MAGIC (0x54524345U) // "TRCE"
+
+typedef struct trace_ring_t {
+    uint32_t magic;   // TRACE_MAGIC once set up
+    uint32_t written; // records ever written
+    trace_record_t records[TRACE_LENGTH];
+} trace_ring_t;
+
+// placed right after the handoff records by both linker scripts, so the ring
+// carries on across the jump to the application and back through a reset
+__attribute__((section(".noinit.trace")))
+static trace_ring_t ring;
+
+static volatile bool frozen = false; // set while the ring is being read out
+
+/*******************************************************************************
+ * @brief Sets up the trace ring, keeping whatever survived a reset
+ * 
+ * @note  Records before the boot event come from before the reset, with 
+ *        timestamps from a cycle counter which has since restarted
+ ******************************************************************************/
+void trace_setup(void) {
+    bool survived = ring.magic == TRACE_MAGIC;
+
+    if (!survived) {
+        ring.written = 0;
+        ring.magic = TRACE_MAGIC;
+    }
+
+    frozen = false;
+    trace_event(TRACE_EVENT_BOOT, survived ? 1U : 0U, 0U);
+}
+
+/*******************************************************************************
+ * @brief Records an event, overwriting the oldest once the ring is full
+ * 
+ * @param event What happened, a trace_event_t
+ * @param arg0 First argument, see trace_event_t
+ * @param arg1 Second argument, see trace_event_t
+ * 
+ * @note  Safe from interrupts: the slot is claimed with interrupts masked, 
+ *        for the handful of instructions it takes to fill it
+ ******************************************************************************/
+void trace_event(uint8_t event, uint8_t arg0, uint16_t arg1) {
+    uint32_t timestamp = system_get_cycles();
+    uint32_t interrupts_masked = cm_mask_interrupts(1U);
+
+    if (!frozen) {
+        trace_record_t* record = 
+            &ring.records[ring.written & (TRACE_LENGTH - 1U)];
+        ring.written++;
+
+        record->timestamp = timestamp;
+        record->event = event;
+        record->arg0 = arg0;
+        record->arg1 = arg1;
+    }
+
+    cm_mask_interrupts(interrupts_masked);
+}
+
+/*******************************************************************************
+ * @brief Stops recording, so reading the ring out does not overwrite it
+ ******************************************************************************/
+void trace_freeze(void) {
+    frozen = true;
+}
+
+/*******************************************************************************
+ * @brief Returns the number of records held
+ ******************************************************************************/
+uint32_t trace_count(void) {
+    return ring.written < TRACE_LENGTH ? ring.written : TRACE_LENGTH;
+}
+
+/*******************************************************************************
+ * @brief Reads a record out of the ring
+ * 
+ * @param index Which record, 0 being the oldest held
+ * @param record Pointer to the record to fill in
+ * @return True if there is such a record, False otherwise
+ ******************************************************************************/
+bool trace_get(uint32_t index, trace_record_t* record) {
+    uint32_t count = trace_count();
+
+    if (index >= count) {
+        return false;
+    }
+
+    *record = ring.records[(ring.written - count + index) & (TRACE_LENGTH - 1U)];
+    return true;
+}
@@ -12,12 +12,15 @@
 #include "common.h"
 #include "core/uart.h"
 #include "core/ring-buffer.h"
+#include "core/trace.h"
 
 #define BAUD_RATE (115200)
 #define RING_BUFFER_SIZE (uint32_t)(256) // must be a power of 2
 
 static uint8_t data_buffer[RING_BUFFER_SIZE] = {0U};
 static ring_buffer_t rb = {0U};
+static uart_rx_callback_t rx_callback = 0;
+static volatile uart_stats_t stats = {0U}; // updated from usart1_isr()
 
 /*******************************************************************************
  * @brief USART1 interrupt service routine to write to ring buffer
@@ -26,10 +29,21 @@ void usart1_isr(void) {
     const bool overrun_occurred = usart_get_flag(USART1, USART_FLAG_ORE) == 1;
     const bool received_data = usart_get_flag(USART1, USART_FLAG_RXNE) == 1;
 
+    if (overrun_occurred) {
+        stats.overruns++;
+        trace_event(TRACE_EVENT_UART_OVERRUN, 0U, 0U);
+    }
+
     // when uart receives data, write a byte to the ring buffer
     if (received_data || overrun_occurred) {
+        stats.rx_bytes++;
         if(!ring_buffer_write(&rb, (uint8_t)usart_recv(USART1))) {
-            // buffer full, do something, handle failure
+            stats.rx_dropped++; // nothing to do but count it, the packet 
+                                // layer asks for the packet again
+        }
+
+        if (rx_callback) {
+            rx_callback();
         }
     }
 }
@@ -73,6 +87,27 @@ void uart_setup(void) {
     ring_buffer_setup(&rb, data_buffer, RING_BUFFER_SIZE);
 }
 
+/*******************************************************************************
+ * @brief Change the UART baud rate from the BAUD_RATE default
+ * 
+ * @param baud_rate The new baud rate, must be called after uart_setup()
+ ******************************************************************************/
+void uart_set_baud_rate(uint32_t baud_rate) {
+    usart_disable(USART1);
+    usart_set_baudrate(USART1, baud_rate);
+    usart_enable(USART1);
+}
+
+/*******************************************************************************
+ * @brief Set a function to be called from the UART interrupt whenever a byte 
+ *        is received, such as one waking the task reading the data
+ * 
+ * @param callback The function to call, or 0 for none
+ ******************************************************************************/
+void uart_set_rx_callback(uart_rx_callback_t callback) {
+    rx_callback = callback;
+}
+
 /*******************************************************************************
  * @brief reset UART peripheral and relevant GPIO to default known state
  ******************************************************************************/
@@ -102,6 +137,7 @@ void uart_send(uint8_t* data, const uint32_t length){
  ******************************************************************************/
 void uart_send_byte(uint8_t data) {
     usart_send_blocking(USART1, (uint16_t)data);
+    stats.tx_bytes++;
 }
 
 /******************************************************************************* 
@@ -146,3 +182,13 @@ uint8_t uart_receive_byte(void) {
 bool uart_data_available(void) {
     return !ring_buffer_empty(&rb);
 }
+
+/*******************************************************************************
+ * @brief Returns the UART counters, which run from uart_setup() onwards
+ * 
+ * @note  Counters are single words written only by their owner, so each 
+ *        reads consistently, though not all at the same instant
+ ******************************************************************************/
+const uart_stats_t* uart_get_stats(void) {
+    return (const uart_stats_t*)&stats;
+}